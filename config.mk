@@ -74,7 +74,9 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS = serial_server readline_server keyboard_server mmap_test
+STUDENTTESTS = serial_server readline_server keyboard_server mmap_test memstats_test shm_test \
+			   map_file_test priority_test spawn_test \
+			   time_test
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -114,7 +116,10 @@ SYSCALL_OBJS = sys_print.o set_status.o vanish.o deschedule.o sys_exec.o fork.o
 			   remove_pages.o set_cursor_pos.o set_term_color.o sleep.o \
 			   swexn.o task_vanish.o wait.o yield.o udriv_register.o \
 			   udriv_deregister.o udriv_send.o udriv_wait.o udriv_inb.o \
-			   udriv_outb.o udriv_mmap.o key_circular_buffer.o circular_buffer.o
+			   udriv_outb.o udriv_mmap.o memstats.o spawn.o key_circular_buffer.o \
+			   circular_buffer.o shm_create.o shm_attach.o shm_detach.o \
+			   map_file.o set_priority.o get_time_ns.o \
+			   sleep_ns.o
 
 ###########################################################################
 # Object files for your automatic stack handling
@@ -133,17 +138,18 @@ AUTOSTACK_OBJS = autostack.o
 #
 KERNEL_OBJS = kernel.o loader/loader.o list/list.o drivers/console/console.o \
 			  drivers/console/console_util.o drivers/timer/timer.o drivers/timer/timer_handler.o \
+			  drivers/timer/tsc.o \
 			  interrupts/interrupt_handlers.o interrupts/idt_entry.o interrupts/fault_handlers.o \
 			  interrupts/fault_handlers_asm.o \
 			  drivers/keyboard/keyboard.o drivers/keyboard/keyboard_handler.o allocator/frame_allocator.o \
-			  sync/mutex.o sync/cond_var.o  sync/sem.o \
-			  vm/vm.o core/task.o core/thread.o core/fork.o asm/asm.o syscalls/syscall_handlers.o \
+			  sync/mutex.o sync/cond_var.o  sync/sem.o sync/spinlock.o \
+			  vm/vm.o vm/vm_area.o vm/swap.o vm/shm.o vm/page_cache.o core/task.o core/thread.o core/fork.o asm/asm.o syscalls/syscall_handlers.o \
 			  syscalls/thread_syscalls.o syscalls/thread_syscalls_asm.o syscalls/console_syscalls.o \
 			  syscalls/console_syscalls_asm.o syscalls/lifecycle_syscalls.o syscalls/lifecycle_syscalls_asm.o \
 			  common/assert.o common/malloc_wrappers.o core/context.o core/scheduler.o core/exec.o syscalls/misc_syscalls.o \
 			  syscalls/misc_syscalls_asm.o core/wait_vanish.o syscalls/memory_syscalls.o syscalls/memory_syscalls_asm.o \
 			  drivers/keyboard/keyboard_circular_buffer.o syscalls/system_check_syscalls.o \
-			  syscalls/system_check_syscalls_asm.o core/sleep.o	syscalls/syscall_util.o \
+			  syscalls/system_check_syscalls_asm.o core/sleep.o core/cpu.o core/cpu_asm.o	syscalls/syscall_util.o \
 			  interrupts/device_handlers.o interrupts/device_handlers_asm.o \
 			  udriv/udriv.o udriv/circular_buffer.o udriv/udriv_server_table.o \
 			  syscalls/udriv_syscalls_asm.o
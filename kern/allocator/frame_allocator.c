@@ -1,143 +1,651 @@
 /** @file frame_allocator.c
  *  @brief implement the frame_allocator functions
  *
+ *  Free frames are managed by a buddy allocator. A free block of order k
+ *  is 2^k frames, aligned on 2^k frames, and sits on the free list of its
+ *  order. Blocks are split to satisfy smaller requests and merged with
+ *  their buddy when both halves are free again. Single frames are also 
+ *  cached in a small magazine per processor and a pool of zeroed frames,
+ *  which sit outside the buddy lists.
+ *
+ *  The free frame counts and the magazines are only touched with the 
+ *  kernel lock held, which keeps the other processors out, and with 
+ *  interrupts disabled, which keeps out the other threads of this one.
+ *
  *  @author Rohit Upadhyaya (rjupadhy)
  *  @author Prajwal Yadapadithaya (pyadapad)
  */
 #include <allocator/frame_allocator.h>
 #include <common/malloc_wrappers.h>
 #include <common_kern.h>
-#include <limits.h>
 #include <simics.h>
 #include <sync/mutex.h>
 #include <page.h>
 #include <stddef.h>
+#include <string.h>
 #include <common/assert.h>
+#include <common/errors.h>
+#include <list/list.h>
+#include <vm/vm.h>
+#include <asm.h>
+#include <asm/asm.h>
+#include <x86/eflags.h>
+#include <core/cpu.h>
+#include <smp/smp.h>
 
-#define FREE_FRAME_LIST_END UINT_MAX
 #define PAGE_ALIGNMENT_CHECK 0x00000fff
+#define ZEROED_POOL_SIZE 256     /* Frames the idle task keeps zeroed */
+#define ZEROED_REFILL_BATCH 16   /* Frames zeroed per idle context switch */
+#define MAGAZINE_SIZE 64         /* Frames cached outside the free lists */
+#define MAGAZINE_REFILL 32       /* Frames moved to the magazine at once */
+
+#define FRAME_ADDR(index) ((void *)(USER_MEM_START + (index) * PAGE_SIZE))
+#define FRAME_DESC_ADDR(desc) FRAME_ADDR((desc) - frame_descs)
+
+static frame_desc_t *frame_descs;  /* one descriptor per physical frame */
+static int num_frames;             /* Number of frames managed */
+
+static list_head free_areas[MAX_FRAME_ORDER + 1]; /* Free blocks per order */
+static mutex_t list_mut;     /* Mutex to synchronize access to free lists */
+
+static list_head zeroed_list; /* Pool of zeroed free frames */
+static int zeroed_count;      /* Number of frames in the zeroed pool */
 
-static int *free_frames_arr;        /* stack of free physical frames */
-static mutex_t *free_frames_lock;   /* locks for the physical frames */
+/* Free frames cached for each processor so that single frames can be 
+ * allocated and freed without the list mutex */
+static void *magazine[MAX_CPUS][MAGAZINE_SIZE];
+static int magazine_count[MAX_CPUS];
 
-static void *free_list_head; /* Head of free list,UINT_MAX => no free frames */
-static mutex_t list_mut;     /* Mutex to synchronize access to free frame list */
+/* Free frames anywhere (free lists, zeroed pool or magazines) and the ones
+ * promised to demand-zero pages */
+static int free_count;
+static int reserved_count;
 
 static void init_free_list();
+static void *buddy_alloc(int order);
+static void buddy_free(void *frame_addr, int order);
+static void drain_frame_caches();
+static void *take_frame(int zeroed, int *is_zeroed);
+static int claim_frames(int count, int reserved);
+static void release_frames(int count, int reserved);
+static void free_frames(void **frames, int count, int reserved);
+static void *magazine_pop(int cpu);
+static int magazine_push(int cpu, void *frame_addr);
+static frame_desc_t *get_frame_desc(void *frame_addr);
 
 /** @brief initialize the free frame allocator
  *
- *  initialize the free list and also the mutex to synchronize access to the 
- *  free frame list.
+ *  initialize the free lists and also the mutex to synchronize access to 
+ *  them.
  *
  *  @return void
  */
 void init_frame_allocator() {
-    /* create the free list of frames */
+    /* create the free lists of frames */
     init_free_list();
 
     kernel_assert(mutex_init(&list_mut) == 0);
 }
 
-/** @brief initialize the free frame list on system startup
+/** @brief initialize the free frame lists on system startup
  *
- *  allocates space for the free frame stack and the frame locks
- *  initializes the mutexes for each physical frame. Initialize
- *  free_list_head to USER_MEM_START
+ *  allocates space for the frame descriptors and puts every frame on the
+ *  buddy free lists in the largest aligned blocks that fit.
  *
  *  @return void
  */
 void init_free_list() {
+	int i, order;
 
-	/*Initialize the free list array*/
-	free_frames_arr = (int *)smalloc(FREE_FRAMES_COUNT*sizeof(int));
-	kernel_assert(free_frames_arr != NULL);
-	free_frames_lock = (mutex_t *)smalloc(FREE_FRAMES_COUNT*sizeof(mutex_t));
-	kernel_assert(free_frames_lock != NULL);
+	/*Initialize the frame descriptors*/
+	num_frames = FREE_FRAMES_COUNT;
+	frame_descs = (frame_desc_t *)smalloc(num_frames * sizeof(frame_desc_t));
+	kernel_assert(frame_descs != NULL);
 
-	int i;
-	for(i = 0; i < FREE_FRAMES_COUNT - 1; i++) {
-		free_frames_arr[i] = (USER_MEM_START + ((i+1) * PAGE_SIZE));
-		kernel_assert(mutex_init(&free_frames_lock[i]) == 0);
+	for(order = 0; order <= MAX_FRAME_ORDER; order++) {
+		init_head(&free_areas[order]);
+	}
+	init_head(&zeroed_list);
+	for(i = 0; i < num_frames; i++) {
+		frame_descs[i].flags = 0;
+		frame_descs[i].order = 0;
+		frame_descs[i].ref_count = 0;
+	}
+	for(i = 0; i < num_frames; i += (1 << order)) {
+		order = MAX_FRAME_ORDER;
+		while((i & ((1 << order) - 1)) != 0 || i + (1 << order) > num_frames) {
+			order--;
+		}
+		frame_descs[i].flags = FRAME_FREE | FRAME_BUDDY;
+		frame_descs[i].order = order;
+		add_to_tail(&frame_descs[i].link, &free_areas[order]);
 	}
-	free_frames_arr[FREE_FRAMES_COUNT - 1] = FREE_FRAME_LIST_END;
-	kernel_assert(mutex_init(&free_frames_lock[FREE_FRAMES_COUNT - 1]) == 0);
 
-	free_list_head = (void *)USER_MEM_START;
+	memset(magazine_count, 0, sizeof(magazine_count));
+	zeroed_count = 0;
+	free_count = num_frames;
+	reserved_count = 0;
 }
 
-/** @brief get a free physical frame
+/** @brief take a block off the buddy free lists
  *
- *  This function locks the frame list (which functions as a stack)
- *  and returns the top of the frame list. If there are no more free frames 
- *  the function returns null.
+ *  The smallest free block large enough is split in halves until it has
+ *  the requested order, the upper halves going back on the free lists.
  *
- *  @return void * physical address of the free frame
+ *  @pre list_mut is held
+ *  @param order the order of the block
+ *  @return void * physical address of the block, NULL if there is no free
+ *          block that large
  */
-void *allocate_frame() {
+void *buddy_alloc(int order) {
+	int k = order;
+	while(k <= MAX_FRAME_ORDER && get_first(&free_areas[k]) == NULL) {
+		k++;
+	}
+	if(k > MAX_FRAME_ORDER) {
+		return NULL;
+	}
+	frame_desc_t *desc = get_entry(get_first(&free_areas[k]), 
+								   frame_desc_t, link);
+	del_entry(&desc->link);
+	desc->flags = 0;
+	while(k > order) {
+		k--;
+		frame_desc_t *buddy = desc + (1 << k);
+		buddy->flags = FRAME_FREE | FRAME_BUDDY;
+		buddy->order = k;
+		add_to_head(&buddy->link, &free_areas[k]);
+	}
+
+	void *frame_addr = FRAME_DESC_ADDR(desc);
+    kernel_assert(((int)frame_addr & PAGE_ALIGNMENT_CHECK) == 0);
+	return frame_addr;
+}
+
+/** @brief give a block back to the buddy free lists
+ *
+ *  The block is merged with its buddy for as long as the buddy is a free 
+ *  block of the same order.
+ *
+ *  @pre list_mut is held
+ *  @param frame_addr the address of the block
+ *  @param order the order of the block
+ *  @return void
+ */
+void buddy_free(void *frame_addr, int order) {
+	int index = FRAME_INDEX(frame_addr);
+	while(order < MAX_FRAME_ORDER) {
+		int buddy_index = index ^ (1 << order);
+		if(buddy_index >= num_frames || 
+		   !(frame_descs[buddy_index].flags & FRAME_BUDDY) ||
+		   frame_descs[buddy_index].order != order) {
+			break;
+		}
+		del_entry(&frame_descs[buddy_index].link);
+		frame_descs[buddy_index].flags = 0;
+		index &= ~(1 << order);
+		order++;
+	}
+	frame_descs[index].flags = FRAME_FREE | FRAME_BUDDY;
+	frame_descs[index].order = order;
+	add_to_head(&frame_descs[index].link, &free_areas[order]);
+}
+
+/** @brief give the frames of the magazines and the zeroed pool back to 
+ *         the buddy free lists so they can be merged
+ *
+ *  The magazines of the other processors are safe to empty since they 
+ *  are kept out by the kernel lock.
+ *
+ *  @pre list_mut is held
+ *  @return void
+ */
+void drain_frame_caches() {
+	void *frame_addr;
+	list_head *node;
+	int cpu;
+	for(cpu = 0; cpu < get_num_cpus(); cpu++) {
+		while((frame_addr = magazine_pop(cpu)) != NULL) {
+			buddy_free(frame_addr, 0);
+		}
+	}
+	while((node = get_first(&zeroed_list)) != NULL) {
+		del_entry(node);
+		zeroed_count--;
+		buddy_free(FRAME_DESC_ADDR(get_entry(node, frame_desc_t, link)), 0);
+	}
+}
+
+/** @brief account for frames about to be taken off the free lists
+ *
+ *  Once claimed, a frame is guaranteed to be found on the free lists, the 
+ *  zeroed pool or a magazine.
+ *
+ *  @param count the number of frames
+ *  @param reserved 1 if the frames were reserved with reserve_frames()
+ *  @return int 0 on success, ERR_NOMEM if there are not enough unreserved 
+ *          free frames
+ */
+int claim_frames(int count, int reserved) {
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	if (reserved) {
+		kernel_assert(reserved_count >= count);
+		reserved_count -= count;
+	} else if (free_count - reserved_count < count) {
+		if (int_flag) {
+			enable_interrupts();
+		}
+		return ERR_NOMEM;
+	}
+	free_count -= count;
+	kernel_assert(free_count >= reserved_count);
+	if (int_flag) {
+		enable_interrupts();
+	}
+	return 0;
+}
+
+/** @brief account for frames put back on the free lists
+ *
+ *  @param count the number of frames
+ *  @param reserved 1 to keep the frames reserved for the caller
+ *  @return void
+ */
+void release_frames(int count, int reserved) {
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	free_count += count;
+	if (reserved) {
+		reserved_count += count;
+	}
+	if (int_flag) {
+		enable_interrupts();
+	}
+}
+
+/** @brief take a frame out of the magazine of a processor
+ *
+ *  @param cpu the processor
+ *  @return void * the frame, NULL if the magazine is empty
+ */
+void *magazine_pop(int cpu) {
+	void *frame_addr = NULL;
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	if (magazine_count[cpu] > 0) {
+		frame_addr = magazine[cpu][--magazine_count[cpu]];
+		get_frame_desc(frame_addr)->flags = 0;
+	}
+	if (int_flag) {
+		enable_interrupts();
+	}
+	return frame_addr;
+}
+
+/** @brief put a frame in the magazine of a processor
+ *
+ *  @param cpu the processor
+ *  @param frame_addr the free frame
+ *  @return int 0 on success, ERR_NOMEM if the magazine is full
+ */
+int magazine_push(int cpu, void *frame_addr) {
+	int retval = ERR_NOMEM;
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	if (magazine_count[cpu] < MAGAZINE_SIZE) {
+		magazine[cpu][magazine_count[cpu]++] = frame_addr;
+		get_frame_desc(frame_addr)->flags = FRAME_FREE;
+		retval = 0;
+	}
+	if (int_flag) {
+		enable_interrupts();
+	}
+	return retval;
+}
+
+/** @brief get the descriptor of a physical frame
+ *
+ *  @param frame_addr the address of the frame
+ *  @return frame_desc_t* the descriptor
+ */
+frame_desc_t *get_frame_desc(void *frame_addr) {
+	return &frame_descs[FRAME_INDEX(frame_addr)];
+}
+
+/** @brief take a claimed frame from wherever it is
+ *
+ *  Dirty frames come from the magazine of this processor when it has any,
+ *  without taking the list mutex. Otherwise the frame comes from the 
+ *  zeroed pool or the buddy lists, and the magazine is refilled from the 
+ *  buddy lists in the same critical section. Failing both, the frame 
+ *  sits in a magazine and they are all drained.
+ *
+ *  @pre a frame has been claimed with claim_frames()
+ *  @param zeroed 1 to prefer a zeroed frame, 0 to prefer a dirty one
+ *  @param is_zeroed set to whether the frame is known to be zeroed, may 
+ *         be NULL
+ *  @return void * physical address of the frame
+ */
+void *take_frame(int zeroed, int *is_zeroed) {
+	void *frame_addr = NULL;
+	list_head *node;
+	int i, cpu = this_cpu();
+
+	if (is_zeroed != NULL) {
+		*is_zeroed = 0;
+	}
+	if (!zeroed && (frame_addr = magazine_pop(cpu)) != NULL) {
+		return frame_addr;
+	}
     mutex_lock(&list_mut);
-	if ((int)free_list_head == FREE_FRAME_LIST_END) {
-        mutex_unlock(&list_mut);
-        return NULL;
-    }
-    void *frame_addr = free_list_head; 
-	free_list_head = (void *)free_frames_arr[FRAME_INDEX(frame_addr)];
+	if (!zeroed || get_first(&zeroed_list) == NULL) {
+		frame_addr = buddy_alloc(0);
+	}
+	for (i = 0; frame_addr != NULL && i < MAGAZINE_REFILL; i++) {
+		void *extra = buddy_alloc(0);
+		if (extra == NULL) {
+			break;
+		}
+		if (magazine_push(cpu, extra) < 0) {
+			buddy_free(extra, 0);
+			break;
+		}
+	}
+	if (frame_addr == NULL && (node = get_first(&zeroed_list)) != NULL) {
+		del_entry(node);
+		zeroed_count--;
+		frame_addr = FRAME_DESC_ADDR(get_entry(node, frame_desc_t, link));
+		get_frame_desc(frame_addr)->flags = 0;
+		if (is_zeroed != NULL) {
+			*is_zeroed = 1;
+		}
+	}
+	if (frame_addr == NULL) {
+		drain_frame_caches();
+		frame_addr = buddy_alloc(0);
+	}
 	mutex_unlock(&list_mut);
+	kernel_assert(frame_addr != NULL);
+	return frame_addr;
+}
 
-    kernel_assert(((int)frame_addr & PAGE_ALIGNMENT_CHECK) == 0);
-	kernel_assert(FRAME_INDEX(frame_addr) >= 0);
-	kernel_assert(FRAME_INDEX(frame_addr) < FREE_FRAMES_COUNT);
+/** @brief put a batch of frames back on the free lists
+ *
+ *  Frames go to the magazine of this processor while it has room. The 
+ *  rest are given back 
+ *  to the buddy lists under a single acquisition of the list mutex.
+ *
+ *  @param frames the addresses of the frames to be freed
+ *  @param count the number of frames
+ *  @param reserved 1 to keep the frames reserved for the caller
+ *  @return void
+ */
+void free_frames(void **frames, int count, int reserved) {
+	int i, cpu = this_cpu();
+	for (i = 0; i < count; i++) {
+		kernel_assert(frames[i] != NULL);
+    	kernel_assert(((int)frames[i] & PAGE_ALIGNMENT_CHECK) == 0);
+		kernel_assert(FRAME_INDEX(frames[i]) >= 0);
+		kernel_assert(FRAME_INDEX(frames[i]) < num_frames);
+		kernel_assert(!(get_frame_desc(frames[i])->flags & FRAME_FREE));
+		kernel_assert(get_frame_desc(frames[i])->ref_count == 0);
+	}
+	for (i = 0; i < count && magazine_push(cpu, frames[i]) == 0; i++) {
+		continue;
+	}
+	if (i < count) {
+    	mutex_lock(&list_mut);
+		for (; i < count; i++) {
+			buddy_free(frames[i], 0);
+		}
+    	mutex_unlock(&list_mut);
+	}
+	release_frames(count, reserved);
+}
 
-    return frame_addr;
+/** @brief get a free physical frame
+ *
+ *  Frames which have been reserved for demand-zero pages are not handed 
+ *  out. If there are no more unreserved free frames the function returns 
+ *  null.
+ *
+ *  @return void * physical address of the free frame
+ */
+void *allocate_frame() {
+	if (claim_frames(1, 0) < 0) {
+		return NULL;
+	}
+	return take_frame(0, NULL);
+}
+
+/** @brief get a free physical frame against an earlier reservation
+ *
+ *  The caller must hold a reservation obtained through reserve_frames().
+ *  The reservation is consumed, so this function never fails.
+ *
+ *  @param zeroed 1 if the caller wants a zeroed frame
+ *  @param is_zeroed set to whether the frame came from the zeroed pool,
+ *         may be NULL. If not the caller has to zero it itself
+ *  @return void * physical address of the free frame
+ */
+void *allocate_reserved_frame(int zeroed, int *is_zeroed) {
+	kernel_assert(claim_frames(1, 1) == 0);
+	return take_frame(zeroed, is_zeroed);
 }
 
-/** @brief return a physical frame to the free frame stack
+/** @brief zero a few free frames into the zeroed pool
+ *
+ *  Called from the idle path of the context switch, when nothing else is 
+ *  runnable, so demand-zero pages rarely have to be zeroed on the fault 
+ *  path. Nothing is done if the free lists are busy.
  *
- *  This function locks the frame list (which functions as a stack)
- *  adds a frame back to the top of the frame stack.
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void refill_zeroed_frames() {
+	int i;
+	void *frame_addr;
+	if (zeroed_count >= ZEROED_POOL_SIZE || mutex_trylock(&list_mut) < 0) {
+		return;
+	}
+	for (i = 0; i < ZEROED_REFILL_BATCH && zeroed_count < ZEROED_POOL_SIZE 
+				&& (frame_addr = buddy_alloc(0)) != NULL; i++) {
+		zero_frame(frame_addr);
+		get_frame_desc(frame_addr)->flags = FRAME_FREE | FRAME_ZEROED;
+		add_to_head(&get_frame_desc(frame_addr)->link, &zeroed_list);
+		zeroed_count++;
+	}
+	mutex_unlock_int_save(&list_mut);
+}
+
+/** @brief return a physical frame to the free frames
  *
  *  @param frame_addr the address of the frame to be freed.
  *  @return void
  */
 void deallocate_frame(void *frame_addr) {
-    kernel_assert(((int)frame_addr & PAGE_ALIGNMENT_CHECK) == 0);
-    kernel_assert(frame_addr != NULL);
+	deallocate_frames(&frame_addr, 1);
+}
+
+/** @brief return a batch of physical frames to the free frames
+ *
+ *  @param frames the addresses of the frames to be freed
+ *  @param count the number of frames
+ *  @return void
+ */
+void deallocate_frames(void **frames, int count) {
+	free_frames(frames, count, 0);
+}
+
+/** @brief return a batch of physical frames, keeping them reserved
+ *
+ *  The frames can no longer be taken by anybody else. The caller gets a
+ *  reservation for each of them, as if it had called reserve_frames(),
+ *  so memory being reused cannot run out in between.
+ *
+ *  @param frames the addresses of the frames to be freed
+ *  @param count the number of frames
+ *  @return void
+ */
+void deallocate_frames_reserved(void **frames, int count) {
+	free_frames(frames, count, 1);
+}
+
+/** @brief get 2^order physically contiguous frames
+ *
+ *  The block is aligned on its size, so an order of LARGE_FRAME_ORDER 
+ *  gives a frame for a 4 MB page. Reserved frames are never handed out. 
+ *  If no block is large enough the frames cached outside the buddy lists
+ *  are given back, which may let blocks merge, and the request is tried 
+ *  again.
+ *
+ *  @param order the order of the block, at most MAX_FRAME_ORDER
+ *  @return void * physical address of the first frame of the block, NULL
+ *          if no free block is large enough
+ */
+void *allocate_contiguous_frames(int order) {
+	kernel_assert(order >= 0 && order <= MAX_FRAME_ORDER);
+	if (claim_frames(1 << order, 0) < 0) {
+        return NULL;
+    }
+    mutex_lock(&list_mut);
+	void *frame_addr = buddy_alloc(order);
+	if (frame_addr == NULL) {
+		drain_frame_caches();
+		frame_addr = buddy_alloc(order);
+	}
+    mutex_unlock(&list_mut);
+	if (frame_addr == NULL) {
+		release_frames(1 << order, 0);
+	}
+	return frame_addr;
+}
+
+/** @brief return a block obtained from allocate_contiguous_frames()
+ *
+ *  @param frame_addr the address of the first frame of the block
+ *  @param order the order the block was allocated with
+ *  @return void
+ */
+void deallocate_contiguous_frames(void *frame_addr, int order) {
+	kernel_assert(order >= 0 && order <= MAX_FRAME_ORDER);
+    kernel_assert((FRAME_INDEX(frame_addr) & ((1 << order) - 1)) == 0);
 	kernel_assert(FRAME_INDEX(frame_addr) >= 0);
-	kernel_assert(FRAME_INDEX(frame_addr) < FREE_FRAMES_COUNT);
+	kernel_assert(FRAME_INDEX(frame_addr) + (1 << order) <= num_frames);
 
     mutex_lock(&list_mut);
-	int index = FRAME_INDEX(frame_addr);
-	free_frames_arr[index] = (unsigned int)free_list_head;
-	free_list_head = frame_addr;
+	buddy_free(frame_addr, order);
     mutex_unlock(&list_mut);
+	release_frames(1 << order, 0);
 }
 
-/** @brief Function to lock a particular physical frame
+/** @brief reserve free frames for later use
+ *
+ *  Reserved frames stay on the free lists but are not handed out by
+ *  allocate_frame(). They are claimed one at a time with
+ *  allocate_reserved_frame() when a demand-zero page is first touched.
  *
- *  @param frame_addr The address of the frame that must be locked
+ *  @param count the number of frames to reserve
+ *  @return int 0 on success, ERR_NOMEM if not enough frames are free
+ */
+int reserve_frames(int count) {
+	int retval = ERR_NOMEM;
+	kernel_assert(count >= 0);
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	if (free_count - reserved_count >= count) {
+		reserved_count += count;
+		retval = 0;
+	}
+	if (int_flag) {
+		enable_interrupts();
+	}
+	return retval;
+}
+
+/** @brief give back frames reserved through reserve_frames()
  *
+ *  @param count the number of reservations to drop
  *  @return void
  */
-void lock_frame(void *frame_addr) {
+void unreserve_frames(int count) {
+	kernel_assert(count >= 0);
+	kernel_assert(kernel_lock_held());
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	reserved_count -= count;
+	kernel_assert(reserved_count >= 0);
+	if (int_flag) {
+		enable_interrupts();
+	}
+}
+
+/** @brief Function to add references to a physical frame
+ *
+ *  The count is updated atomically, so no lock is needed.
+ *
+ *  @param frame_addr The address of the frame
+ *  @param count The number of references to add, negative to drop them
+ *
+ *  @return int The new reference count of the frame
+ */
+int frame_add_ref(void *frame_addr, int count) {
 	kernel_assert(frame_addr != NULL);
 	kernel_assert(FRAME_INDEX(frame_addr) >= 0);
-	kernel_assert(FRAME_INDEX(frame_addr) < FREE_FRAMES_COUNT);
+	kernel_assert(FRAME_INDEX(frame_addr) < num_frames);
 
-	mutex_lock(&free_frames_lock[FRAME_INDEX(frame_addr)]);
+	int ref_count = atomic_add(&get_frame_desc(frame_addr)->ref_count, count);
+	kernel_assert(ref_count >= 0);
+	return ref_count;
 }
 
-/** @brief Function to unlock a particular physical frame
+/** @brief Function to get the reference count of a physical frame
  *
- *  @param frame_addr The address of the frame that must be unlocked
+ *  @param frame_addr The address of the frame
+ *
+ *  @return int The reference count of the frame
+ */
+int frame_get_ref(void *frame_addr) {
+	kernel_assert(frame_addr != NULL);
+	kernel_assert(FRAME_INDEX(frame_addr) >= 0);
+	kernel_assert(FRAME_INDEX(frame_addr) < num_frames);
+
+	return get_frame_desc(frame_addr)->ref_count;
+}
+
+/** @brief Function to record that the page cache keeps a frame
+ *
+ *  The cache never lets go of its reference, so the frame stays marked
+ *  until it is freed.
+ *
+ *  @param frame_addr The address of the frame
  *
  *  @return void
  */
-void unlock_frame(void *frame_addr) {
+void frame_set_cached(void *frame_addr) {
 	kernel_assert(frame_addr != NULL);
 	kernel_assert(FRAME_INDEX(frame_addr) >= 0);
-	kernel_assert(FRAME_INDEX(frame_addr) < FREE_FRAMES_COUNT);
+	kernel_assert(FRAME_INDEX(frame_addr) < num_frames);
+
+	get_frame_desc(frame_addr)->flags |= FRAME_CACHED;
+}
 
-	mutex_unlock(&free_frames_lock[FRAME_INDEX(frame_addr)]);
+/** @brief Function to get the number of mappings of a physical frame
+ *
+ *  @param frame_addr The address of the frame
+ *
+ *  @return int The reference count of the frame, less the reference of 
+ *          the page cache if it keeps the frame
+ */
+int frame_get_mappings(void *frame_addr) {
+	frame_desc_t *desc = get_frame_desc(frame_addr);
+	return frame_get_ref(frame_addr) - ((desc->flags & FRAME_CACHED) ? 1 : 0);
 }
 
 /** @brief Function used to check the physical frames status
@@ -147,15 +655,24 @@ void unlock_frame(void *frame_addr) {
  *  @return int Number of free physical frames
  */
 int check_physical_memory() {
-    int free_count = 0;
-    void *first = free_list_head;
+    int free_count = 0, order, i;
+	list_head *node;
 
-    while ((int)first != FREE_FRAME_LIST_END) {
-		kernel_assert((unsigned int)first >= USER_MEM_START);
-		kernel_assert((unsigned int)first <= FREE_FRAME_LIST_END);
-	    first = (void *)(free_frames_arr[FRAME_INDEX(first)]);
+	for (order = 0; order <= MAX_FRAME_ORDER; order++) {
+		for (node = free_areas[order].next; node != &free_areas[order]; 
+			 node = node->next) {
+			frame_desc_t *desc = get_entry(node, frame_desc_t, link);
+			kernel_assert(desc->flags & FRAME_BUDDY);
+			kernel_assert(desc->order == order);
+			free_count += (1 << order);
+		}
+	}
+	for (node = zeroed_list.next; node != &zeroed_list; node = node->next) {
         free_count++;
+	}
+    for (i = 0; i < get_num_cpus(); i++) {
+        free_count += magazine_count[i];
     }
-    lprintf("Total free physical frames: %d, next free frame %p",free_count, free_list_head);
+    lprintf("Total free physical frames: %d", free_count);
     return free_count;	
 }
@@ -10,49 +10,93 @@
 #include <asm.h>
 #include <asm/asm.h>
 #include <vm/vm.h>
+#include <allocator/frame_allocator.h>
 #include <syscall.h>
 #include <core/scheduler.h>
 #include <core/thread.h>
 #include <simics.h>
 #include <common/assert.h>
 
+static void switch_from_current(int yielding);
 static void switch_to_thread(thread_struct_t *curr_thread, 
 								thread_struct_t *new_thread);
 
 /** @brief Function to context switch to a different thread
  *
- *  This function calls the scheduler to get the next schedulable
- *  thread. It also sends the current thread to the scheduler to
- *  be added back to the runnable queue.
+ *  This function sends the current thread to the scheduler to be 
+ *  added back to the runnable queue, and then calls the scheduler to 
+ *  get the next schedulable thread. The current thread is queued first
+ *  so that it competes with the others by priority; it keeps running if
+ *  the scheduler picks it again.
  *
  *  @return Void
  */
 void context_switch() {
+	switch_from_current(0);
+}
+
+/** @brief Function to give up the processor to another thread
+ *
+ *  Unlike context_switch(), the current thread is left out of the pick
+ *  once, so any other runnable thread gets to run even if the current 
+ *  one outranks it. The current thread is then queued behind its peers.
+ *  It carries on right away only if nothing else is runnable.
+ *
+ *  @return Void
+ */
+void context_yield() {
+	switch_from_current(1);
+}
+
+/** @brief Function to pick the next thread and switch to it
+ *
+ *  @param yielding non zero if the current thread must not be picked
+ *         ahead of the other runnable threads
+ *
+ *  @return Void
+ */
+void switch_from_current(int yielding) {
 
 	disable_interrupts();	/* Context switching is a critical section */
 
-	thread_struct_t *idle_thread = get_idle_task()->thr;
+	thread_struct_t *idle_thread = get_idle_thread();
+
+	thread_struct_t *curr_thread = get_curr_thread();
+
+	thread_struct_t *thr = NULL;
+
+	/* A yielding thread is left out of the first pick */
+	if(yielding) {
+		thr = next_thread();
+	}
+
+	if(curr_thread != NULL && curr_thread->status == RUNNING &&
+			curr_thread != idle_thread) {
+		curr_thread->status = RUNNABLE;
+		runq_add_thread_interruptible(curr_thread);
+	}
 	
 	/* Get the next thread to be run from scheduler */
-    thread_struct_t *thr = next_thread();
+	if(thr == NULL) {
+		thr = next_thread();
+	}
 
-	thread_struct_t *curr_thread = get_curr_thread();
+	if(thr != NULL && thr == curr_thread) {
+		curr_thread->status = RUNNING;
+		enable_interrupts();
+		return;
+	}
 	
 	if(thr == NULL) { /* There are no other threads to schedule, run idle */
-		if(curr_thread != NULL && (curr_thread->id == idle_thread->id || 
-				curr_thread->status == RUNNING)) {
+		if(curr_thread != NULL && curr_thread == idle_thread) {
+			/* Nothing to do, get frames ready for demand-zero pages */
+			refill_zeroed_frames();
 			enable_interrupts();
 			return;
 		} else {
 			thr = idle_thread;
 		}
 	}
-    
-	if(curr_thread != NULL && curr_thread->status == RUNNING &&
-			curr_thread->id != idle_thread->id) {
-		curr_thread->status = RUNNABLE;
-		runq_add_thread_interruptible(curr_thread);
-	}
 
 	/* Call switch_to_thread with the new thread */
     switch_to_thread(curr_thread, thr);
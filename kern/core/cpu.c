@@ -0,0 +1,482 @@
+/** @file cpu.c
+ *
+ *  Multiprocessor support.
+ *
+ *  The processors are found in the MP table and booted with the SMP code
+ *  of 410kern. Each of them has its own run queue, current thread and
+ *  idle thread in the scheduler, and its own TSS so set_esp0() works as
+ *  is. An application processor preempts its threads with the timer of
+ *  its local APIC. The PIT and the devices still interrupt the boot
+ *  processor only.
+ *
+ *  User code runs on all the processors at once. Kernel code runs under
+ *  a single kernel lock, a spinlock taken on every entry from user mode
+ *  and released on the way back (see core/cpu_asm.h). A processor in
+ *  the kernel holds it, so disabling interrupts still keeps everybody
+ *  else out and the mutexes, condition variables and other critical
+ *  sections built on that stay safe. A thread blocking in the kernel
+ *  hands the lock over to the thread the processor switches to.
+ *
+ *  Page table changes are pushed to the other processors running the
+ *  same page directory with an IPI which makes them flush their TLB. A
+ *  processor waiting for the kernel lock runs with interrupts disabled 
+ *  and checks for such requests as it spins.
+ *
+ *  An idle application processor releases the kernel lock and sleeps in
+ *  hlt. Queueing a thread sends it an IPI to wake it up. Its timer still
+ *  ticks but is ignored then, as the handler runs without the lock.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <core/cpu.h>
+#include <core/scheduler.h>
+#include <core/context.h>
+#include <core/task.h>
+#include <core/thread.h>
+#include <smp/smp.h>
+#include <smp/apic.h>
+#include <smp/mptable.h>
+#include <sync/spinlock.h>
+#include <interrupts/idt_entry.h>
+#include <drivers/timer/timer.h>
+#include <drivers/timer/tsc.h>
+#include <vm/vm.h>
+#include <asm/asm.h>
+#include <common/assert.h>
+#include <cr.h>
+#include <asm.h>
+#include <simics.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TSS_DESC_ACCESS 0x89    /* Present, DPL 0, available 32 bit TSS */
+
+#define AP_TIMER_IDT_ENTRY 0xf0         /* Local APIC timer */
+#define TLB_SHOOTDOWN_IDT_ENTRY 0xf1    /* TLB flush requests */
+#define WAKEUP_IDT_ENTRY 0xf2           /* Wakes an idle processor up */
+#define HALT_IDT_ENTRY 0xf3             /* Stops a processor for good */
+#define SPURIOUS_IDT_ENTRY 0xff         /* Default spurious vector */
+
+#define LAPIC_MAX_COUNT 0xffffffff
+#define CPU_BOOT_TIMEOUT_NS (NS_PER_SEC / 10)
+#define MAX_WAIT_POLLS 100000000        /* In case the clock is stuck */
+
+static int num_cpus = 1;        /* Processors found in the MP table */
+static int smp_active;          /* Set once the local APICs are in use */
+static volatile int cpu_booted[MAX_CPUS];   /* Reported in after booting */
+static volatile int cpu_online[MAX_CPUS] = { 1 }; /* Taking part, the boot
+                                                  * processor always does */
+static volatile int cpus_started;   /* Set when the idle threads exist */
+static volatile int cpus_halted;    /* Set when the machine halts */
+static volatile int cpu_idling[MAX_CPUS];   /* Asleep in cpu_idle() */
+static spinlock_t kernel_spinlock;
+static volatile int kernel_lock_cpu = -1;   /* Processor holding it */
+static void *volatile cpu_pd[MAX_CPUS];     /* Page directory in %cr3 */
+static volatile int tlb_flush_pending[MAX_CPUS];
+static uint32_t lapic_counts_per_tick;  /* Of the local APIC timer */
+
+static void ap_main(int cpu);
+static void cpu_idle();
+static void calibrate_lapic_timer();
+static void start_lapic_timer();
+static void serve_tlb_shootdown(int cpu);
+static void send_ipi(int cpu, int vector);
+
+/** @brief Find the processors of the machine
+ *
+ *  Must be called before vm_init, which maps the local APIC if there
+ *  is more than one processor. The boot processor takes the kernel lock
+ *  here and holds it until it first leaves for user mode.
+ *
+ *  @param mbinfo the multiboot info of the boot loader
+ *  @return void
+ */
+void cpus_init(mbinfo_t *mbinfo) {
+    spin_init(&kernel_spinlock);
+    kernel_lock();
+    if (smp_init(mbinfo) == 0) {
+        num_cpus = smp_num_cpus();
+    }
+}
+
+/** @brief Boot the application processors
+ *
+ *  Returns once all of them reported in, or after CPU_BOOT_TIMEOUT_NS.
+ *  A processor which has not reported in by then is left out and halts
+ *  if it ever does. The processors wait for start_cpus() before they
+ *  run any thread.
+ *
+ *  @pre paging, the IDT and the timer are set up
+ *  @return void
+ */
+void boot_cpus() {
+    int cpu, booted = 1, polls = 0;
+    if (num_cpus == 1) {
+        return;
+    }
+    kernel_assert(add_idt_entry(ap_timer_handler, AP_TIMER_IDT_ENTRY,
+                                INTERRUPT_GATE, KERNEL_DPL) == 0);
+    kernel_assert(add_idt_entry(tlb_shootdown_handler,
+                                TLB_SHOOTDOWN_IDT_ENTRY, INTERRUPT_GATE,
+                                KERNEL_DPL) == 0);
+    kernel_assert(add_idt_entry(wakeup_handler, WAKEUP_IDT_ENTRY,
+                                INTERRUPT_GATE, KERNEL_DPL) == 0);
+    kernel_assert(add_idt_entry(halt_ipi_handler, HALT_IDT_ENTRY,
+                                INTERRUPT_GATE, KERNEL_DPL) == 0);
+    kernel_assert(add_idt_entry(spurious_handler, SPURIOUS_IDT_ENTRY,
+                                INTERRUPT_GATE, KERNEL_DPL) == 0);
+    smp_active = 1;
+    smp_boot(ap_main);
+
+    unsigned long long deadline = tsc_time_ns() + CPU_BOOT_TIMEOUT_NS;
+    while (booted < num_cpus && tsc_time_ns() < deadline &&
+           polls < MAX_WAIT_POLLS) {
+        for (booted = 1, cpu = 1; cpu < num_cpus; cpu++) {
+            booted += cpu_booted[cpu];
+        }
+        polls++;
+    }
+    for (booted = 1, cpu = 1; cpu < num_cpus; cpu++) {
+        cpu_online[cpu] = cpu_booted[cpu];
+        booted += cpu_online[cpu];
+    }
+    calibrate_lapic_timer();
+    lprintf("%d of %d processors online", booted, num_cpus);
+}
+
+/** @brief Let the application processors run threads
+ *
+ *  Each one gets an idle thread in the idle task, and starts running
+ *  threads once it has the kernel lock.
+ *
+ *  @pre the scheduler and the idle task are set up
+ *  @return void
+ */
+void start_cpus() {
+    int cpu;
+    for (cpu = 1; cpu < num_cpus; cpu++) {
+        if (!cpu_online[cpu]) {
+            continue;
+        }
+        thread_struct_t *idle_thread = create_thread(get_idle_task());
+        kernel_assert(idle_thread != NULL);
+        set_idle_thread(cpu, idle_thread);
+    }
+    cpus_started = 1;
+}
+
+/** @brief Get the number of the processor we are running on
+ *
+ *  The boot processor is 0.
+ *
+ *  @return int the processor number
+ */
+int this_cpu() {
+    return smp_active ? smp_get_cpu() : 0;
+}
+
+/** @brief Get the number of processors of the machine
+ *
+ *  @return int the number of processors, online or not
+ */
+int get_num_cpus() {
+    return num_cpus;
+}
+
+/** @brief Check if a processor runs threads
+ *
+ *  @param cpu the processor number
+ *  @return int 1 if it is online, 0 if not
+ */
+int is_cpu_online(int cpu) {
+    return cpu_online[cpu];
+}
+
+/** @brief Take the kernel lock
+ *
+ *  TLB flush requests are served while spinning, as the processor
+ *  holding the lock may be waiting for them. If the machine is being 
+ *  halted, the lock never comes and the processor parks.
+ *
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void kernel_lock() {
+    int cpu = this_cpu();
+    while (!spin_trylock(&kernel_spinlock)) {
+        if (cpus_halted) {
+            park_cpu();
+        }
+        serve_tlb_shootdown(cpu);
+    }
+    kernel_lock_cpu = cpu;
+}
+
+/** @brief Release the kernel lock
+ *
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void kernel_unlock() {
+    kernel_lock_cpu = -1;
+    spin_unlock(&kernel_spinlock);
+}
+
+/** @brief Check if this processor holds the kernel lock
+ *
+ *  @return int 1 if it does, 0 if not
+ */
+int kernel_lock_held() {
+    return kernel_lock_cpu == this_cpu();
+}
+
+/** @brief Record the page directory loaded on this processor
+ *
+ *  @param pd the page directory
+ *  @return void
+ */
+void set_cpu_pd(void *pd) {
+    cpu_pd[this_cpu()] = pd;
+}
+
+/** @brief Flush the TLB of the other processors running a page directory
+ *
+ *  Returns once they all did. The TLB of this processor is left alone.
+ *
+ *  @param pd the page directory whose entries changed
+ *  @return void
+ */
+void tlb_shootdown(void *pd) {
+    int cpu, me;
+    if (!cpus_started) {
+        return;
+    }
+    me = this_cpu();
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        if (cpu != me && cpu_online[cpu] && cpu_pd[cpu] == pd) {
+            tlb_flush_pending[cpu] = 1;
+            send_ipi(cpu, TLB_SHOOTDOWN_IDT_ENTRY);
+        }
+    }
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        while (tlb_flush_pending[cpu]) {
+            continue;
+        }
+    }
+}
+
+/** @brief Wake an idle processor up to run a thread just queued
+ *
+ *  The processor the thread was queued on is preferred. If it is busy, 
+ *  any idle processor can take the thread from its queue.
+ *
+ *  @param cpu the processor the thread was queued on
+ *  @return void
+ */
+void wake_idle_cpu(int cpu) {
+    if (!cpus_started) {
+        return;
+    }
+    if (!cpu_idling[cpu]) {
+        for (cpu = 0; cpu < num_cpus && !cpu_idling[cpu]; cpu++) {
+            continue;
+        }
+        if (cpu == num_cpus) {
+            return;
+        }
+    }
+    send_ipi(cpu, WAKEUP_IDT_ENTRY);
+}
+
+/** @brief Stop the other processors for good
+ *
+ *  Those running user code or idle get an IPI which parks them. The 
+ *  others park when they try to take the kernel lock, which the caller
+ *  keeps.
+ *
+ *  @pre the kernel lock is held
+ *  @return void
+ */
+void halt_cpus() {
+    int cpu, me = this_cpu();
+    cpus_halted = 1;
+    if (!cpus_started) {
+        return;
+    }
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        if (cpu != me && cpu_online[cpu]) {
+            send_ipi(cpu, HALT_IDT_ENTRY);
+        }
+    }
+}
+
+/** @brief Handle a TLB flush request from another processor
+ *
+ *  Runs without the kernel lock, which the sender holds.
+ *
+ *  @return void
+ */
+void tlb_shootdown_handler_c() {
+    serve_tlb_shootdown(this_cpu());
+    apic_eoi();
+}
+
+/** @brief Handle a tick of the local APIC timer of an application
+ *         processor
+ *
+ *  @return void
+ */
+void ap_timer_handler_c() {
+    int next_ticks;
+    apic_eoi();
+    if (cpu_idling[this_cpu()]) {
+        /* Woke cpu_idle() up, which has no kernel lock */
+        return;
+    }
+    if (scheduler_tick(total_ticks(), &next_ticks)) {
+        context_switch();
+    }
+}
+
+/** @brief Build the GDT descriptor of a TSS
+ *
+ *  Called by the 410kern SMP code for the TSS of each application
+ *  processor, with paging disabled.
+ *
+ *  @param tss the TSS
+ *  @param tss_size the size of the TSS in bytes
+ *  @return uint64_t the descriptor
+ */
+uint64_t tss_desc_create(void *tss, size_t tss_size) {
+    uint64_t base = (uint32_t)tss;
+    uint64_t limit = tss_size - 1;
+    return (limit & 0xffff) | ((base & 0xffffff) << 16) |
+           ((uint64_t)TSS_DESC_ACCESS << 40) |
+           (((limit >> 16) & 0xf) << 48) | ((base >> 24) << 56);
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief Entry point of an application processor
+ *
+ *  Runs on the boot stack and TSS set up for the processor by 410kern,
+ *  with paging disabled and interrupts disabled. Once started, the
+ *  processor moves to the stack of its idle thread for good.
+ *
+ *  @param cpu the number of the processor
+ *  @return Does not return
+ */
+void ap_main(int cpu) {
+    vm_init_ap();
+    set_kernel_pd();
+    cpu_booted[cpu] = 1;
+    while (!cpus_started) {
+        continue;
+    }
+    if (!cpu_online[cpu]) {
+        park_cpu();
+    }
+
+    kernel_lock();
+    thread_struct_t *idle_thread = get_idle_thread();
+    set_running_thread(idle_thread);
+    idle_thread->status = RUNNING;
+    set_esp0(idle_thread->k_stack_base);
+    start_lapic_timer();
+    update_to_dead_thr_stack(idle_thread->k_stack_base);
+    cpu_idle();
+}
+
+/** @brief Body of the idle thread of an application processor
+ *
+ *  Runs whatever the scheduler has. When there is nothing, the kernel
+ *  lock is released and the processor sleeps until some thread is queued
+ *  on any processor. Interrupts are only enabled in hlt, so the 
+ *  handlers see cpu_idling set whenever they interrupt the idle thread
+ *  without the lock.
+ *
+ *  @pre the kernel lock is held
+ *  @return Does not return
+ */
+void cpu_idle() {
+    int cpu = this_cpu();
+    while (1) {
+        context_switch();
+        disable_interrupts();
+        cpu_idling[cpu] = 1;
+        kernel_unlock();
+        while (!runq_work_pending()) {
+            serve_tlb_shootdown(cpu);
+            wait_for_interrupt();
+        }
+        cpu_idling[cpu] = 0;
+        kernel_lock();
+    }
+}
+
+/** @brief Measure the local APIC timer against the TSC
+ *
+ *  The timer runs at the bus clock on every processor, so the boot
+ *  processor measures it for all.
+ *
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void calibrate_lapic_timer() {
+    int polls = 0;
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_X16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_IMASK | AP_TIMER_IDT_ENTRY);
+    lapic_write(LAPIC_TIMER_INIT, LAPIC_MAX_COUNT);
+    unsigned long long end = tsc_time_ns() + NS_PER_TICK;
+    while (tsc_time_ns() < end && polls < MAX_WAIT_POLLS) {
+        polls++;
+    }
+    lapic_counts_per_tick = LAPIC_MAX_COUNT - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    if (lapic_counts_per_tick == 0) {
+        lprintf("Local APIC timer does not count, no preemption on APs");
+    }
+}
+
+/** @brief Make the local APIC timer of this processor tick
+ *
+ *  @return void
+ */
+void start_lapic_timer() {
+    if (lapic_counts_per_tick == 0) {
+        return;
+    }
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_X16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_PERIODIC | AP_TIMER_IDT_ENTRY);
+    lapic_write(LAPIC_TIMER_INIT, lapic_counts_per_tick);
+}
+
+/** @brief Flush the TLB if another processor asked to
+ *
+ *  @pre interrupts are disabled
+ *  @param cpu this processor
+ *  @return void
+ */
+void serve_tlb_shootdown(int cpu) {
+    if (tlb_flush_pending[cpu]) {
+        flush_tlb();
+        tlb_flush_pending[cpu] = 0;
+    }
+}
+
+/** @brief Send an IPI to a processor
+ *
+ *  Waits for the local APIC to be done with the previous one first.
+ *
+ *  @param cpu the processor
+ *  @param vector the IDT entry
+ *  @return void
+ */
+void send_ipi(int cpu, int vector) {
+    while (lapic_read(LAPIC_ICRLO) & LAPIC_DELIVS) {
+        continue;
+    }
+    apic_ipi_cpu(cpu, vector);
+}
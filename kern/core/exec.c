@@ -1,7 +1,7 @@
 /** @file exec.c
  *
  *  File which implements the functions required for the exec
- *  system call.
+ *  and spawn system calls.
  *
  *  @author Rohit Upadhyaya (rjupadhy)
  *  @author Prajwal Yadapadithaya (pyadapad)
@@ -19,10 +19,16 @@
 #include <core/scheduler.h>
 #include <loader/loader.h>
 #include <syscalls/syscall_util.h>
+#include <core/wait_vanish.h>
 
+#define EXEC_FAIL_EXIT_STATUS -2
+
+static int read_program_args(void *arg_packet, program_image_t *image, 
+                             int *num_args, char ***argvec_kern);
 static int get_num_args(char **argvec);
 static char **copy_args(int num_args,char **argvec);
 static void free_args(char **argvec, int num);
+static void free_partial_args(char **argvec, int num_copied, int num_args);
 
 /** @brief The entry point for exec
  *
@@ -30,68 +36,152 @@ static void free_args(char **argvec, int num);
  *  the required arguments for exec.
  *
  *  @return nothing if the call succeeds. If exec
- *  fails, then a negative number is returned.
+ *  fails, then a negative number is returned and the old program keeps 
+ *  running. Only if another thread of the task unmaps memory while the 
+ *  old program is cleared can loading fail after that, and then the task
+ *  vanishes.
  */
 int do_exec(void *arg_packet) {
     task_struct_t *t = get_curr_task();
+    program_image_t image;
+    char **argvec_kern;
+    void *args;
+    int num_args, args_size, retval;
 
     /* Prevent multiple threads from same task from running exec at the 
      * same time */
     mutex_lock(&t->exec_mutex);
 
-    char *execname = (char *)(*((int *)arg_packet));
-    char **argvec = (char **)(*((int *)arg_packet + 1));
-    int num_args, retval;
+    /* Copy the argument vector into kernel space as we will be clearing
+     * the old process's address space soon */
+    retval = read_program_args(arg_packet, &image, &num_args, &argvec_kern);
+    if (retval < 0) {
+    	mutex_unlock(&t->exec_mutex);
+        return retval;
+    }
 
-    /* Copy execname to kernel memory after checking validity */
-    char execname_kern[EXECNAME_MAX];
-    if (execname_kern == NULL) {
+    /* Lay out the top of the new user stack while we can still fail */
+    args = prepare_user_args(num_args, argvec_kern, &args_size);
+    free_args(argvec_kern, num_args);
+    if (args == NULL) {
     	mutex_unlock(&t->exec_mutex);
         return ERR_NOMEM;
     }
-    if (copy_user_data(execname_kern, execname, EXECNAME_MAX) < 0) {
+
+    /* The new program is loaded into the same page directory, reusing the
+     * page tables and frames of the old one. The frames and page tables it
+     * needs are set aside before the old program is cleared */
+    retval = reset_paging_info(t->pdbr, &image.se_hdr);
+    if (retval < 0) {
+        sfree(args, args_size);
     	mutex_unlock(&t->exec_mutex);
+        return retval;
+    }
+    retval = load_program(&image, args, args_size, t);
+    trim_paging_info(t->pdbr);
+
+    mutex_unlock(&t->exec_mutex);
+
+    if (retval < 0) {
+        t->exit_status = EXEC_FAIL_EXIT_STATUS;
+        do_vanish();
+    }
+
+    return 0;
+}
+
+/** @brief The entry point for spawn
+ *
+ *  Starts a program in a new child task without cloning the address
+ *  space of the caller first, which is what fork() followed by exec()
+ *  would do.
+ *
+ *  @param arg_packet The address of argument packet containing 
+ *  the execname and argument vector of the program.
+ *
+ *  @return int the ID of the new task. If spawn fails, then a negative 
+ *  number is returned.
+ */
+int do_spawn(void *arg_packet) {
+    task_struct_t *curr_task = get_curr_task();
+    task_struct_t *child_task;
+    program_image_t image;
+    char **argvec_kern;
+    int num_args, retval;
+
+    retval = read_program_args(arg_packet, &image, &num_args, &argvec_kern);
+    if (retval < 0) {
+        return retval;
+    }
+    retval = spawn_task(&image, num_args, argvec_kern, curr_task, 
+                        &child_task);
+    free_args(argvec_kern, num_args);
+    if (retval < 0) {
+        return retval;
+    }
+
+    mutex_lock(&curr_task->vanish_mutex);
+    add_to_tail(&child_task->child_task_link, &curr_task->child_task_head);
+    mutex_unlock(&curr_task->vanish_mutex);
+
+    /* Add the first thread of the new task to runnable queue */
+    runq_add_thread(child_task->thr);
+
+    return child_task->id;
+}
+
+/** @brief Function to read the program to be run by exec or spawn
+ *
+ *  The execname and the argument vector are validated and copied to 
+ *  kernel memory and the program header is read.
+ *
+ *  @param arg_packet The user address of the execname and argument vector
+ *  @param image Filled with the program image
+ *  @param num_args Set to the number of arguments
+ *  @param argvec_kern Set to the arguments in kernel memory, to be freed 
+ *  with free_args() by the caller
+ *
+ *  @return int 0 on success, -ve integer on failure
+ */
+int read_program_args(void *arg_packet, program_image_t *image, 
+                      int *num_args, char ***argvec_kern) {
+    char *packet[2];
+    int retval;
+
+    if (copy_from_user(packet, arg_packet, sizeof(packet)) < 0) {
+        return ERR_INVAL;
+    }
+    char *execname = packet[0];
+    char **argvec = (char **)packet[1];
+
+    /* Copy execname to kernel memory after checking validity */
+    char execname_kern[EXECNAME_MAX];
+    if (strncpy_from_user(execname_kern, execname, EXECNAME_MAX) < 0) {
         return ERR_INVAL;
     }
 
     /* Check if program exists in ramdisk and is a valid ELF prog */
     retval = check_program(execname_kern);
     if (retval == PROG_ABSENT_INVALID) {
-    	mutex_unlock(&t->exec_mutex);
         return ERR_FAILURE;
     }
 
     /* Count number of arguments in argvec returning an error if exceeding
      * the maximum number of arguments */
-    num_args = get_num_args(argvec);
-    if (num_args < 0) {
-    	mutex_unlock(&t->exec_mutex);
+    *num_args = get_num_args(argvec);
+    if (*num_args < 0) {
         return ERR_FAILURE;
     }
-    void *old_pd = (void *)get_cr3();
-
-    /* Copy the argument vector into kernel space as we will be freeing
-     * the old process's address space soon */
-    char **argvec_kern = copy_args(num_args, argvec);
-    if (argvec_kern == NULL) {
-    	mutex_unlock(&t->exec_mutex);
+    *argvec_kern = copy_args(*num_args, argvec);
+    if (*argvec_kern == NULL) {
         return ERR_FAILURE;
     }
 
-    retval = load_task(execname_kern, num_args, argvec_kern, t);
+    retval = setup_program_image(execname_kern, image);
     if (retval < 0) {
-        free_args(argvec_kern, num_args);
-        set_cur_pd(old_pd);
-    	mutex_unlock(&t->exec_mutex);
+        free_args(*argvec_kern, *num_args);
         return retval;
     }
-
-    /* Free kernel argvec and execname */
-    free_paging_info(old_pd);
-    free_args(argvec_kern, num_args);
-
-    mutex_unlock(&t->exec_mutex);
-
     return 0;
 }
 
@@ -111,20 +201,22 @@ char **copy_args(int num_args,char **argvec) {
         return NULL;
     }
     for (i = 0; i < num_args; i++) {
+        char *user_arg;
         arg = (char *)smalloc(ARGNAME_MAX);
         if (arg == NULL) {
-            free_args(argvec_kern, i);
+            free_partial_args(argvec_kern, i, num_args);
             return NULL;
         }
-        if (copy_user_data(arg, argvec[i], ARGNAME_MAX) < 0) {
-            free_args(argvec_kern, i);
+        argvec_kern[i] = arg;
+        if (copy_from_user(&user_arg, &argvec[i], sizeof(char *)) < 0 ||
+            strncpy_from_user(arg, user_arg, ARGNAME_MAX) < 0) {
+            free_partial_args(argvec_kern, i + 1, num_args);
             return NULL;
         }
-        argvec_kern[i] = arg;
     }
     arg = (char *)smalloc(sizeof(char));
     if(arg == NULL) {
-        free_args(argvec_kern, num_args);
+        free_partial_args(argvec_kern, num_args, num_args);
         return NULL;
     }
     arg[0] = '\0';
@@ -148,6 +240,21 @@ void free_args(char **argvec, int num_args) {
     sfree(argvec, (num_args + 1) * sizeof(char *));
 }
 
+/** @brief free the kernel args of a partly copied argument vector
+ *
+ *  @param argvec the argument array to be freed
+ *  @param num_copied number of arguments copied so far
+ *  @param num_args number of arguments the array was allocated for
+ *
+ *  @return void
+ */
+void free_partial_args(char **argvec, int num_copied, int num_args) {
+    int i;
+    for (i = 0; i < num_copied; i++) {
+        sfree(argvec[i], ARGNAME_MAX);
+    }
+    sfree(argvec, (num_args + 1) * sizeof(char *));
+}
 
 /** @brief Function to get the number of arguments from
  *         the argument vector
@@ -161,16 +268,18 @@ void free_args(char **argvec, int num_args) {
  */
 int get_num_args(char **argvec) {
     int count = 0;
-    if (is_pointer_valid(argvec, sizeof(char *)) < 0) {
-        return ERR_INVAL;
-    }
+    char *arg;
 
-    while ((is_pointer_valid(argvec[count], sizeof(char *)) == 0)
-            && argvec[count] != '\0') {
+    while (1) {
+        if (copy_from_user(&arg, &argvec[count], sizeof(char *)) < 0) {
+            return ERR_INVAL;
+        }
+        if (arg == NULL) {
+            return count;
+        }
         count++;
         if (count > NUM_ARGS_MAX) {
             return ERR_BIG;
         }
     }
-    return count;
 }
@@ -56,6 +56,9 @@ int do_fork() {
 	child_task->swexn_args = curr_task->swexn_args;
 	child_task->swexn_esp = curr_task->swexn_esp;
 
+	/* The child pages in the same program as the parent */
+	child_task->image = curr_task->image;
+
 	/* Clone the kernel stack */
 	memcpy(child_task->thr->k_stack, curr_task->thr->k_stack, 
 							KERNEL_STACK_SIZE);
@@ -67,9 +70,6 @@ int do_fork() {
 	/* Add the first thread of the new task to runnable queue */
 	runq_add_thread(child_task->thr);
 
-	/* Dummy operation to invalidate TLB */
-	set_cur_pd(curr_task->pdbr);
-
 	mutex_unlock(&curr_task->fork_mutex);
 
 	return child_task->id;	
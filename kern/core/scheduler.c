@@ -14,26 +14,125 @@
 #include <core/sleep.h>
 #include <udriv/udriv.h>
 #include <drivers/timer/timer.h>
+#include <x86/asm.h>
+#include <x86/eflags.h>
+#include <core/cpu.h>
+#include <smp/smp.h>
 
-static thread_struct_t *curr_thread; /* The thread currently being run */
+/** @brief the scheduling state of a processor
+ *
+ *  A thread is queued on the processor it last ran on, or on the least
+ *  loaded one when it is new. A processor with an empty queue takes 
+ *  threads from the others.
+ */
+typedef struct runq {
+    thread_struct_t *curr_thread;   /* The thread currently being run */
+    thread_struct_t *idle_thread;   /* Run when there is nothing else */
+
+    /* Runnable threads, one FIFO queue per priority level */
+    list_head runnable_threads[NUM_PRIORITY_LEVELS];
+
+    /* Bit p is set when runnable_threads[p] is not empty */
+    unsigned int runq_bitmap;
+
+    int nr_queued;                  /* Threads in the queues */
+    unsigned int last_tick;         /* Tick of the last timer interrupt */
+} runq_t;
+
+static runq_t runqs[MAX_CPUS];
+
+/* Threads queued on all the processors, read by idle processors without
+ * the kernel lock */
+static volatile int total_queued;
 
-static list_head runnable_threads;    /* List of runnable threads */
+/* Bumped on every priority boost. Threads which missed a boost while they
+ * were blocked catch up when they are queued again */
+static unsigned int boost_epoch;
 
-static thread_struct_t *runq_get_head();
+static unsigned int last_boost_tick;    /* Tick of the last boost check */
+
+static thread_struct_t *runq_get_head(runq_t *rq);
+static thread_struct_t *runq_steal();
+static void runq_enqueue(thread_struct_t *thr);
+static void runq_dequeue(thread_struct_t *thr);
+static void boost_priorities();
+static int least_loaded_cpu();
 
 /** @brief initialize the scheduler data structures
  *
  *  @return void
  */
 void init_scheduler() {
-	init_head(&runnable_threads);
+    int cpu, i;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+	        init_head(&runqs[cpu].runnable_threads[i]);
+        }
+        runqs[cpu].runq_bitmap = 0;
+        runqs[cpu].nr_queued = 0;
+    }
+    total_queued = 0;
     init_sleeping_threads();
 }
 
+/** @brief set up the scheduling state of a new thread
+ *
+ *  A thread starts at the base priority of the thread creating it, or at
+ *  DEFAULT_PRIORITY if there is none. It is queued on the least loaded
+ *  processor.
+ *
+ *  @param thr the new thread, not yet runnable
+ *  @return void
+ */
+void sched_init_thread(thread_struct_t *thr) {
+    thread_struct_t *creator = get_curr_thread();
+    thr->base_priority = (creator != NULL) ? creator->base_priority 
+                                           : DEFAULT_PRIORITY;
+    thr->priority = thr->base_priority;
+    thr->time_slice = TIME_SLICE(thr->priority);
+    thr->boost_epoch = boost_epoch;
+    thr->on_runq = 0;
+    thr->cpu = least_loaded_cpu();
+}
+
+/** @brief set the idle thread of a processor
+ *
+ *  @param cpu the processor
+ *  @param thr the idle thread, which is never queued
+ *  @return void
+ */
+void set_idle_thread(int cpu, thread_struct_t *thr) {
+    runqs[cpu].idle_thread = thr;
+    thr->cpu = cpu;
+}
+
+/** @brief get the idle thread of this processor
+ *
+ *  @return thread_struct_t the idle thread
+ */
+thread_struct_t *get_idle_thread() {
+    return runqs[this_cpu()].idle_thread;
+}
+
+/** @brief check if an idle processor has anything to run
+ *
+ *  Called without the kernel lock, so the answer is only a hint.
+ *
+ *  @return int non zero if some thread is queued or a driver thread is 
+ *          pending
+ */
+int runq_work_pending() {
+    return total_queued != 0 || udriv_thread_pending();
+}
+
 /** @brief return the next thread to be run
  *
- *  Implements a round robin scheduling strategy. Returns the next thread
- *  to be run. This will be invoked by context switching code ONLY.
+ *  Driver threads with pending interrupts run first. Otherwise the head
+ *  of the highest priority non empty queue of this processor is 
+ *  returned. The queue is found with a single bit scan of runq_bitmap, 
+ *  so picking a thread takes constant time. If this processor has 
+ *  nothing queued, a thread is taken from another one. This will be
+ *  invoked by context switching code ONLY.
  *
  *  @return thread_struct_t a struct containing scheduling information 
  *                          for the next thread
@@ -46,32 +145,108 @@ thread_struct_t *next_thread() {
         return udriv_thread;
     }
 
-    /* See if any sleeping thread can be woken up */
-    thread_struct_t *sleeping_thread = get_sleeping_thread();
-    if (sleeping_thread != NULL) {
-        return sleeping_thread;
+    /* Get the thread at the head of the highest priority queue */
+    thread_struct_t *thr = runq_get_head(&runqs[this_cpu()]);
+    if (thr == NULL) {
+        thr = runq_steal();
     }
+    return thr;
+}
 
-    /* Get the thread at the head of the runqueue */
-    thread_struct_t *head = runq_get_head();
-    if (head == NULL) {
-        return NULL;
+/** @brief account the ticks since the last timer interrupt to the 
+ *         running thread
+ *
+ *  Sleepers whose time is up are queued. A thread which uses up its time
+ *  slice drops one priority level, so CPU bound threads sink below
+ *  interactive ones. Every BOOST_INTERVAL ticks all threads go back to
+ *  their base priority so that nothing starves. 
+ *
+ *  The timer need not interrupt again until the running thread may have 
+ *  to give way: when its time slice ends if other threads are waiting, 
+ *  or when the next sleeper wakes up. Called from the timer interrupt 
+ *  of each processor with interrupts disabled. Only the PIT of the boot 
+ *  processor skips ticks, the local APIC timers tick all the time.
+ *
+ *  @param ticks the number of ticks since startup
+ *  @param next_ticks set to the number of ticks until the next timer
+ *         interrupt is needed
+ *  @return int 1 if the running thread should be preempted, 0 if it may
+ *          carry on
+ */
+int scheduler_tick(unsigned int ticks, int *next_ticks) {
+    runq_t *rq = &runqs[this_cpu()];
+    thread_struct_t *thr = rq->curr_thread;
+    int elapsed = ticks - rq->last_tick;
+    if (ticks / BOOST_INTERVAL != last_boost_tick / BOOST_INTERVAL) {
+        boost_priorities();
+    }
+    last_boost_tick = ticks;
+    rq->last_tick = ticks;
+    wake_sleeping_threads(ticks);
+
+    *next_ticks = 1;
+    if (thr == NULL || thr->status != RUNNING) {
+        return 1;
+    }
+    if (thr == rq->idle_thread) {
+        /* Nothing to preempt, skip ticks until there is something to run
+         * here or to take from another processor. The switch lets the 
+         * idle path do its housekeeping */
+        if (total_queued == 0 && !udriv_thread_pending()) {
+            *next_ticks = ticks_until_wakeup();
+        }
+        return 1;
     }
-    return head;
+    if (thr->boost_epoch != boost_epoch) {
+        thr->boost_epoch = boost_epoch;
+        thr->priority = thr->base_priority;
+        thr->time_slice = TIME_SLICE(thr->priority);
+    }
+    thr->time_slice -= elapsed;
+    if (thr->time_slice <= 0) {
+        if (thr->priority < NUM_PRIORITY_LEVELS - 1) {
+            thr->priority++;
+        }
+        thr->time_slice = TIME_SLICE(thr->priority);
+        return 1;
+    }
+
+    /* Carry on unless something more important became runnable */
+    if (udriv_thread_pending() || 
+        (rq->runq_bitmap & ((1 << thr->priority) - 1)) != 0) {
+        return 1;
+    }
+    *next_ticks = ticks_until_wakeup();
+    if (rq->runq_bitmap != 0 && thr->time_slice < *next_ticks) {
+        *next_ticks = thr->time_slice;
+    }
+    return 0;
 }
 
-/** @brief Function to get the first thread present in the runnable queue.
+/** @brief set the base priority of a thread
  *
- *  @return thread_struct_t * Pointer to the thread struct.
+ *  The thread restarts at the new level with a full time slice.
+ *
+ *  @param thr the thread
+ *  @param priority the new priority, 0 being the highest
+ *  @return void
  */
-thread_struct_t *runq_get_head() {
-    list_head *head = get_first(&runnable_threads);
-    if (head == NULL) {
-        return NULL;
+void set_thread_priority(thread_struct_t *thr, int priority) {
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int queued = thr->on_runq;
+    if (queued) {
+        runq_dequeue(thr);
+    }
+    thr->base_priority = priority;
+    thr->priority = priority;
+    thr->time_slice = TIME_SLICE(priority);
+    if (queued) {
+        runq_enqueue(thr);
+    }
+    if (int_flag) {
+        enable_interrupts();
     }
-    thread_struct_t *head_thread = get_entry(head, thread_struct_t, runq_link);
-    del_entry(head);
-    return head_thread;
 }
 
 /** @brief Function to add a particular thread to the runnable queue.
@@ -85,7 +260,7 @@ thread_struct_t *runq_get_head() {
  */
 void runq_add_thread(thread_struct_t *thr) {
     disable_interrupts();
-    add_to_tail(&thr->runq_link, &runnable_threads);
+    runq_enqueue(thr);
     enable_interrupts();
 }
 
@@ -99,26 +274,28 @@ void runq_add_thread(thread_struct_t *thr) {
  *  @return void
  */
 void runq_add_thread_interruptible(thread_struct_t *thr) {
-    add_to_tail(&thr->runq_link, &runnable_threads);
+    runq_enqueue(thr);
 }
 
-/** @brief get the currently running thread
+/** @brief get the thread running on this processor
  *
  *  @return thread_struct_t thread info of the currently running thread
  */
 thread_struct_t *get_curr_thread() {
-    return curr_thread;
+    return runqs[this_cpu()].curr_thread;
 }
 
-/** @brief get the currently running task
+/** @brief get the task running on this processor
  *
  *  @return task_struct_t Task info of the current task
  */
 task_struct_t *get_curr_task() {
-	return curr_thread->parent_task;
+	return get_curr_thread()->parent_task;
 }
 
-/** @brief Set the currently running thread
+/** @brief Set the thread running on this processor
+ *
+ *  The thread is queued here from now on when it is runnable again.
  *
  *  @param thr The thread struct for the thread to be set
  *  as the currently running thread
@@ -126,7 +303,11 @@ task_struct_t *get_curr_task() {
  *  @return void
  */
 void set_running_thread(thread_struct_t *thr) {
-    curr_thread = thr;
+    int cpu = this_cpu();
+    runqs[cpu].curr_thread = thr;
+    if (thr != NULL) {
+        thr->cpu = cpu;
+    }
 }
 
 /** @brief Prints the runnable thread list
@@ -136,12 +317,158 @@ void set_running_thread(thread_struct_t *thr) {
  *  @return void
  */
 void print_runnable_list() {
-	list_head *temp = get_first(&runnable_threads);
+	int cpu, i;
 	lprintf("-------Beginning of runnable threads--------");
-	while(temp != NULL && temp != &runnable_threads) {
-		thread_struct_t *thr = get_entry(temp, thread_struct_t, runq_link);
-		lprintf("-------Thread %d-------", thr->id);
-		temp = temp->next;
+	for(cpu = 0; cpu < get_num_cpus(); cpu++) {
+		for(i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+			list_head *head = &runqs[cpu].runnable_threads[i];
+			list_head *temp = get_first(head);
+			while(temp != NULL && temp != head) {
+				thread_struct_t *thr = get_entry(temp, thread_struct_t, 
+												 runq_link);
+				lprintf("-------Thread %d cpu %d priority %d-------", 
+						thr->id, cpu, i);
+				temp = temp->next;
+			}
+		}
 	}
 	lprintf("--------End of runnable threads-------");
 }
+
+/* ---------- Static local functions ----------- */
+
+/** @brief Function to get the first thread of the highest priority 
+ *         non empty queue of a processor.
+ *
+ *  @param rq the scheduling state of the processor
+ *  @return thread_struct_t * Pointer to the thread struct.
+ */
+thread_struct_t *runq_get_head(runq_t *rq) {
+    if (rq->runq_bitmap == 0) {
+        return NULL;
+    }
+    int level = __builtin_ctz(rq->runq_bitmap);
+    list_head *head = get_first(&rq->runnable_threads[level]);
+    thread_struct_t *head_thread = get_entry(head, thread_struct_t, runq_link);
+    runq_dequeue(head_thread);
+    return head_thread;
+}
+
+/** @brief take the most important thread queued on another processor
+ *
+ *  @return thread_struct_t the thread, NULL if nothing is queued
+ */
+thread_struct_t *runq_steal() {
+    int cpu, victim = -1, level = NUM_PRIORITY_LEVELS;
+    if (total_queued == 0) {
+        return NULL;
+    }
+    for (cpu = 0; cpu < get_num_cpus(); cpu++) {
+        unsigned int bitmap = runqs[cpu].runq_bitmap;
+        if (bitmap != 0 && __builtin_ctz(bitmap) < level) {
+            level = __builtin_ctz(bitmap);
+            victim = cpu;
+        }
+    }
+    return (victim < 0) ? NULL : runq_get_head(&runqs[victim]);
+}
+
+/** @brief add a thread to the tail of the queue of its priority
+ *
+ *  A thread which was blocked through a priority boost gets it now.
+ *
+ *  @pre interrupts are disabled
+ *  @param thr the thread
+ *  @return void
+ */
+void runq_enqueue(thread_struct_t *thr) {
+    runq_t *rq = &runqs[thr->cpu];
+    if (thr->boost_epoch != boost_epoch) {
+        thr->boost_epoch = boost_epoch;
+        thr->priority = thr->base_priority;
+        thr->time_slice = TIME_SLICE(thr->priority);
+    }
+    add_to_tail(&thr->runq_link, &rq->runnable_threads[thr->priority]);
+    rq->runq_bitmap |= (1 << thr->priority);
+    rq->nr_queued++;
+    total_queued++;
+    thr->on_runq = 1;
+
+    /* The timer may be skipping ticks, the thread has to be noticed */
+    request_next_timer_interrupt();
+
+    /* So does an idle processor. A thread preempted here is picked again
+     * right away if nothing else is queued */
+    if (thr != runqs[this_cpu()].curr_thread) {
+        wake_idle_cpu(thr->cpu);
+    }
+}
+
+/** @brief remove a thread from the queue of its priority
+ *
+ *  @pre interrupts are disabled
+ *  @param thr the thread, queued
+ *  @return void
+ */
+void runq_dequeue(thread_struct_t *thr) {
+    runq_t *rq = &runqs[thr->cpu];
+    del_entry(&thr->runq_link);
+    if (get_first(&rq->runnable_threads[thr->priority]) == NULL) {
+        rq->runq_bitmap &= ~(1 << thr->priority);
+    }
+    rq->nr_queued--;
+    total_queued--;
+    thr->on_runq = 0;
+}
+
+/** @brief move every thread back to its base priority
+ *
+ *  Queued threads are moved right away, the others when they are next 
+ *  queued or ticked.
+ *
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void boost_priorities() {
+    int cpu, i;
+    boost_epoch++;
+    for (cpu = 0; cpu < get_num_cpus(); cpu++) {
+        for (i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+            list_head *head = &runqs[cpu].runnable_threads[i];
+            list_head *node = get_first(head);
+            while (node != NULL && node != head) {
+                list_head *next = node->next;
+                thread_struct_t *thr = get_entry(node, thread_struct_t, 
+                                                 runq_link);
+                if (thr->priority != thr->base_priority) {
+                    runq_dequeue(thr);
+                    runq_enqueue(thr);
+                } else {
+                    thr->boost_epoch = boost_epoch;
+                }
+                node = next;
+            }
+        }
+    }
+}
+
+/** @brief find the online processor with the least threads to run
+ *
+ *  @return int the processor
+ */
+int least_loaded_cpu() {
+    int cpu, best = 0, best_load = -1;
+    for (cpu = 0; cpu < get_num_cpus(); cpu++) {
+        runq_t *rq = &runqs[cpu];
+        if (!is_cpu_online(cpu)) {
+            continue;
+        }
+        int load = rq->nr_queued + (rq->curr_thread != NULL && 
+                                    rq->curr_thread != rq->idle_thread);
+        if (best_load < 0 || load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
@@ -13,25 +13,43 @@
 #include <simics.h>
 #include <list/list.h>
 #include <drivers/timer/timer.h>
+#include <drivers/timer/tsc.h>
+#include <limits.h>
 #include <core/context.h>
 #include <core/thread.h>
-#include <sync/mutex.h> 
 #include <asm.h>
-#include <common/malloc_wrappers.h>
 
-static list_head *sleeping_threads;    /* List of threads that are 'sleep'ing */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)        /* Slots per level */
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1 << (WHEEL_BITS * WHEEL_LEVELS)) /* Ticks covered */
 
-static mutex_t sleep_list_mutex;
+/* Slot of the wheel holding a wake time at a level */
+#define WHEEL_SLOT(wake_time, level) \
+    (((wake_time) >> ((level) * WHEEL_BITS)) & WHEEL_MASK)
 
-/** @brief Function to initialize the list of sleeping threads
+/* Sleeping threads. Slot i of level l holds the threads waking in the
+ * i-th (mod WHEEL_SIZE) block of WHEEL_SIZE^l ticks */
+static list_head sleep_wheel[WHEEL_LEVELS][WHEEL_SIZE];
+
+static unsigned int wheel_time;     /* Last tick the wheel has reached */
+
+static void wheel_insert(thread_struct_t *thr);
+static void wheel_cascade(int level);
+
+/** @brief Function to initialize the wheel of sleeping threads
  *
  *  @return void
  */
 void init_sleeping_threads() {
-    mutex_init(&sleep_list_mutex);
-    sleeping_threads = (list_head *)smalloc(sizeof(list_head));
-    kernel_assert(sleeping_threads != NULL);
-    init_head(sleeping_threads);
+    int i, j;
+    for (i = 0; i < WHEEL_LEVELS; i++) {
+        for (j = 0; j < WHEEL_SIZE; j++) {
+            init_head(&sleep_wheel[i][j]);
+        }
+    }
+    wheel_time = total_ticks();
 }
 
 /** @brief The entry point for sleep
@@ -52,77 +70,152 @@ int do_sleep(int ticks) {
 
 }
 
-/** @brief return next sleeping thread ready to be woken if any
+/** @brief move every thread whose wake time has come to the run queues
  *
- *  Check if the first sleeping thread is ready to be woken up (based on
- *  the current ticks and the first thread's wake time). If any thread is
- *  to be woken up, return that. Else return NULL.
+ *  Turns the wheel one tick at a time up to now. Whenever the slots of a
+ *  level wrap around, the next slot of the level above is spread out over
+ *  the levels below. Then every thread in the current slot of the lowest
+ *  level is due. Called from the timer interrupt with interrupts disabled.
  *
- *  @return thread_struct_t NULL if no thread existing or ready to be woken up
+ *  @param now the number of ticks since startup
+ *  @return void
  */
-thread_struct_t *get_sleeping_thread() {
-    /* Check if any sleeping thread can be woken up */
-    if (sleeping_threads != NULL) {
-        list_head *thr_entry = get_first(sleeping_threads);
-        if (thr_entry != NULL) {
-            int curr_ticks = total_ticks();
-            thread_struct_t *thr = get_entry(thr_entry, thread_struct_t, 
+void wake_sleeping_threads(unsigned int now) {
+    while (wheel_time != now) {
+        wheel_time++;
+        int level = 1;
+        while (level < WHEEL_LEVELS && 
+               WHEEL_SLOT(wheel_time, level - 1) == 0) {
+            wheel_cascade(level++);
+        }
+
+        list_head *slot = &sleep_wheel[0][WHEEL_SLOT(wheel_time, 0)];
+        list_head *entry;
+        while ((entry = get_first(slot)) != NULL) {
+            thread_struct_t *thr = get_entry(entry, thread_struct_t, 
                                              sleepq_link);
-            if (thr->wake_time < curr_ticks) {
-                del_entry(&thr->sleepq_link);
-                return thr;
-            }
+            del_entry(entry);
+            thr->status = RUNNABLE;
+            runq_add_thread_interruptible(thr);
         }
     }
-    return NULL;
 }
 
+/** @brief The entry point for sleep_ns
+ *
+ *  Sleeps on the wheel until the first tick which starts at or after the
+ *  deadline, then yields until the time stamp counter says the time is 
+ *  up. The two clocks only disagree by a fraction of a tick, so that is 
+ *  all the sleep ever spins for.
+ *
+ *  @param ns the number of nanoseconds to sleep for
+ *  @return int 0
+ */
+int do_sleep_ns(unsigned long long ns) {
+    unsigned long long deadline = tsc_time_ns() + ns;
+
+    /* A sleep of k ticks runs out k ticks after the next one starts */
+    unsigned long long to_next_tick = ns_until_next_tick();
+    unsigned long long ticks = 0;
+    if (ns > to_next_tick) {
+        ticks = (ns - to_next_tick + NS_PER_TICK - 1) / NS_PER_TICK;
+    }
+    if (ns > 0) {
+        schedule_sleep(ticks >= INT_MAX ? INT_MAX : (int)ticks);
+    }
+    while (tsc_time_ns() < deadline) {
+        context_switch();
+    }
+    return 0;
+}
+
+/** @brief the number of ticks until a sleeper may have to be woken up
+ *
+ *  Cascades may move threads into the lowest level, so the wheel has to 
+ *  be turned at the next cascade even if no thread is due before it.
+ *
+ *  @pre interrupts are disabled
+ *  @return int the number of ticks after the current one, at most 
+ *          WHEEL_SIZE
+ */
+int ticks_until_wakeup() {
+    int i;
+    for (i = 1; i < WHEEL_SIZE; i++) {
+        unsigned int tick = wheel_time + i;
+        if (WHEEL_SLOT(tick, 0) == 0 || 
+            get_first(&sleep_wheel[0][WHEEL_SLOT(tick, 0)]) != NULL) {
+            return i;
+        }
+    }
+    return WHEEL_SIZE;
+}
 
 /** @brief schedule a thread for sleeping
  *
  *  calculate the time at which the current thread will be woken up given
- *  the number of ticks that the thread has to sleep. Then obtain a lock 
- *  on the sleeping thread queue, temporarily set the sleeping thread head to 
- *  NULL (so that the scheduler can run in parallel and not interfere with 
- *  the code to maintain the list in sorted order). Then we find the right 
- *  position for this thread based on the time it has to wake up, with the 
- *  head of the queue being the earliest wake time.
+ *  the number of ticks that the thread has to sleep, and put the thread in
+ *  the slot of the wheel for that time. It is woken on the first tick 
+ *  after its wake time.
  *
  *  @param ticks number of ticks to sleep for
  *  @return void
  */
 void schedule_sleep(int ticks) {
     thread_struct_t *thr = get_curr_thread();
-    int curr_ticks = total_ticks();
-
-	/* In case the integer overflow, we don't sleep */
-	if(curr_ticks + ticks < curr_ticks) {
-		return;
-	}
-
-    thr->wake_time = curr_ticks + ticks;
-
-    mutex_lock(&sleep_list_mutex);
-    list_head *temp_head = sleeping_threads;
-    sleeping_threads = NULL;
-    list_head *entry = get_first(temp_head);
-    while (entry != NULL && entry != temp_head) {
-        thread_struct_t *thread = get_entry(entry, thread_struct_t, 
-                                            sleepq_link);
-        if (thread->wake_time > thr->wake_time) {
-            break;
-        }
-        entry = entry->next;
-    }
-    if (entry == NULL) {
-        add_to_tail(&thr->sleepq_link, temp_head);
-    }
-    else {
-        add_to_list(&thr->sleepq_link, entry->prev, entry);
-    }
-    mutex_unlock(&sleep_list_mutex);
+
     disable_interrupts();
-    sleeping_threads = temp_head;
+    thr->wake_time = total_ticks() + ticks + 1;
+    wheel_insert(thr);
     thr->status = WAITING;
     context_switch();
 }
+
+/* ---------- Static local functions ----------- */
+
+/** @brief put a sleeping thread in its slot of the wheel
+ *
+ *  The level is the lowest one whose slots are wide enough to hold the
+ *  wake time without wrapping around. A wake time equal to the current 
+ *  tick, which only comes from a cascade, lands in the slot about to be
+ *  emptied. Wake times further out than the whole wheel are parked in
+ *  the top level and placed again when it cascades.
+ *
+ *  @pre interrupts are disabled
+ *  @param thr the thread, with its wake time set
+ *  @return void
+ */
+void wheel_insert(thread_struct_t *thr) {
+    unsigned int delta = thr->wake_time - wheel_time;
+    unsigned int wake_time = thr->wake_time;
+    int level = 0;
+
+    if (delta >= WHEEL_SPAN) {
+        wake_time = wheel_time + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    while (level < WHEEL_LEVELS - 1 && 
+           delta >= (1 << ((level + 1) * WHEEL_BITS))) {
+        level++;
+    }
+    add_to_tail(&thr->sleepq_link, 
+                &sleep_wheel[level][WHEEL_SLOT(wake_time, level)]);
+
+    /* The timer may be set to skip the ticks up to the wake time */
+    request_timer_interrupt(thr->wake_time);
+}
+
+/** @brief spread the threads of the current slot of a level over the
+ *         levels below
+ *
+ *  @pre interrupts are disabled
+ *  @param level the level, above the lowest
+ *  @return void
+ */
+void wheel_cascade(int level) {
+    list_head *slot = &sleep_wheel[level][WHEEL_SLOT(wheel_time, level)];
+    list_head *entry;
+    while ((entry = get_first(slot)) != NULL) {
+        del_entry(entry);
+        wheel_insert(get_entry(entry, thread_struct_t, sleepq_link));
+    }
+}
@@ -7,6 +7,7 @@
 #include <common/malloc_wrappers.h>
 #include <seg.h>
 #include <cr.h>
+#include <asm.h>
 #include <vm/vm.h>
 #include <simics.h>
 #include <stddef.h>
@@ -15,6 +16,7 @@
 #include <asm/asm.h>
 #include <core/thread.h>
 #include <core/scheduler.h>
+#include <core/cpu.h>
 #include <loader/loader.h>
 #include <ureg.h>
 #include <syscall.h>
@@ -26,13 +28,14 @@
 #define EFLAGS_IOPL 0x00000000 
 #define EFLAGS_IF 0x00000200 
 #define EFLAGS_ALIGNMENT_CHECK 0xFFFbFFFF
+#define USER_STACK_FRAME_WORDS 5 /* Return address and _main()'s arguments */
 	
 static task_struct_t *init_task;
 static task_struct_t *idle_task;
 static uint32_t setup_user_eflags();
 static void set_task_stack(void *kernel_stack_base, int entry_addr,
                            void *user_stack_top);
-static void *copy_user_args(int num_args, char **argvec);
+static void *place_user_args(void *args, int args_size, void *pd);
 static void init_task_structures(task_struct_t *t);
 
 
@@ -148,29 +151,32 @@ void load_bootstrap_task(char *prog_name) {
     t->pdbr = pd_addr;
 
     /* Read the idle task header to set up VM */
-	simple_elf_t se_hdr;
-
-    elf_load_helper(&se_hdr, prog_name);
-    
-    /* Invoke VM to setup the page directory/page table for a given binary */
-    retval = setup_page_table(&se_hdr, pd_addr);
+    retval = setup_program_image(prog_name, &t->image);
     kernel_assert(retval == 0);
-
-    /* Copy program into memory */
-    retval = load_program(&se_hdr);
+    
+    /* Invoke VM to setup the page directory/page table for a given binary.
+     * The program is paged in from the ramdisk as it runs */
+    retval = setup_page_table(&t->image.se_hdr, pd_addr);
     kernel_assert(retval == 0);
 
+	set_idle_thread(0, t->thr);
 	set_running_thread(t->thr);
 	t->thr->status = RUNNING;
     set_esp0(t->thr->k_stack_base);
 
 	uint32_t EFLAGS = setup_user_eflags();
-	unsigned long entry = se_hdr.e_entry;
+	unsigned long entry = t->image.se_hdr.e_entry;
 	
 	idle_task = t;
 
+	/* The application processors run their own idle threads */
+	start_cpus();
+
 	enable_mutex_lib(); /* We need to enable mutex library */
 
+	/* Leave the kernel like every other way out to user mode does */
+	disable_interrupts();
+	kernel_unlock();
 	call_iret(EFLAGS, entry);
 }
 
@@ -199,33 +205,112 @@ int load_task(char *prog_name, int num_args, char **argvec,
 
     t->pdbr = pd_addr;
 
-    /* Read the idle task header to set up VM */
-	simple_elf_t se_hdr;
-
-    elf_load_helper(&se_hdr, prog_name);
-    
-    /* Invoke VM to setup the page directory/page table for a given binary */
-    retval = setup_page_table(&se_hdr, pd_addr);
+    /* Read the program header to set up VM */
+	program_image_t image;
+    retval = setup_program_image(prog_name, &image);
     if (retval < 0) {
         return retval;
     }
+    
+    int args_size;
+    void *args = prepare_user_args(num_args, argvec, &args_size);
+    if (args == NULL) {
+        return ERR_NOMEM;
+    }
+    return load_program(&image, args, args_size, t);
+}
 
-    /* Copy program into memory */
-    retval = load_program(&se_hdr);
+/** @brief Function to load a program into the address space of a task
+ *
+ *  The page directory of the task must not map anything in user space 
+ *  yet. It need not be the current one.
+ *
+ *  @param image The program image obtained from setup_program_image
+ *  @param args The top of the user stack from prepare_user_args(), freed
+ *              by this function
+ *  @param args_size The size of args
+ *  @param t Reference to the task to which the program must be 
+ *  		 loaded
+ *
+ *  @return 0 on success -ve integer on failure
+ */
+int load_program(program_image_t *image, void *args, int args_size,
+                 task_struct_t *t) {
+
+	int retval;
+    /* Invoke VM to setup the page directory/page table for a given binary.
+     * The program is paged in from the ramdisk as it runs */
+    retval = setup_page_table(&image->se_hdr, t->pdbr);
     if (retval < 0) {
+        sfree(args, args_size);
         return retval;
     }
 
     /* Copy arguments onto user stack */
-    void *user_stack_top = copy_user_args(num_args, argvec);
+    void *user_stack_top = place_user_args(args, args_size, t->pdbr);
     if (user_stack_top == NULL) {
         return ERR_FAILURE;
     }
 
 	set_task_stack((void *)t->thr->k_stack_base, 
-					se_hdr.e_entry, user_stack_top);
+					image->se_hdr.e_entry, user_stack_top);
+	t->thr->cur_esp = (t->thr->k_stack_base - DEFAULT_STACK_OFFSET);
+	t->image = *image;
+
+    return 0;
+}
+
+/** @brief Function to create a task running a program
+ *
+ *  Unlike fork() nothing of the parent is copied. The child gets a new
+ *  address space with the program loaded and starts at its entry point. 
+ *  Everything which may fail is done before the task is created, so the 
+ *  task never needs to be torn down again.
+ *
+ *  @param image The program image obtained from setup_program_image
+ *  @param num_args Number of arguments to the program
+ *  @param argvec Character array of the arguments in kernel memory
+ *  @param parent The parent of the new task
+ *  @param child Set to the new task, which is not runnable yet
+ *
+ *  @return 0 on success -ve integer on failure
+ */
+int spawn_task(program_image_t *image, int num_args, char **argvec,
+               task_struct_t *parent, task_struct_t **child) {
+    int retval;
+    void *pd_addr = create_page_directory();
+    if (pd_addr == NULL) {
+        return ERR_NOMEM;
+    }
+    retval = setup_page_table(&image->se_hdr, pd_addr);
+    if (retval < 0) {
+        free_paging_info(pd_addr);
+        return retval;
+    }
+    int args_size;
+    void *args = prepare_user_args(num_args, argvec, &args_size);
+    if (args == NULL) {
+        free_paging_info(pd_addr);
+        return ERR_NOMEM;
+    }
+    void *user_stack_top = place_user_args(args, args_size, pd_addr);
+    if (user_stack_top == NULL) {
+        free_paging_info(pd_addr);
+        return ERR_NOMEM;
+    }
+
+	task_struct_t *t = create_task(parent);
+    if (t == NULL) {
+        free_paging_info(pd_addr);
+        return ERR_NOMEM;
+    }
+    t->pdbr = pd_addr;
+	t->image = *image;
+	set_task_stack((void *)t->thr->k_stack_base, 
+					image->se_hdr.e_entry, user_stack_top);
 	t->thr->cur_esp = (t->thr->k_stack_base - DEFAULT_STACK_OFFSET);
 
+    *child = t;
     return 0;
 }
 
@@ -258,45 +343,78 @@ void set_task_stack(void *kernel_stack_base, int entry_addr,
 	*((int *)(kernel_stack_base) - IRET_FUN_OFFSET) = (int)iret_fun;
 }
 
-/** @brief Function to copy the arguments to a given program
- *  on to the user space task stack
+/** @brief Function to lay out the arguments to a given program
+ *  for the top of its user stack
+ *
+ *  The top of the stack is laid out in kernel memory, to be copied to 
+ *  the stack in one go with place_user_args(). This also works for a task
+ *  which is not running yet, and exec does it before the old program is
+ *  cleared as it is the last thing loading a program could fail on.
  *
  *  @param num_args Number of arguments to the program
  *  @param argvec Character array of the argument vector
+ *  @param size Set to the size of the top of the stack
  *
- *  @return void* Address of the top of user stack
+ *  @return void* The top of the stack, to be freed with sfree() if it is
+ *          not placed. NULL on failure
  */
-void *copy_user_args(int num_args, char **argvec) {
-    char *user_stack_top = (char *)STACK_START;
-    char **argvec_copy = (char **)smalloc((num_args + 1) * sizeof(char *));
-    if (argvec_copy == NULL) {
+void *prepare_user_args(int num_args, char **argvec, int *size) {
+    int i, len = 1 + (num_args + 1) * sizeof(char *) + 
+                 USER_STACK_FRAME_WORDS * sizeof(int);
+    for (i = 0; i < num_args; i++) {
+        len += strlen(argvec[i]) + 1;
+    }
+    len = (len + sizeof(int) - 1) & ~(sizeof(int) - 1);
+    char *buf = (char *)smalloc(len);
+    if (buf == NULL) {
         return NULL;
     }
-    int i;
+    /* buf holds what goes in [user_stack_top, STACK_START) */
+    char *user_stack_top = (char *)STACK_START - len;
+    int argv_offset = USER_STACK_FRAME_WORDS * sizeof(int);
+    char **argvec_usr = (char **)(buf + argv_offset);
+    int offset = len;
     for (i = 0; i < num_args; i++) {
-        user_stack_top -= strlen(argvec[i]) + 1;
-        strcpy((void *)user_stack_top, argvec[i]);
-        argvec_copy[i] = user_stack_top;
+        offset -= strlen(argvec[i]) + 1;
+        strcpy(buf + offset, argvec[i]);
+        argvec_usr[i] = user_stack_top + offset;
     }
-    user_stack_top -= 1;
-    *user_stack_top ='\0';
-    argvec_copy[i] = (char *)user_stack_top;
-    user_stack_top -= (num_args + 1) * sizeof(char *);
-    memcpy(user_stack_top, (void *)argvec_copy, (num_args + 1) * sizeof(char *));
-    char **argvec_usr = (char **)user_stack_top;
-    user_stack_top -= sizeof(int *);
-    *(int *)user_stack_top = STACK_END;
-    user_stack_top -= sizeof(int *);
-    *(int *)user_stack_top = STACK_START;
-    user_stack_top -= sizeof(char **);
-    *(int *)user_stack_top = (int)argvec_usr;
-    user_stack_top -= sizeof(int *);
-    *user_stack_top = (int)num_args;
-    user_stack_top -= sizeof(int *);
-    *user_stack_top = (int)0;
-    sfree(argvec_copy, (num_args + 1) * sizeof(char *));
-
-    return user_stack_top;
+    offset -= 1;
+    buf[offset] = '\0';
+    argvec_usr[i] = user_stack_top + offset;
+
+    /* The frame _main() is entered with */
+    int *frame = (int *)buf;
+    frame[0] = 0;                                   /* Return address */
+    frame[1] = num_args;
+    frame[2] = (int)(user_stack_top + argv_offset);
+    frame[3] = STACK_START;
+    frame[4] = STACK_END;
+
+    *size = len;
+    return buf;
+}
+
+/** @brief Function to copy the arguments laid out by prepare_user_args()
+ *  on to the user space task stack
+ *
+ *  @param args The top of the stack, freed by this function
+ *  @param args_size The size of the top of the stack
+ *  @param pd The page directory of the task
+ *
+ *  @return void* Address of the top of user stack. NULL on failure
+ */
+void *place_user_args(void *args, int args_size, void *pd) {
+    char *user_stack_top = (char *)STACK_START - args_size;
+    int retval = 0;
+    if (pd == (void *)get_cr3()) {
+        memcpy(user_stack_top, args, args_size);
+    } else {
+        retval = copy_to_pd(pd, user_stack_top, args, args_size);
+    }
+    sfree(args, args_size);
+
+    return (retval < 0) ? NULL : user_stack_top;
 }
 
 /** @brief set user EFLAGS 
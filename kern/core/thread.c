@@ -79,6 +79,7 @@ thread_struct_t *create_thread(task_struct_t *task) {
 	thr->cur_esp = thr->k_stack_base;
 	thr->cur_ebp = thr->k_stack_base;
 	thr->status = RUNNABLE; /* Default value */
+    sched_init_thread(thr);
     return thr;
 }
 
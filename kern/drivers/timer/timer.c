@@ -7,6 +7,7 @@
  */
 
 #include <timer_defines.h>
+#include <interrupt_defines.h>
 #include <asm.h>
 #include <seg.h>
 #include <common/errors.h>
@@ -14,14 +15,38 @@
 #include <interrupts/idt_entry.h>
 #include <interrupts/interrupt_handlers.h>
 #include <drivers/timer/timer_handler.h>
+#include <drivers/timer/tsc.h>
+#include <x86/asm.h>
+#include <x86/eflags.h>
 
 #define INT_FREQ 10
 #define MILLISECONDS 1000
+#define TIMER_LATCH 0x00        /* Latch the count of counter 0 */
+#define MAX_TIMER_COUNT 0xffff
+#define PIC_READ_IRR (OCW_TEMPLATE | READ_NEXT_RD | READ_IR_ONRD)
+#define PIC_READ_ISR (OCW_TEMPLATE | READ_NEXT_RD | READ_IS_ONRD)
+#define TIMER_IRQ_BIT 0x01      /* IRQ 0 in the master PIC's IRR */
 
-static void set_mode_freq();
+/* Timer input cycles in a tick */
+#define COUNTS_PER_TICK (TIMER_RATE / (MILLISECONDS / INT_FREQ))
+/* Longest a single count can run */
+#define MAX_ONE_SHOT_TICKS (MAX_TIMER_COUNT / COUNTS_PER_TICK)
+
+static void load_count(int ticks);
+static unsigned int read_count();
+static int count_elapsed();
+static int advance_ticks();
 static int install_timer_handler();
 static void (*callback)(unsigned int);
-static unsigned int tick_counter = 0;
+
+/* The timer runs in one-shot mode. Each count runs out at a tick 
+ * boundary, which may be several ticks away when there is nothing to do 
+ * in between */
+static unsigned int tick_counter = 0;   /* Ticks before the current count */
+static unsigned int phase;      /* Cycles of the current tick which passed 
+                                 * before the current count was loaded */
+static unsigned int loaded;     /* The current count */
+static unsigned int end_tick;   /* Tick at which the current count runs out */
 
 /** @brief initialize the timer and install handler for it
  *
@@ -29,27 +54,13 @@ static unsigned int tick_counter = 0;
  *  @return int 0 on success. -ve integer on failure
  */
 int initialize_timer(void (*tickback)(unsigned int)) {
+    calibrate_tsc();
     callback = tickback;
-    set_mode_freq();
+    phase = 0;
+    load_count(1);
     return install_timer_handler();
 }
 
-/** @brief function to initialize the timer
- *
- *  This function initializes the timer to square wave mode
- *  and sets the number of interrupts we get per second by
- *  dividing the clock frequency by the required frequency.
- *
- *  @return void
- */
-void set_mode_freq() {
-    int output_freq = MILLISECONDS / INT_FREQ;
-    int freq_divider = TIMER_RATE / output_freq;
-    outb(TIMER_MODE_IO_PORT, TIMER_SQUARE_WAVE);
-    outb(TIMER_PERIOD_IO_PORT, (unsigned char)(freq_divider & 0xff));
-    outb(TIMER_PERIOD_IO_PORT, (unsigned char)((freq_divider >> 8) & 0xff));
-}
-
 /** @brief function to install timer handler in the IDT
  *
  *  @return int return value of add_idt_entry
@@ -61,29 +72,191 @@ int install_timer_handler() {
 
 /** @brief called by interrupt to do any processing needed
  *
- *  This function increments a variable keeping count of the number of
- *  ticks so far and calls the callback function with this variable. We
- *  acknowledge interrupts immediately since the timer interrupt is an
- *  interrupt gate and we iret from a different in case of fork and the
- *  initial task
+ *  This function accounts the ticks the count ran for, arms the timer 
+ *  for the next tick and calls the callback function with the number of 
+ *  ticks so far. The counter keeps counting down from MAX_TIMER_COUNT
+ *  once the count runs out, so the cycles which passed before the 
+ *  interrupt was handled are read off it and carried into the next 
+ *  count, and ticks do not drift by the interrupt latency. The callback may then push the next interrupt further 
+ *  out with set_next_timer_interrupt(). We acknowledge interrupts 
+ *  immediately since the timer interrupt is an interrupt gate and we 
+ *  iret from a different in case of fork and the initial task
  *
  *  @return void
  */
 void callback_handler() {
     acknowledge_interrupt();
-    tick_counter++;
+    unsigned int overshoot = (MAX_TIMER_COUNT + 1 - read_count()) 
+                             & MAX_TIMER_COUNT;
+    tick_counter = end_tick + overshoot / COUNTS_PER_TICK;
+    phase = overshoot % COUNTS_PER_TICK;
+    load_count(1);
     callback(tick_counter);
     return;
 }
 
+/** @brief set when the next timer interrupt comes
+ *
+ *  The interrupt comes at most MAX_ONE_SHOT_TICKS ticks out, since that
+ *  is as long as the timer can count.
+ *
+ *  @pre interrupts are disabled
+ *  @param ticks the number of ticks after the current one
+ *  @return void
+ */
+void set_next_timer_interrupt(int ticks) {
+    if (advance_ticks() == 0) {
+        load_count(ticks);
+    }
+}
+
+/** @brief make sure a timer interrupt comes by a given tick
+ *
+ *  @pre interrupts are disabled
+ *  @param tick the tick
+ *  @return void
+ */
+void request_timer_interrupt(unsigned int tick) {
+    if ((int)(end_tick - tick) <= 0 || advance_ticks() < 0) {
+        return;
+    }
+    load_count(tick - tick_counter);
+}
+
+/** @brief make sure a timer interrupt comes at the next tick
+ *
+ *  Used when a thread becomes runnable while the timer was set to skip
+ *  ticks, so that it is scheduled as soon as it would have been if the 
+ *  timer ticked every time.
+ *
+ *  @pre interrupts are disabled
+ *  @return void
+ */
+void request_next_timer_interrupt() {
+    if (end_tick - tick_counter <= 1 || advance_ticks() < 0) {
+        return;
+    }
+    load_count(1);
+}
+
 /** @brief return the number of ticks since startup
  *
  *  This function returns the number of ticks since system
  *  startup. This can be used as a seed for a random number 
- *  generator and also to keep track of time.
+ *  generator and also to keep track of time. The ticks which passed 
+ *  since the current count was loaded are read off the timer.
  *
  *  @return unsigned int total_ticks
  */
 unsigned int total_ticks() {
-    return tick_counter;
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int elapsed = count_elapsed();
+    unsigned int ticks = (elapsed < 0) ? end_tick : 
+                         tick_counter + (phase + elapsed) / COUNTS_PER_TICK;
+    if (int_flag) {
+        enable_interrupts();
+    }
+    return ticks;
+}
+
+/** @brief return the time left until the next tick starts
+ *
+ *  When the count already ran out and the interrupt is pending, 0 is
+ *  returned, so callers never count on more time than there is.
+ *
+ *  @return unsigned long long the nanoseconds until the next tick
+ */
+unsigned long long ns_until_next_tick() {
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int elapsed = count_elapsed();
+    unsigned int left = (elapsed < 0) ? 0 : 
+                COUNTS_PER_TICK - (phase + elapsed) % COUNTS_PER_TICK;
+    if (int_flag) {
+        enable_interrupts();
+    }
+    return (unsigned long long)left * NS_PER_SEC / TIMER_RATE;
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief load a count running out a number of ticks from now
+ *
+ *  @pre interrupts are disabled
+ *  @param ticks the number of ticks after the one in progress
+ *  @return void
+ */
+void load_count(int ticks) {
+    if (ticks < 1) {
+        ticks = 1;
+    } else if (ticks > MAX_ONE_SHOT_TICKS) {
+        ticks = MAX_ONE_SHOT_TICKS;
+    }
+    loaded = ticks * COUNTS_PER_TICK - phase;
+    end_tick = tick_counter + ticks;
+    outb(TIMER_MODE_IO_PORT, TIMER_ONE_SHOT);
+    outb(TIMER_PERIOD_IO_PORT, (unsigned char)(loaded & 0xff));
+    outb(TIMER_PERIOD_IO_PORT, (unsigned char)((loaded >> 8) & 0xff));
+}
+
+/** @brief read the counter of the timer
+ *
+ *  @pre interrupts are disabled
+ *  @return unsigned int the count left
+ */
+unsigned int read_count() {
+    outb(TIMER_MODE_IO_PORT, TIMER_LATCH);
+    unsigned int count = inb(TIMER_PERIOD_IO_PORT);
+    count |= inb(TIMER_PERIOD_IO_PORT) << 8;
+    return count;
+}
+
+/** @brief read how far the current count got
+ *
+ *  Once a one-shot count runs out the counter wraps around and soon 
+ *  drops below the count loaded again, so the counter alone cannot tell 
+ *  a count which ran out. The timer interrupt stays pending in the PIC 
+ *  while interrupts are disabled, so that is checked instead. The IRR is
+ *  read after the counter is latched, so a count which runs out in 
+ *  between is not missed. The ISR is checked too: an application 
+ *  processor may read the timer after the boot processor took the 
+ *  interrupt but before its handler, waiting for the kernel lock, 
+ *  acknowledged it.
+ *
+ *  @pre interrupts are disabled
+ *  @return int the cycles since the count was loaded, -1 if it ran out
+ */
+int count_elapsed() {
+    unsigned int count = read_count();
+    outb(INT_CTL_PORT, PIC_READ_IRR);
+    if (inb(INT_CTL_PORT) & TIMER_IRQ_BIT) {
+        return -1;
+    }
+    outb(INT_CTL_PORT, PIC_READ_ISR);
+    if (inb(INT_CTL_PORT) & TIMER_IRQ_BIT) {
+        return -1;
+    }
+    /* The counter is not loaded until the timer's next input cycle */
+    if (count > loaded) {
+        return 0;
+    }
+    return loaded - count;
+}
+
+/** @brief account the ticks which passed since the count was loaded
+ *
+ *  @pre interrupts are disabled
+ *  @return int 0 on success, -1 if the count ran out and the interrupt 
+ *          will do it
+ */
+int advance_ticks() {
+    int elapsed = count_elapsed();
+    if (elapsed < 0) {
+        return -1;
+    }
+    elapsed += phase;
+    tick_counter += elapsed / COUNTS_PER_TICK;
+    phase = elapsed % COUNTS_PER_TICK;
+    return 0;
 }
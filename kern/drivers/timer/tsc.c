@@ -0,0 +1,79 @@
+/** @file tsc.c
+ *  @brief nanosecond clock based on the time stamp counter
+ *
+ *  The TSC counts processor cycles, so it measures time as finely as
+ *  anything on the machine once its rate is known. The rate is measured
+ *  at boot against channel 2 of the PIT, whose input clock runs at a
+ *  known TIMER_RATE. Channel 0 drives the timer interrupt and is left
+ *  alone. If the measurement fails the clock falls back to timer ticks.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <drivers/timer/tsc.h>
+#include <drivers/timer/timer.h>
+#include <timer_defines.h>
+#include <x86/asm.h>
+#include <simics.h>
+
+#define PIT_CHANNEL2_IO_PORT 0x42
+#define PIT_CHANNEL2_ONE_SHOT 0xb0  /* Counter 2, lobyte/hibyte, mode 0 */
+#define SPEAKER_IO_PORT 0x61        /* Gate and output of counter 2 */
+#define SPEAKER_GATE2 0x01
+#define SPEAKER_ENABLE 0x02
+#define SPEAKER_OUT2 0x20
+#define CALIBRATE_COUNTS (TIMER_RATE / 20)  /* 50 ms */
+#define CALIBRATE_MAX_POLLS 10000000        /* Give up on a broken PIT */
+
+static unsigned long long tsc_hz;   /* TSC cycles per second, 0 if unknown */
+static unsigned long long boot_tsc; /* TSC when the clock started */
+
+/** @brief measure the rate of the TSC
+ *
+ *  Counts TSC cycles while counter 2 of the PIT counts down 50 ms. 
+ *  Called once at boot with interrupts disabled.
+ *
+ *  @return void
+ */
+void calibrate_tsc() {
+    unsigned char speaker = inb(SPEAKER_IO_PORT);
+    int polls = 0;
+
+    /* Gate counter 2 on with the speaker off, and start the count */
+    outb(SPEAKER_IO_PORT, (speaker & ~SPEAKER_ENABLE) | SPEAKER_GATE2);
+    outb(TIMER_MODE_IO_PORT, PIT_CHANNEL2_ONE_SHOT);
+    outb(PIT_CHANNEL2_IO_PORT, (unsigned char)(CALIBRATE_COUNTS & 0xff));
+    outb(PIT_CHANNEL2_IO_PORT, (unsigned char)((CALIBRATE_COUNTS >> 8) 
+                                               & 0xff));
+    unsigned long long start = rdtsc();
+    while (!(inb(SPEAKER_IO_PORT) & SPEAKER_OUT2) && 
+           polls < CALIBRATE_MAX_POLLS) {
+        polls++;
+    }
+    unsigned long long end = rdtsc();
+    outb(SPEAKER_IO_PORT, speaker);
+
+    boot_tsc = end;
+    if (polls == CALIBRATE_MAX_POLLS) {
+        lprintf("TSC calibration failed, using timer ticks");
+        tsc_hz = 0;
+        return;
+    }
+    tsc_hz = (end - start) * TIMER_RATE / CALIBRATE_COUNTS;
+}
+
+/** @brief the time since boot in nanoseconds
+ *
+ *  The cycles are split into whole seconds and the rest so that the
+ *  products never overflow.
+ *
+ *  @return unsigned long long nanoseconds since the clock started
+ */
+unsigned long long tsc_time_ns() {
+    if (tsc_hz == 0) {
+        return total_ticks() * NS_PER_TICK;
+    }
+    unsigned long long cycles = rdtsc() - boot_tsc;
+    return (cycles / tsc_hz) * NS_PER_SEC + 
+           (cycles % tsc_hz) * NS_PER_SEC / tsc_hz;
+}
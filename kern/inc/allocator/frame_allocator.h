@@ -7,19 +7,58 @@
 #ifndef __FRAME_ALLOCATOR_H
 #define __FRAME_ALLOCATOR_H
 
+#include <list/list.h>
+
 #define FREE_FRAMES_COUNT ((machine_phys_frames())-(USER_MEM_START / PAGE_SIZE))
 #define FRAME_INDEX(addr) ((((unsigned int)addr)-(USER_MEM_START))/(PAGE_SIZE))
+#define MAX_FRAME_ORDER 10        /* Largest block is 2^10 frames, 4 MB */
+#define LARGE_FRAME_ORDER 10      /* Order of the frames of a 4 MB page */
+#define FRAMES_PER_LARGE_FRAME (1 << LARGE_FRAME_ORDER)
+#define LARGE_FRAME_SIZE (PAGE_SIZE * FRAMES_PER_LARGE_FRAME)
+
+#define FRAME_FREE 1    /* The frame is free, wherever it is kept */
+#define FRAME_BUDDY 2   /* The frame heads a block on a buddy free list */
+#define FRAME_ZEROED 4  /* The frame is in the pool of zeroed frames */
+#define FRAME_CACHED 8  /* The page cache holds a reference to the frame */
+
+/** @brief the bookkeeping kept for a physical frame */
+typedef struct frame_desc {
+    list_head link;         /* Free list the frame is on, if any */
+    unsigned short flags;   /* FRAME_* flags */
+    unsigned short order;   /* Order of the free block the frame heads */
+    int ref_count;          /* Page table entries and caches using the frame */
+} frame_desc_t;
 
 void init_frame_allocator();
 
 void *allocate_frame();
 
+void *allocate_reserved_frame(int zeroed, int *is_zeroed);
+
+void refill_zeroed_frames();
+
 void deallocate_frame(void *frame_addr);
 
+void deallocate_frames(void **frames, int count);
+
+void deallocate_frames_reserved(void **frames, int count);
+
+void *allocate_contiguous_frames(int order);
+
+void deallocate_contiguous_frames(void *frame_addr, int order);
+
+int reserve_frames(int count);
+
+void unreserve_frames(int count);
+
 int check_physical_memory();
 
-void lock_frame(void *frame_addr);
+int frame_add_ref(void *frame_addr, int count);
+
+int frame_get_ref(void *frame_addr);
+
+void frame_set_cached(void *frame_addr);
 
-void unlock_frame(void *frame_addr);
+int frame_get_mappings(void *frame_addr);
 
 #endif /* __FRAME_ALLOCATOR_H */
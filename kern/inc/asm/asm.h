@@ -64,6 +64,9 @@ int get_ds();
 int get_ss();
 
 /** @brief exit to userspace for new tasks
+ *
+ *  Releases the kernel lock on the way out, like the system call and
+ *  interrupt handlers do.
  */
 void iret_fun();
 
@@ -117,4 +120,92 @@ void *get_err_instr();
  */
 void invalidate_tlb_page(void *addr);
 
+/** @brief Function to invalidate a range of pages from TLB
+ *
+ *  Each page is invalidated with invlpg. Large ranges fall back to
+ *  flushing the whole TLB (bar global entries), which is cheaper.
+ *
+ *  @param addr Start of the range to be invalidated
+ *  @param num_pages Number of pages in the range
+ *
+ *  @return void
+ */
+void invalidate_tlb_range(void *addr, unsigned int num_pages);
+
+/** @brief Function to flush all non-global entries from TLB
+ *
+ *  @return void
+ */
+void flush_tlb();
+
+/** @brief Function to atomically add to a counter
+ *
+ *  @param addr Address of the counter
+ *  @param val Value to be added, may be negative
+ *
+ *  @return int The new value of the counter
+ */
+int atomic_add(int *addr, int val);
+
+/** @brief Function to atomically swap a value into a word
+ *
+ *  @param addr Address of the word
+ *  @param val Value to be stored
+ *
+ *  @return int The previous value of the word
+ */
+int atomic_xchg(int *addr, int val);
+
+/** @brief Function to halt the processor for good
+ *
+ *  Interrupts are disabled first so that the processor never wakes up.
+ *
+ *  @return Does not return
+ */
+void park_cpu();
+
+/** @brief Function to sleep until the next interrupt
+ *
+ *  Interrupts are enabled only for the hlt, which an interrupt pending
+ *  from before still wakes up, and are disabled again on return.
+ *
+ *  @return void
+ */
+void wait_for_interrupt();
+
+/** @brief an instruction touching user memory and where to resume if it
+ *         faults on a bad address
+ */
+typedef struct user_copy_fixup {
+    void *fault_eip;
+    void *fixup_eip;
+} user_copy_fixup_t;
+
+/** @brief Fixups of the user copy functions, ended by a zero entry */
+extern user_copy_fixup_t user_copy_fixups[];
+
+/** @brief Function to copy to or from user memory
+ *
+ *  The user side must already be known to lie in user space.
+ *
+ *  @param dst Destination address
+ *  @param src Source address
+ *  @param len Number of bytes to be copied
+ *
+ *  @return int 0 on success, ERR_INVAL if the user memory is not mapped
+ */
+int copy_user(void *dst, const void *src, int len);
+
+/** @brief Function to copy a string from user memory
+ *
+ *  @param dst Destination address, with room for max bytes
+ *  @param src Source address in user space
+ *  @param max Maximum number of bytes to be copied
+ *
+ *  @return int Bytes copied including the NUL, max if no NUL was found
+ *          in the first max bytes. ERR_INVAL if the user memory is not 
+ *          mapped
+ */
+int copy_user_string(char *dst, const char *src, int max);
+
 #endif
@@ -11,4 +11,6 @@
 
 void context_switch();
 
+void context_yield();
+
 #endif /* __CONTEXT_H*/
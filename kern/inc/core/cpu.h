@@ -0,0 +1,63 @@
+/** @file cpu.h
+ *
+ *  Header file for cpu.c
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#ifndef __CPU_H
+#define __CPU_H
+#include <multiboot.h>
+
+void cpus_init(mbinfo_t *mbinfo);
+
+void boot_cpus();
+
+void start_cpus();
+
+int this_cpu();
+
+int get_num_cpus();
+
+int is_cpu_online(int cpu);
+
+void kernel_lock();
+
+void kernel_unlock();
+
+int kernel_lock_held();
+
+void set_cpu_pd(void *pd);
+
+void wake_idle_cpu(int cpu);
+
+void halt_cpus();
+
+void tlb_shootdown(void *pd);
+
+void tlb_shootdown_handler_c();
+
+void ap_timer_handler_c();
+
+/** @brief Handler of the local APIC timer of the application processors
+ */
+void ap_timer_handler();
+
+/** @brief Handler of the TLB flush IPI
+ */
+void tlb_shootdown_handler();
+
+/** @brief Handler of the IPI waking an idle processor up
+ */
+void wakeup_handler();
+
+/** @brief Handler of the IPI stopping a processor for good
+ */
+void halt_ipi_handler();
+
+/** @brief Handler of spurious local APIC interrupts, which need no EOI
+ */
+void spurious_handler();
+
+#endif  /* __CPU_H */
@@ -0,0 +1,47 @@
+/** @file cpu_asm.h
+ *
+ *  Kernel lock handling for the interrupt and system call entry points
+ *
+ *  Kernel code on a processor runs holding the kernel lock (see cpu.c).
+ *  It is taken on an entry from user mode and released on the way back
+ *  to user mode. Entries from kernel mode already hold it. Every handler
+ *  is entered through an interrupt gate, so nothing can get in before
+ *  the lock is taken. Handlers installed as TRAP_GATE turn interrupts
+ *  back on once they hold it, if the interrupted code had them on.
+ *
+ *  The argument is the offset from %esp of the saved %cs, which is 
+ *  followed by the saved %eflags.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __CPU_ASM_H
+#define __CPU_ASM_H
+
+#define RING_MASK 3             /* Privilege level bits of %cs */
+#define EFLAGS_IF 0x200         /* Interrupt enable flag */
+
+#define KERNEL_ENTER(cs) \
+		testl $RING_MASK, cs(%esp); \
+		jz 1f; \
+		call kernel_lock; \
+	1:
+
+#define KERNEL_ENTER_TRAP(cs) \
+		KERNEL_ENTER(cs) \
+		testl $EFLAGS_IF, 4+cs(%esp); \
+		jz 2f; \
+		sti; \
+	2:
+
+/* %eax carries the return value of a system call */
+#define KERNEL_EXIT(cs) \
+		cli; \
+		testl $RING_MASK, cs(%esp); \
+		jz 3f; \
+		pushl %eax; \
+		call kernel_unlock; \
+		popl %eax; \
+	3:
+
+#endif /* __CPU_ASM_H */
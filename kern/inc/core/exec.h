@@ -11,4 +11,6 @@
 
 int do_exec();
 
+int do_spawn(void *arg_packet);
+
 #endif  /* __EXEC_H */
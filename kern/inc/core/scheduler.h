@@ -8,10 +8,27 @@
 #define __SCHEDULER_H
 #include <core/thread.h>
 
+#define NUM_PRIORITY_LEVELS 8   /* 0 is the highest priority */
+#define DEFAULT_PRIORITY 4
+#define TIME_SLICE(priority) ((priority) + 1)  /* In timer ticks */
+#define BOOST_INTERVAL 100      /* Ticks between priority boosts */
+
 thread_struct_t *next_thread();
 
 void init_scheduler();
 
+void sched_init_thread(thread_struct_t *thr);
+
+void set_idle_thread(int cpu, thread_struct_t *thr);
+
+thread_struct_t *get_idle_thread();
+
+int runq_work_pending();
+
+int scheduler_tick(unsigned int ticks, int *next_ticks);
+
+void set_thread_priority(thread_struct_t *thr, int priority);
+
 thread_struct_t *get_curr_thread();
 
 task_struct_t *get_curr_task();
@@ -12,7 +12,11 @@
 
 int do_sleep();
 
-thread_struct_t *get_sleeping_thread();
+int do_sleep_ns(unsigned long long ns);
+
+void wake_sleeping_threads(unsigned int now);
+
+int ticks_until_wakeup();
 
 void init_sleeping_threads();
 
@@ -13,6 +13,7 @@
 #include <sync/mutex.h>
 #include <sync/sem.h>
 #include <syscall.h>
+#include <loader/loader.h>
 
 #define DEFAULT_STACK_OFFSET 56 
 
@@ -51,6 +52,8 @@ typedef struct task_struct {
     void *swexn_args;               /* Arguments to the swexn function */
     void *swexn_esp;                /* ESP to run the swexn handler on */
 
+    program_image_t image;          /* Program the task is running */
+
     /* Cond var for threads of THIS task to wait on child vanish()es */
     cond_t exit_cond_var;           
     /* Mutex to synchronize access to dead and alive child task lists */    
@@ -75,6 +78,14 @@ void load_init_task(char *prog_name);
 int load_task(char *prog_name, int num_arg, char **argvec, 
                task_struct_t *t);
 
+void *prepare_user_args(int num_args, char **argvec, int *size);
+
+int load_program(program_image_t *image, void *args, int args_size,
+                 task_struct_t *t);
+
+int spawn_task(program_image_t *image, int num_args, char **argvec,
+               task_struct_t *parent, task_struct_t **child);
+
 task_struct_t *get_init_task();
 
 task_struct_t *get_idle_task();
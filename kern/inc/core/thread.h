@@ -47,7 +47,15 @@ typedef struct thread_struct {
 	list_head cond_wait_link;	/* Link structure for cond_wait */
 	list_head mutex_link;		/* Link structure for mutex */
     list_head task_thread_link; /* Link structure for list of threads in parent */
-    long wake_time;             /* Time when this thread is to be woken up */
+    unsigned int wake_time;     /* Tick at which this thread is woken up */
+
+    /* Scheduling state, see scheduler.c */
+    int base_priority;          /* Level set by set_priority */
+    int priority;               /* Current level, base_priority or lower */
+    int time_slice;             /* Ticks left at the current level */
+    unsigned int boost_epoch;   /* Last priority boost the thread got */
+    int on_runq;                /* Whether the thread is in a run queue */
+    int cpu;                    /* Processor whose run queue it goes to */
 
 	/* List of drivers to which this thread is registered */
 	list_head udriv_list;
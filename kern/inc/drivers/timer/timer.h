@@ -15,4 +15,12 @@ void callback_handler();
 
 unsigned int total_ticks();
 
+unsigned long long ns_until_next_tick();
+
+void set_next_timer_interrupt(int ticks);
+
+void request_timer_interrupt(unsigned int tick);
+
+void request_next_timer_interrupt();
+
 #endif  /* __TIMER_H */
@@ -0,0 +1,17 @@
+/** @file tsc.h
+ *  @brief nanosecond clock based on the time stamp counter
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __TSC_H
+#define __TSC_H
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_TICK 10000000ULL     /* A timer tick is 10 ms */
+
+void calibrate_tsc();
+
+unsigned long long tsc_time_ns();
+
+#endif /* __TSC_H */
@@ -21,7 +21,7 @@ void invalid_tss_handler_c();
 void snp_handler_c();
 void ssf_handler_c();
 void gpf_handler_c();
-void page_fault_handler_c();
+void page_fault_handler_c(void **fault_eip, unsigned int error_code);
 void math_fault_handler_c();
 void alignment_check_handler_c();
 void machine_check_handler_c();
@@ -12,10 +12,22 @@
 #define PROG_PRESENT_VALID 0
 #define PROG_ABSENT_INVALID 1
 
-int load_program(simple_elf_t *se_hdr);
+/** @brief a program in the ramdisk which is being demand loaded */
+typedef struct program_image {
+    int toc_index;          /* index of the program in exec2obj_userapp_TOC */
+    simple_elf_t se_hdr;    /* where the segments live in the file */
+} program_image_t;
+
+int setup_program_image(const char *prog_name, program_image_t *image);
+
+void load_page(const program_image_t *image, void *page_addr, void *buf);
 
 int getbytes(const char *filename, int offset, int size, char *buf);
 
+int find_file(const char *filename, int *len);
+
+void load_file_page(int toc_index, int offset, void *buf);
+
 int check_program(const char *prog_name);
 
 #endif /* __LOADER_H */
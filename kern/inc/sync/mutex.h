@@ -15,5 +15,6 @@ void mutex_lock( mutex_t *mp );
 void mutex_unlock( mutex_t *mp );
 void mutex_lock_int_save( mutex_t *mp );
 void mutex_unlock_int_save( mutex_t *mp );
+int mutex_trylock( mutex_t *mp );
 
 #endif /* MUTEX_H */
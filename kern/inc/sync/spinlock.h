@@ -0,0 +1,18 @@
+/** @file spinlock.h
+ *  @brief This file defines the interface for spinlocks.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <sync/spinlock_type.h>
+
+void spin_init( spinlock_t *lock );
+void spin_lock( spinlock_t *lock );
+int spin_trylock( spinlock_t *lock );
+void spin_unlock( spinlock_t *lock );
+
+#endif /* SPINLOCK_H */
@@ -0,0 +1,15 @@
+/** @file spinlock_type.h
+ *  @brief This file defines the type for spinlocks.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#ifndef _SPINLOCK_TYPE_H
+#define _SPINLOCK_TYPE_H
+
+typedef struct spinlock {
+    volatile int locked;    /* 1 while some processor holds it */
+} spinlock_t;
+
+#endif /* _SPINLOCK_TYPE_H */
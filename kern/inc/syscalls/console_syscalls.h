@@ -8,6 +8,8 @@
 #ifndef __CONSOLE_SYSCALLS_H
 #define __CONSOLE_SYSCALLS_H
 
+int print_init();
+
 int print_handler();
 
 int print_handler_c(void *arg_packet);
@@ -20,6 +20,10 @@ int exec_handler();
 
 int exec_handler_c();
 
+int spawn_handler();
+
+int spawn_handler_c(void *arg_packet);
+
 void set_status_handler();
 
 void set_status_handler_c(int status);
@@ -16,4 +16,20 @@ int remove_pages_handler();
 
 int remove_pages_handler_c(void *base_addr);
 
+int memstats_handler();
+
+int memstats_handler_c(void *stats);
+
+int shm_create_handler();
+
+int shm_create_handler_c(void *arg_packet);
+
+int shm_attach_handler();
+
+int shm_attach_handler_c(void *arg_packet);
+
+int shm_detach_handler();
+
+int shm_detach_handler_c(void *base);
+
 #endif  /* __MEMORY_SYSCALLS_H */
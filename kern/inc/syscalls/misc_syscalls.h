@@ -10,8 +10,14 @@
 
 void halt_handler();
 
+void halt_handler_c();
+
 int readfile_handler();
 
 int readfile_handler_c(void *arg_packet);
 
+int map_file_handler();
+
+int map_file_handler_c(void *arg_packet);
+
 #endif  /* __MISC_SYSCALLS_H */
@@ -25,6 +25,10 @@ void populate_ureg(ureg_t *ureg, int err_code_available,
 
 int is_pointer_valid(void *ptr, int bytes);
 
-int copy_user_data(char *buf, char *ptr, int max_size);
+int strncpy_from_user(char *buf, const char *ptr, int max_size);
+
+int copy_from_user(void *buf, const void *ptr, int len);
+
+int copy_to_user(void *ptr, const void *buf, int len);
 
 #endif  /*__SYSCALL_UTIL_H */
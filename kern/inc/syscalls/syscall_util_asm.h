@@ -8,6 +8,12 @@
 #ifndef __SYSCALL_UTIL_ASM_H
 #define __SYSCALL_UTIL_ASM_H
 
+#include <core/cpu_asm.h>
+
+/* Offset of the saved %cs past the registers saved by SAVE_REGS */
+#define SAVE_REGS_CS 36
+
+/* System calls are installed as TRAP_GATE */
 #define SAVE_REGS \
 		pushl %ecx; \
 		pushl %eax; \
@@ -16,9 +22,11 @@
     	pushl %esp; \
     	pushl %ebp; \
     	pushl %edi; \
-    	pushl %esi;
+    	pushl %esi; \
+		KERNEL_ENTER_TRAP(SAVE_REGS_CS)
 
 #define RESTORE_REGS \
+		KERNEL_EXIT(SAVE_REGS_CS) \
 		popl %esi; \
 	    popl %edi; \
     	popl %ebp; \
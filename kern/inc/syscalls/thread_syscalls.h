@@ -20,6 +20,10 @@ int sleep_handler();
 
 int sleep_handler_c(int ticks);
 
+int sleep_ns_handler();
+
+int sleep_ns_handler_c(void *arg_packet);
+
 int deschedule_handler();
 
 int deschedule_handler_c(int *reject);
@@ -28,10 +32,18 @@ int make_runnable_handler();
 
 int make_runnable_handler_c(int tid);
 
+int set_priority_handler();
+
+int set_priority_handler_c(void *arg_packet);
+
 unsigned int get_ticks_handler();
 
 unsigned int get_ticks_handler_c();
 
+unsigned long long get_time_ns_handler();
+
+unsigned long long get_time_ns_handler_c();
+
 int swexn_handler();
 
 int swexn_handler_c(void *arg_packet);
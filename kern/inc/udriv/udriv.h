@@ -37,6 +37,8 @@ void udriv_init();
 
 thread_struct_t *get_udriv_thread();
 
+int udriv_thread_pending();
+
 int handle_udriv_register(void *arg_packet);
 void handle_udriv_deregister(driv_id_t driver_id);
 int handle_udriv_send(void *arg_packet);
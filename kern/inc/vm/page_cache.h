@@ -0,0 +1,16 @@
+/** @file page_cache.h
+ *  @brief cache of read-only program pages shared between tasks
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __PAGE_CACHE_H
+#define __PAGE_CACHE_H
+
+void page_cache_init();
+
+void *page_cache_lookup(int toc_index, void *page_addr);
+
+int page_cache_insert(int toc_index, void *page_addr, void *frame);
+
+#endif /* __PAGE_CACHE_H */
@@ -0,0 +1,31 @@
+/** @file shm.h
+ *  @brief shared memory segments
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <list/list.h>
+
+/** @brief frames any number of tasks may map at the same time */
+typedef struct shm_segment {
+    int key;                /* name the tasks agree on */
+    int num_pages;
+    void **frames;          /* each carries a reference of the segment */
+    int ref_count;          /* areas mapping the segment */
+    list_head link;         /* in the list of segments */
+} shm_segment_t;
+
+void shm_init();
+
+int shm_alloc(int key, int num_pages, shm_segment_t **seg);
+
+shm_segment_t *shm_lookup(int key);
+
+void shm_dup(shm_segment_t *seg);
+
+void shm_put(shm_segment_t *seg);
+
+#endif /* __SHM_H */
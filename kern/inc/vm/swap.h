@@ -0,0 +1,22 @@
+/** @file swap.h
+ *  @brief compressed in-memory store for swapped out pages
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __SWAP_H
+#define __SWAP_H
+
+#define SWAP_MAX_SLOTS 8192
+
+void swap_init();
+
+int swap_store(const void *page);
+
+void swap_load(int slot, void *page);
+
+void swap_dup(int slot);
+
+void swap_free(int slot);
+
+#endif /* __SWAP_H */
@@ -8,6 +8,9 @@
 #define __VM_H
 
 #include <elf_410.h>
+#include <loader/loader.h>
+#include <memstats.h>
+#include <vm/shm.h>
 
 #define PAGE_ENTRY_PRESENT 1
 #define READ_WRITE_ENABLE 2
@@ -15,12 +18,21 @@
 #define USER_MODE 4
 #define COW_MODE 512
 #define COW_MODE_DISABLE_MASK 0xFFFFFDFF
+#define PT_COW_MODE 512
 #define WRITE_THROUGH_CACHING 8
 #define DISABLE_CACHING 16
+#define PAGE_ACCESSED 32
+#define PAGE_DIRTY 64
+#define LARGE_PAGE_ENTRY 128
 #define GLOBAL_PAGE_ENTRY 256
-#define NEWPAGE_PAGE 1024
-#define NEWPAGE_START 2048
-#define NEWPAGE_END 3072
+#define ZERO_FILL_ON_DEMAND 4096
+#define LOAD_ON_DEMAND 8192
+#define SWAPPED_OUT 16384
+#define SHARED_MEM_PAGE 1024
+
+/* Page fault error code bits */
+#define PF_ERR_WRITE 2
+#define PF_ERR_USER 4
 
 /*Constants and macros*/
 
@@ -29,6 +41,7 @@
 #define PAGE_TABLE_MASK 0x003ff000
 #define PAGE_ROUND_DOWN 0xfffff000
 #define NUM_PAGE_TABLE_ENTRIES (PAGE_SIZE / PAGE_TABLE_ENTRY_SIZE)
+#define LARGE_PAGE_SIZE (PAGE_SIZE * NUM_PAGE_TABLE_ENTRIES)
 #define DEFAULT_STACK_SIZE 2 * 1024 * 1024
 #define STACK_START 0xc0000000
 #define STACK_END (STACK_START - DEFAULT_STACK_SIZE)
@@ -43,12 +56,42 @@
 #define GET_ADDR_FROM_ENTRY(addr) (((unsigned int)addr)&0xFFFFF000)
 #define GET_FLAGS_FROM_ENTRY(addr) (((unsigned int)addr)&0x00000FFF)
 
+/* A not-present entry which has a frame reserved for it. The remaining
+ * flag bits are the ones the page will be mapped with on first touch */
+#define ZFOD_ENTRY(flags) ((((unsigned int)(flags)) & ~PAGE_ENTRY_PRESENT) \
+                           | ZERO_FILL_ON_DEMAND)
+#define IS_ZFOD_ENTRY(entry) ((((unsigned int)(entry)) & \
+                 (ZERO_FILL_ON_DEMAND | PAGE_ENTRY_PRESENT)) == ZERO_FILL_ON_DEMAND)
+
+/* Same as above but the page is filled from the program image */
+#define LOD_ENTRY(flags) ((((unsigned int)(flags)) & ~PAGE_ENTRY_PRESENT) \
+                          | LOAD_ON_DEMAND)
+#define IS_LOD_ENTRY(entry) ((((unsigned int)(entry)) & \
+                 (LOAD_ON_DEMAND | PAGE_ENTRY_PRESENT)) == LOAD_ON_DEMAND)
+
+#define IS_RESERVED_ENTRY(entry) (IS_ZFOD_ENTRY(entry) || IS_LOD_ENTRY(entry))
+
+/* A not-present entry whose page was compressed into a swap slot. The 
+ * slot number sits above the marker bit, the page is mapped again with
+ * the flags the entry keeps */
+#define SWAP_SLOT_SHIFT 15
+#define SWAP_ENTRY(slot, entry) ((((unsigned int)(slot)) << SWAP_SLOT_SHIFT) \
+                 | (GET_FLAGS_FROM_ENTRY(entry) & ~(PAGE_ENTRY_PRESENT | \
+                    PAGE_ACCESSED | PAGE_DIRTY)) | SWAPPED_OUT)
+#define IS_SWAP_ENTRY(entry) ((((unsigned int)(entry)) & \
+                 (SWAPPED_OUT | PAGE_ENTRY_PRESENT)) == SWAPPED_OUT)
+#define GET_SWAP_SLOT(entry) (((unsigned int)(entry)) >> SWAP_SLOT_SHIFT)
+
+#define PAGE_DIRECTORY_SHIFT 22
 #define GET_PD_INDEX(addr) ((unsigned int)((int)(addr) & PAGE_DIRECTORY_MASK) >> 22)
+#define GET_PD_BASE(index) ((void *)((unsigned int)(index) << PAGE_DIRECTORY_SHIFT))
 #define GET_PT_INDEX(addr) ((unsigned int)((int)(addr) & PAGE_TABLE_MASK) >> 12)
 #define KERNEL_MAP_NUM_ENTRIES (sizeof(direct_map) / sizeof(direct_map[0]))
 
 void vm_init();
 
+void vm_init_ap();
+
 void *create_page_directory();
 
 void free_page_directory(void *pd_addr);
@@ -56,6 +99,10 @@ void free_page_directory(void *pd_addr);
 void *clone_paging_info(int *pd);
 
 void free_paging_info(int *pd);
+
+int reset_paging_info(int *pd, simple_elf_t *se_hdr);
+
+void trim_paging_info(int *pd);
  
 int setup_page_table(simple_elf_t *se_hdr, void *pd_addr);
 
@@ -71,18 +118,52 @@ int is_addr_cow(void *addr);
 
 int handle_cow(void *addr);
 
+int is_addr_pt_cow(void *addr);
+
+int handle_pt_cow(void *addr);
+
+int is_addr_zfod(void *addr);
+
+int handle_zfod(void *addr);
+
+int is_addr_lod(void *addr);
+
+int handle_lod(void *addr, const program_image_t *image);
+
+int is_addr_swapped(void *addr);
+
+int handle_swapped(void *addr);
+
 void enable_paging();
 
+void zero_frame(void *frame);
+
 int is_memory_range_mapped(void *base, int len);
 
+int is_addr_mapped(void *addr);
+
+int is_fault_resolved(void *addr, unsigned int error_code);
+
+int is_memory_range_accessible(void *base, int len, int write);
+
 int map_new_pages(void *base, int length);
 
 int unmap_new_pages(void *base);
 
+int map_shm(void *base, shm_segment_t *seg);
+
+int unmap_shm(void *base);
+
+int map_ramdisk_file(void *base, int toc_index, int len);
+
 int is_memory_writable(void *ptr, int bytes);
 
 int is_memory_writable(void *ptr, int bytes);
 
 int map_phys_to_virt(void *base_phys, void *base_virt, int len);
 
+int copy_to_pd(int *pd, void *dst, const void *src, int len);
+
+void get_mem_stats(mem_stats_t *stats);
+
 #endif /* __VM_H */
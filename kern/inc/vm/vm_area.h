@@ -0,0 +1,64 @@
+/** @file vm_area.h
+ *  @brief regions of a user address space
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef __VM_AREA_H
+#define __VM_AREA_H
+
+#include <sync/mutex.h>
+
+#define VMA_READ 1
+#define VMA_WRITE 2
+
+/* What backs the pages of an area */
+#define VMA_IMAGE 0      /* text, data and rodata of the program */
+#define VMA_ZERO 1       /* bss and stack */
+#define VMA_NEW_PAGES 2  /* a region allocated with new_pages */
+#define VMA_PHYS 3       /* device memory mapped by udriv */
+#define VMA_SHM 4        /* a shared memory segment */
+#define VMA_FILE 5       /* a ramdisk file mapped with map_file */
+
+/** @brief a page aligned range [start, end) of an address space */
+typedef struct vm_area {
+    unsigned int start;
+    unsigned int end;
+    int prot;               /* VMA_READ | VMA_WRITE */
+    int type;               /* VMA_* backing of the area */
+    void *object;           /* what backs the area, for VMA_SHM */
+} vm_area_t;
+
+/** @brief the areas of an address space, sorted by start address */
+typedef struct vm_map {
+    vm_area_t *areas;
+    int num_areas;
+    int max_areas;
+    mutex_t lock;           /* Serializes changes to the map */
+} vm_map_t;
+
+vm_map_t *vm_map_create();
+
+void vm_map_destroy(vm_map_t *map);
+
+int vm_map_copy(vm_map_t *dst, vm_map_t *src);
+
+void vm_map_clear(vm_map_t *map);
+
+int vm_map_find(vm_map_t *map, unsigned int addr, vm_area_t *area);
+
+int vm_map_overlaps(vm_map_t *map, unsigned int start, unsigned int end);
+
+int vm_map_covers(vm_map_t *map, unsigned int start, unsigned int end,
+                  int prot);
+
+int vm_map_insert(vm_map_t *map, unsigned int start, unsigned int end,
+                  int prot, int type, void *object);
+
+int vm_map_insert_gaps(vm_map_t *map, unsigned int start, unsigned int end,
+                       int prot, int type);
+
+int vm_map_remove(vm_map_t *map, unsigned int start, int type,
+                  vm_area_t *area);
+
+#endif /* __VM_AREA_H */
@@ -34,18 +34,26 @@ static void *setup_swexn_stack(void *esp3, ureg_t *ureg, void *arg);
 static void update_fault_stack(void *esp3, swexn_handler_t eip, 
                                thread_struct_t *curr_thread);
 static void kill_current_thread(int cause);
+static void handle_bad_page_fault(void **fault_eip);
 void handle_fault(int cause);
 int invoke_swexn_handler(int cause);
 
 /** @brief Callback function for the timer handler
  *
- *  This function invokes the context switch during every
- *  timer tick
+ *  This function sets when the next timer interrupt comes and invokes
+ *  the context switch when the scheduler decides the running thread 
+ *  should be preempted. The timer is set first since the switch may not
+ *  return for a long time.
  *
  *  @return void
  */
 void tickback(unsigned int ticks) {
-	context_switch();
+	int next_ticks;
+	int preempt = scheduler_tick(ticks, &next_ticks);
+	set_next_timer_interrupt(next_ticks);
+	if(preempt) {
+		context_switch();
+	}
 }
 
 /** @brief this function handles a divide by zero error condition.
@@ -59,27 +67,100 @@ void divide_error_handler_c() {
 /** @brief This function handles the page fault
  *
  *  The page fault handler checks the address that 
- *  caused page fault. If the address is a COW page fault,
- *  then the handler invokes the COW handler using the VM
- *  module. If not, then it checks for the swexn handler
- *  installed. If the handler is not installed, then the
- *  page fault handler kills the thread.
+ *  caused page fault. If the address is a demand-zero or
+ *  demand-load page the VM module allocates a frame for it and
+ *  fills it with zeroes or from the program image. A swapped out 
+ *  page is brought back from the swap store. Faults in a
+ *  page table shared after fork first get a private copy of
+ *  the page table. If the
+ *  address is a COW page fault, then the handler invokes the 
+ *  COW handler using the VM module. If not, and the kernel was
+ *  copying user memory, the copy is made to fail. Otherwise it 
+ *  checks for the swexn handler installed. If the handler is not 
+ *  installed, then the page fault handler kills the thread.
+ *
+ *  Another thread of the task may have handled a fault on the same
+ *  page while this one waited for the kernel lock, or while it blocked
+ *  here. The access is simply retried when the page allows it now.
+ *
+ * @param fault_eip where the faulting instruction address was saved
+ * @param error_code the error code pushed for the fault
  *
  * @return Void
  */
-void page_fault_handler_c() {
+void page_fault_handler_c(void **fault_eip, unsigned int error_code) {
 	void *page_fault_addr = (void *)get_cr2();
+	int pt_split = 0;
+
+	if(is_fault_resolved(page_fault_addr, error_code)) {
+		return;
+	}
+
+	/* Nothing was ever mapped there */
+	if(!is_addr_mapped(page_fault_addr)) {
+		handle_bad_page_fault(fault_eip);
+		return;
+	}
+
+	/* A page table shared after fork has to be made private before any
+	 * of its entries can be populated or written */
+	if(is_addr_pt_cow(page_fault_addr)) {
+		if(handle_pt_cow(page_fault_addr) < 0) {
+			kill_current_thread(SWEXN_CAUSE_PAGEFAULT);
+		}
+		pt_split = 1;
+	}
 	
-	if(is_addr_cow(page_fault_addr)) {
+	if(is_addr_zfod(page_fault_addr)) {
+		if(handle_zfod(page_fault_addr) < 0) {
+			kill_current_thread(SWEXN_CAUSE_PAGEFAULT);
+		}
+	}
+	else if(is_addr_lod(page_fault_addr)) {
+		if(handle_lod(page_fault_addr, &get_curr_task()->image) < 0) {
+			kill_current_thread(SWEXN_CAUSE_PAGEFAULT);
+		}
+	}
+	else if(is_addr_swapped(page_fault_addr)) {
+		if(handle_swapped(page_fault_addr) < 0) {
+			kill_current_thread(SWEXN_CAUSE_PAGEFAULT);
+		}
+	}
+	else if(is_addr_cow(page_fault_addr)) {
 		if(handle_cow(page_fault_addr) < 0) {
 			kill_current_thread(SWEXN_CAUSE_PAGEFAULT);
 		}
 	} 
+	else if(pt_split || is_fault_resolved(page_fault_addr, error_code)) {
+		/* The access may well succeed now, retry it */
+		return;
+	}
     else {
-        handle_fault(SWEXN_CAUSE_PAGEFAULT);
+        handle_bad_page_fault(fault_eip);
     }
 }
 
+/** @brief handle a page fault on memory the task may not touch
+ *
+ *  If the fault was taken by one of the user copy functions, it
+ *  resumes at the fixup of the faulting instruction, which makes the
+ *  copy return an error. Otherwise the fault is the task's.
+ *
+ *  @param fault_eip where the faulting instruction address was saved
+ *
+ *  @return void
+ */
+void handle_bad_page_fault(void **fault_eip) {
+	user_copy_fixup_t *fixup;
+	for(fixup = user_copy_fixups; fixup->fault_eip != NULL; fixup++) {
+		if(fixup->fault_eip == *fault_eip) {
+			*fault_eip = fixup->fixup_eip;
+			return;
+		}
+	}
+	handle_fault(SWEXN_CAUSE_PAGEFAULT);
+}
+
 /** @brief this function handles a debug exception
  *
  *  @return void
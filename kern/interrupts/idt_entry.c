@@ -12,7 +12,6 @@
 #include <common/errors.h>
 #include <string/string.h>
 
-#define TRAP_GATE_FLAGS 15
 #define INTERRUPT_GATE_FLAGS 14
 
 #define ZEROES 0
@@ -32,14 +31,18 @@ typedef struct {
     unsigned offset_2:16;
 } idt_entry;
 
-static void get_default_trap_idt(idt_entry *entry, unsigned int);
 static void get_default_interrupt_idt(idt_entry *entry, unsigned int);
 
 /** @brief function to add a entry in the IDT table
  *
  *  The function calls the idt_base() function to retrieve the 
  *  base of the IDT and uses the interrupt_num to figure out the 
- *  right memory location to copy the interrupt handler to
+ *  right memory location to copy the interrupt handler to.
+ *
+ *  Every handler is entered through an interrupt gate so that it takes 
+ *  the kernel lock before anything can interrupt it. The handler of a 
+ *  TRAP_GATE turns interrupts back on itself once it holds the lock
+ *  (see core/cpu_asm.h).
  *
  *  @param handler the address of the interrupt handler
  *  @param interrupt_num the interrupt for which we wish to install an
@@ -55,12 +58,7 @@ int add_idt_entry(void *handler, int interrupt_num, int type, unsigned int dpl)
     }
     void *idt_base_addr = idt_base();
     idt_entry entry;
-    if (type == TRAP_GATE) {
-        get_default_trap_idt(&entry, dpl);
-    } 
-    else if (type == INTERRUPT_GATE) {
-        get_default_interrupt_idt(&entry, dpl);
-    }
+    get_default_interrupt_idt(&entry, dpl);
 
     entry.offset_1 = (int)handler & 0xffff;
     entry.offset_2 = ((int)handler >> 16) & 0xffff;
@@ -70,21 +68,6 @@ int add_idt_entry(void *handler, int interrupt_num, int type, unsigned int dpl)
 	return 0;
 }
 
-/** @brief function to return a pointer to an idt_entry struct 
- *         with the default values filled in for a trap gate
- *
- *  @param entry the idt entry to be filled up
- *  @param dpl the descriptor privilege level
- *  @return void
- */
-void get_default_trap_idt(idt_entry *entry, unsigned int dpl) {
-    entry->seg_selector = SEGSEL_KERNEL_CS;
-    entry->zeroes = ZEROES;
-    entry->flags = TRAP_GATE_FLAGS;
-    entry->dpl = dpl;
-    entry->present = PRESENT;
-}
-
 /** @brief function to return a pointer to an idt_entry struct 
  *         with the default values filled ini for an interrupt gate
  *
@@ -37,6 +37,7 @@
 #include <exec2obj.h>
 #include <core/scheduler.h>
 #include <syscalls/syscall_handlers.h>
+#include <core/cpu.h>
 
 static void set_default_color();
 
@@ -52,6 +53,9 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
 	/* Initialize the thread safe malloc library */
 	init_thr_safe_malloc_lib();
 
+    /* Find the other processors, vm_init maps their local APIC */
+    cpus_init(mbinfo);
+
     /* Initialize the VM system */
     vm_init();
 
@@ -64,6 +68,9 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
 	/* Install the system call handlers */
     kernel_assert(install_syscall_handlers() == 0);
 
+    /* Boot the other processors, they wait for the idle task */
+    boot_cpus();
+
     /* Clear the console of crud */
     clear_console();
 
@@ -17,66 +17,139 @@
 #include <common/assert.h>
 #include <vm/vm.h>
 #include <common/errors.h>
+#include <page.h>
 
 #define MAX_SECTION_NAME_LEN 10 /* longer than any we care about */
-static int load_segment(const char *filename, void *start, 
-                        int len, int offset);
+static void load_segment_page(const program_image_t *image, void *page_addr,
+                              char *buf, unsigned long start, 
+                              unsigned long len, unsigned long offset);
 
-/** @brief load a program into memory
+/** @brief set up the image of a program to be demand loaded
  *
- *  memcpy the program regions into memory. It is assumed that paging
- *  information has been setup so copying here should not PAGE FAULT
+ *  Looks up the program in the ramdisk and parses its ELF header. The 
+ *  image records where each segment lives in the file so that pages can 
+ *  be filled in by load_page() when they are first touched.
  *
- *  @pre paging is enabled and page table information has been setup
- *  @param se_hdr the struct containing ELF data about program
+ *  @param prog_name the name of the program
+ *  @param image the image struct to be filled in
  *  @return int 0 on success -ve integer on failure
  */
-int load_program(simple_elf_t *se_hdr) {
-    int retval = 0;
+int setup_program_image(const char *prog_name, program_image_t *image) {
+    int i = find_file(prog_name, NULL);
+    if (i < 0) {
+        return ERR_FAILURE;
+    }
+    image->toc_index = i;
 
-    if ((retval = load_segment(se_hdr->e_fname, (void *)se_hdr->e_txtstart, 
-                              se_hdr->e_txtlen, se_hdr->e_txtoff)) < 0) {
-        return retval;
+    /* The name in the TOC outlives any kernel copy of prog_name */
+    if (elf_load_helper(&image->se_hdr, 
+                        exec2obj_userapp_TOC[i].execname) != ELF_SUCCESS) {
+        return ERR_FAILURE;
+    }
+    return 0;
+}
+
+/** @brief look up a file in the ramdisk
+ *
+ *  @param filename the name of the file
+ *  @param len set to the length of the file in bytes, may be NULL
+ *  @return int the index of the file in exec2obj_userapp_TOC, ERR_FAILURE
+ *          if there is no such file
+ */
+int find_file(const char *filename, int *len) {
+    int i;
+    for (i = 0; i < exec2obj_userapp_count; i++) {
+        if (!strncmp(filename, exec2obj_userapp_TOC[i].execname, 
+                    MAX_EXECNAME_LEN)) {
+            if (len != NULL) {
+                *len = exec2obj_userapp_TOC[i].execlen;
+            }
+            return i;
+        }
     }
-    if ((retval = load_segment(se_hdr->e_fname, (void *)se_hdr->e_datstart, 
-                              se_hdr->e_datlen, se_hdr->e_datoff)) < 0) {
-        return retval;
+    return ERR_FAILURE;
+}
+
+/** @brief fill in one page of a file from the ramdisk
+ *
+ *  The part of the page past the end of the file is zeroed.
+ *
+ *  @param toc_index the index of the file in exec2obj_userapp_TOC
+ *  @param offset the page aligned offset of the page in the file
+ *  @param buf the page sized kernel buffer to fill
+ *  @return void
+ */
+void load_file_page(int toc_index, int offset, void *buf) {
+    const exec2obj_userapp_TOC_entry *entry = &exec2obj_userapp_TOC[toc_index];
+    int len = entry->execlen - offset;
+    if (len > PAGE_SIZE) {
+        len = PAGE_SIZE;
     }
-    if ((retval = load_segment(se_hdr->e_fname, (void *)se_hdr->e_rodatstart, 
-                              se_hdr->e_rodatlen, se_hdr->e_rodatoff)) < 0) {
-        return retval;
+
+    memset(buf, 0, PAGE_SIZE);
+    if (len > 0) {
+        memcpy(buf, entry->execbytes + offset, len);
     }
+}
+
+/** @brief fill in one page of a program from the ramdisk
+ *
+ *  Zeroes the buffer and copies in the parts of the text, data and rodata 
+ *  segments which fall in the page. Whatever is left over (the tail of a 
+ *  segment, the start of bss) stays zero.
+ *
+ *  @param image the program image the page belongs to
+ *  @param page_addr the page aligned virtual address of the page
+ *  @param buf the page sized kernel buffer to fill
+ *  @return void
+ */
+void load_page(const program_image_t *image, void *page_addr, void *buf) {
+    const simple_elf_t *se_hdr = &image->se_hdr;
 
-    /* Load bss section into memory */
-    memset((void *)se_hdr->e_bssstart, 0, se_hdr->e_bsslen);
-    return retval;
+    memset(buf, 0, PAGE_SIZE);
+    load_segment_page(image, page_addr, buf, se_hdr->e_txtstart, 
+                      se_hdr->e_txtlen, se_hdr->e_txtoff);
+    load_segment_page(image, page_addr, buf, se_hdr->e_datstart, 
+                      se_hdr->e_datlen, se_hdr->e_datoff);
+    load_segment_page(image, page_addr, buf, se_hdr->e_rodatstart, 
+                      se_hdr->e_rodatlen, se_hdr->e_rodatoff);
 }
 
-/** @brief load a program segment into memory
+/** @brief copy the part of a segment that falls in a page
  *
+ *  @param image the program image the segment belongs to
+ *  @param page_addr the page aligned virtual address being filled
+ *  @param buf the kernel buffer standing in for the page
  *  @param start starting address of the segment
  *  @param len length of the segment
  *  @param offset the offset of the segment in the file
- *  @return int 0 on success -ve integer on failure
+ *  @return void
  */
-int load_segment(const char *filename, void *start, int len, int offset) {
-    char *buf;
+void load_segment_page(const program_image_t *image, void *page_addr,
+                       char *buf, unsigned long start, unsigned long len, 
+                       unsigned long offset) {
+    unsigned long page_start = (unsigned long)page_addr;
+    unsigned long page_end = page_start + PAGE_SIZE;
+    unsigned long copy_start = (start > page_start) ? start : page_start;
+    unsigned long copy_end = (start + len < page_end) ? start + len : page_end;
 
-	if(len > 0) {
-		buf = (char *)smalloc(len);
-        if (buf == NULL) {
-            return ERR_NOMEM;
-        }
-    	int ret = getbytes(filename, offset, len, buf);
-        if(ret < 0) {
-			sfree(buf, len);
-            return ret;
-        }
-		memcpy(start, buf, len);
-		sfree(buf, len);
-	}
-    return 0;
+    if (copy_start >= copy_end) {
+        return;
+    }
+
+    const exec2obj_userapp_TOC_entry *entry = 
+                                &exec2obj_userapp_TOC[image->toc_index];
+    unsigned long file_off = offset + (copy_start - start);
+    if (file_off >= entry->execlen) {
+        return;
+    }
+    if (file_off + (copy_end - copy_start) > entry->execlen) {
+        copy_end = copy_start + (entry->execlen - file_off);
+    }
+    memcpy(buf + (copy_start - page_start), entry->execbytes + file_off, 
+           copy_end - copy_start);
 }
+
 /**
  * Copies data from a file into a buffer.
  *
@@ -52,6 +52,8 @@ void enable_mutex_lib() {
  *
  *  Before the first task is loaded, there is only
  *  one thread running, and we do not disable interrupts.
+ *  The other processors are kept out by the kernel lock, which the 
+ *  caller holds (see core/cpu.c).
  *
  *  @return void
  */
@@ -202,3 +204,22 @@ void mutex_unlock_int_save(mutex_t *mp) {
     	enable_interrupts_mutex();
     }
 }
+
+/** @brief acquire the lock only if it is free
+ *
+ *  This function never blocks, so it can be used from the context switch
+ *  path. Interrupts must already be disabled. The lock is released with
+ *  mutex_unlock_int_save() to keep them disabled.
+ *
+ *  @param mp the mutex to be locked
+ *  @return int 0 if the lock was acquired, ERR_BUSY if it is held
+ */
+int mutex_trylock(mutex_t *mp) {
+	thread_assert(mp != NULL);
+	thread_assert(mp->value != MUTEX_INVALID);
+	if(mp->value == 0) {
+		return ERR_BUSY;
+	}
+	mp->value = 0;
+	return 0;
+}
@@ -0,0 +1,62 @@
+/** @file spinlock.c
+ *  @brief Implementation of spinlocks
+ *
+ *  Unlike mutexes, which keep other threads of the same processor out by
+ *  disabling interrupts, a spinlock keeps out the other processors. The
+ *  holder must not block, and should have interrupts disabled if an 
+ *  interrupt handler may take the same lock.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <sync/spinlock.h>
+#include <asm/asm.h>
+
+/** @brief initialize a spinlock, unlocked
+ *
+ *  @param lock the spinlock
+ *  @return void
+ */
+void spin_init(spinlock_t *lock) {
+    lock->locked = 0;
+}
+
+/** @brief take a spinlock, spinning until it is free
+ *
+ *  The lock word is only read while it is held elsewhere, so waiting 
+ *  processors do not keep stealing its cache line from the holder.
+ *
+ *  @param lock the spinlock
+ *  @return void
+ */
+void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (lock->locked) {
+            continue;
+        }
+    }
+}
+
+/** @brief take a spinlock if it is free
+ *
+ *  @param lock the spinlock
+ *  @return int 1 if the lock was taken, 0 if it is held elsewhere
+ */
+int spin_trylock(spinlock_t *lock) {
+    if (lock->locked) {
+        return 0;
+    }
+    return atomic_xchg((int *)&lock->locked, 1) == 0;
+}
+
+/** @brief release a spinlock
+ *
+ *  The exchange orders every write made under the lock before the 
+ *  release.
+ *
+ *  @param lock the spinlock, held
+ *  @return void
+ */
+void spin_unlock(spinlock_t *lock) {
+    atomic_xchg((int *)&lock->locked, 0);
+}
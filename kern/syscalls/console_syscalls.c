@@ -15,41 +15,82 @@
 #include <stdio.h>
 #include <syscalls/syscall_util.h>
 #include <vm/vm.h>
+#include <drivers/keyboard/keyboard_circular_buffer.h>
+#include <sync/mutex.h>
+
+#define PRINT_CHUNK_SIZE 256
+
+static char line_buf[KEYBOARD_BUFFER_SIZE]; /* Protected by readline_mutex */
+static mutex_t print_mutex; /* Keeps the output of a print together */
+
+/** @brief initialize the state of the print system call
+ *
+ *  @return int 0 on success, -ve integer on failure
+ */
+int print_init() {
+    return mutex_init(&print_mutex);
+}
 
 /** @brief print to screen 
+ *
+ *  The whole buffer is checked against the areas of the address space
+ *  first so that nothing is printed for a bad buffer. It is then copied
+ *  and printed a chunk at a time, holding print_mutex throughout so that
+ *  prints of other threads do not get mixed in.
  *
  *  @param arg_packet pointer to a memory location containing the arguments
  *  @return int 0 on success, -ve integer on failure
  */
 int print_handler_c(void *arg_packet) {
-    int len = *(int *)arg_packet;
-    char *buf = (char *)(*((int *)arg_packet + 1));
-    if (is_pointer_valid(buf, len) < 0) {
+    int args[2];
+    char kern_buf[PRINT_CHUNK_SIZE];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
         return ERR_INVAL;
     }
-    putbytes(buf, len);
-    return 0;
+    int len = args[0];
+    char *buf = (char *)args[1];
+    if (is_memory_range_accessible(buf, len, 0) < 0) {
+        return ERR_INVAL;
+    }
+    int retval = 0;
+    mutex_lock(&print_mutex);
+    while (len > 0) {
+        int chunk = (len < PRINT_CHUNK_SIZE) ? len : PRINT_CHUNK_SIZE;
+        /* Only fails if another thread unmaps the buffer meanwhile */
+        if (copy_from_user(kern_buf, buf, chunk) < 0) {
+            retval = ERR_INVAL;
+            break;
+        }
+        putbytes(kern_buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    mutex_unlock(&print_mutex);
+    return retval;
 }
 
 /** @brief read a line from console
+ *
+ *  The buffer is checked before the line is taken out of the keyboard
+ *  buffer, so a bad buffer does not lose the line.
  *
  *  @param arg_packet pointer to memory location containing the arguments
  *  @return int number of bytes copied into the buffer
  */
 int readline_handler_c(void *arg_packet) {
-    int len = *(int *)arg_packet;
-    if (len <= 0) {
+    int args[2];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
         return ERR_INVAL;
     }
-    char *buf = (char *)(*((int *)arg_packet + 1));
-    if (is_pointer_valid(buf, len) < 0
-        || is_memory_writable(buf, len) < 0) {
+    int len = args[0];
+    char *buf = (char *)args[1];
+    if (len <= 0 || is_memory_range_accessible(buf, len, 1) < 0) {
         return ERR_INVAL;
     }
     thread_struct_t *curr_thread = get_curr_thread();
 
     mutex_lock(&readline_mutex);
-    int retval = nextline(buf, len);
+    int retval = nextline(line_buf, len);
     if (retval == ERR_INVAL) {
 		mutex_unlock(&readline_mutex);
         return ERR_INVAL;
@@ -57,7 +98,10 @@ int readline_handler_c(void *arg_packet) {
     while (retval == ERR_NOTAVAIL) {
         cond_wait(&readline_cond_var, &readline_mutex, 
                   &curr_thread->cond_wait_link, WAITING);
-        retval = nextline(buf, len);
+        retval = nextline(line_buf, len);
+    }
+    if (copy_to_user(buf, line_buf, retval) < 0) {
+        retval = ERR_INVAL;
     }
     mutex_unlock(&readline_mutex);
     return retval;
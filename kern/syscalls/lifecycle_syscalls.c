@@ -37,6 +37,14 @@ int exec_handler_c(void *arg_packet) {
 	return do_exec(arg_packet);
 }
 
+/** @brief Handler to call the spawn function
+ *
+ *  @return int new PID on success, -ve integer on failure
+ */
+int spawn_handler_c(void *arg_packet) {
+	return do_spawn(arg_packet);
+}
+
 /** @brief Handler to call the set_status function
  *
  *  @return void
@@ -11,6 +11,7 @@
 #include <common/errors.h>
 #include <simics.h>
 #include <core/thread.h>
+#include <syscalls/syscall_util.h>
 
 /** @brief Handler to call the new_pages handler function
  *
@@ -40,3 +41,92 @@ int remove_pages_handler_c(void *base) {
     
     return unmap_new_pages(base);
 }
+
+/** @brief Handler for the memstats syscall
+ *
+ *  @param stats user memory to put the memory usage of the task in
+ *  @return int 0 on success, -ve integer on failure
+ */
+int memstats_handler_c(void *stats) {
+    mem_stats_t kern_stats;
+    get_mem_stats(&kern_stats);
+    return copy_to_user(stats, &kern_stats, sizeof(mem_stats_t));
+}
+
+/** @brief Handler for the shm_create syscall
+ *
+ *  Creates a segment of zeroed memory named by a key and maps it at base.
+ *
+ *  @param arg_packet the key, the base and the length of the segment
+ *  @return int 0 on success, -ve integer on failure
+ */
+int shm_create_handler_c(void *arg_packet) {
+    int args[3];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
+        return ERR_INVAL;
+    }
+    int key = args[0];
+    void *base = (void *)args[1];
+    int len = args[2];
+    if (len <= 0 || (len % PAGE_SIZE) != 0 || ((int)base % PAGE_SIZE) != 0) {
+        return ERR_INVAL;
+    }
+    if (is_memory_range_mapped(base, len) != MEMORY_REGION_UNMAPPED) {
+        return ERR_INVAL;
+    }
+
+    shm_segment_t *seg;
+    int retval = shm_alloc(key, len / PAGE_SIZE, &seg);
+    if (retval < 0) {
+        return retval;
+    }
+    if ((retval = map_shm(base, seg)) < 0) {
+        shm_put(seg);
+    }
+    return retval;
+}
+
+/** @brief Handler for the shm_attach syscall
+ *
+ *  Maps the segment named by a key at base.
+ *
+ *  @param arg_packet the key and the base
+ *  @return int the length of the segment on success, -ve integer on failure
+ */
+int shm_attach_handler_c(void *arg_packet) {
+    int args[2];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
+        return ERR_INVAL;
+    }
+    int key = args[0];
+    void *base = (void *)args[1];
+    if (((int)base % PAGE_SIZE) != 0) {
+        return ERR_INVAL;
+    }
+
+    shm_segment_t *seg = shm_lookup(key);
+    if (seg == NULL) {
+        return ERR_NOTAVAIL;
+    }
+    int len = seg->num_pages * PAGE_SIZE;
+    int retval = ERR_INVAL;
+    if (is_memory_range_mapped(base, len) != MEMORY_REGION_UNMAPPED ||
+        (retval = map_shm(base, seg)) < 0) {
+        shm_put(seg);
+        return retval;
+    }
+    return len;
+}
+
+/** @brief Handler for the shm_detach syscall
+ *
+ *  @param base the base a segment was mapped at by shm_create or shm_attach
+ *  @return int 0 on success, -ve integer on failure
+ */
+int shm_detach_handler_c(void *base) {
+    if (((int)base % PAGE_SIZE) != 0) {
+        return ERR_INVAL;
+    }
+
+    return unmap_shm(base);
+}
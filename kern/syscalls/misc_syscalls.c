@@ -10,25 +10,36 @@
 #include <loader/loader.h>
 #include <common/errors.h>
 #include <simics.h>
+#include <core/cpu.h>
+#include <asm/asm.h>
 #define MAX_FILE_NAME 128
 
+/** @brief Handler for the halt syscall
+ *
+ *  The other processors are stopped first. This one parks in case
+ *  sim_halt is a no-op.
+ *
+ *  @return Does not return
+ */
+void halt_handler_c() {
+    halt_cpus();
+    sim_halt();
+    park_cpu();
+}
+
 /** @brief read a file
  *
  * @param arg_packet
  * @return int 0 on success -ve integer on failure
  */
 int readfile_handler_c(void *arg_packet) {
-    char *filename = (char *)(*((int *)arg_packet));
-    int count;
-    for (count = 0; count < MAX_FILE_NAME; count++) {
-        if (is_pointer_valid(&filename[count], 1) < 0) {
-            return ERR_INVAL;
-        }
-        if (filename[count] == '\0') {
-            break;
-        }
-    }
-    if (count == 0 || count == MAX_FILE_NAME) {
+    char filename[MAX_FILE_NAME];
+    int count = strncpy_from_user(filename, (char *)(*((int *)arg_packet)),
+                                  MAX_FILE_NAME);
+    if (count == ERR_INVAL) {
+        return ERR_INVAL;
+    }
+    if (count <= 1) {
         return ERR_FAILURE;
     }
 
@@ -40,3 +51,43 @@ int readfile_handler_c(void *arg_packet) {
     return bytes_read;
 }
 
+
+/** @brief Handler for the map_file syscall
+ *
+ *  Maps a ramdisk file read-only at a page aligned address. The pages of
+ *  the file are shared with every other task mapping it.
+ *
+ *  @param arg_packet the name of the file and the address
+ *  @return int the length of the file on success, -ve integer on failure
+ */
+int map_file_handler_c(void *arg_packet) {
+    int args[2];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
+        return ERR_INVAL;
+    }
+    char filename[MAX_FILE_NAME];
+    int count = strncpy_from_user(filename, (char *)args[0], MAX_FILE_NAME);
+    if (count == ERR_INVAL) {
+        return ERR_INVAL;
+    }
+    if (count <= 1) {
+        return ERR_FAILURE;
+    }
+
+    void *base = (void *)args[1];
+    int len;
+    int toc_index = find_file(filename, &len);
+    if (toc_index < 0) {
+        return ERR_FAILURE;
+    }
+    if (len <= 0 || ((int)base % PAGE_SIZE) != 0 ||
+        is_memory_range_mapped(base, len) != MEMORY_REGION_UNMAPPED) {
+        return ERR_INVAL;
+    }
+
+    int retval = map_ramdisk_file(base, toc_index, len);
+    if (retval < 0) {
+        return retval;
+    }
+    return len;
+}
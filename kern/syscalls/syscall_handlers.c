@@ -23,11 +23,16 @@ static int install_print_handler();
 static int install_fork_handler();
 static int install_thread_fork_handler();
 static int install_exec_handler();
+static int install_spawn_handler();
 static int install_set_status_handler();
 static int install_halt_handler();
 static int install_wait_handler();
 static int install_vanish_handler();
 static int install_new_pages_handler();
+static int install_memstats_handler();
+static int install_shm_create_handler();
+static int install_shm_attach_handler();
+static int install_shm_detach_handler();
 static int install_remove_pages_handler();
 static int install_readline_handler();
 static int install_gettid_handler();
@@ -37,7 +42,11 @@ static int install_make_runnable_handler();
 static int install_get_ticks_handler();
 static int install_sleep_handler();
 static int install_swexn_handler();
+static int install_set_priority_handler();
+static int install_get_time_ns_handler();
+static int install_sleep_ns_handler();
 static int install_readfile_handler();
+static int install_map_file_handler();
 static int install_set_term_color_handler();
 static int install_set_cursor_pos_handler();
 static int install_get_cursor_pos_handler();
@@ -71,6 +80,9 @@ int install_syscall_handlers() {
 	if((retval = install_exec_handler()) < 0) {
 		return retval;
 	}
+	if((retval = install_spawn_handler()) < 0) {
+		return retval;
+	}
 	if((retval = install_set_status_handler()) < 0) {
 		return retval;
 	}
@@ -89,6 +101,18 @@ int install_syscall_handlers() {
     if((retval = install_remove_pages_handler()) < 0) {
 		return retval;
 	}
+    if((retval = install_memstats_handler()) < 0) {
+		return retval;
+	}
+    if((retval = install_shm_create_handler()) < 0) {
+		return retval;
+	}
+    if((retval = install_shm_attach_handler()) < 0) {
+		return retval;
+	}
+    if((retval = install_shm_detach_handler()) < 0) {
+		return retval;
+	}
     if((retval = install_readline_handler()) < 0) {
 		return retval;
 	}
@@ -116,9 +140,21 @@ int install_syscall_handlers() {
     if((retval = install_swexn_handler()) < 0) {
 		return retval;
 	}
+    if((retval = install_set_priority_handler()) < 0) {
+		return retval;
+	}
+    if((retval = install_get_time_ns_handler()) < 0) {
+		return retval;
+	}
+    if((retval = install_sleep_ns_handler()) < 0) {
+		return retval;
+	}
     if((retval = install_readfile_handler()) < 0) {
 		return retval;
 	}
+    if((retval = install_map_file_handler()) < 0) {
+		return retval;
+	}
     if((retval = install_set_term_color_handler()) < 0) {
 		return retval;
 	}
@@ -168,6 +204,10 @@ int install_gettid_handler() {
  *  @return int return value of add_idt_entry
  */
 int install_print_handler() {
+    int retval;
+    if ((retval = print_init()) < 0) {
+        return retval;
+    }
     return add_idt_entry(print_handler, PRINT_INT, TRAP_GATE, USER_DPL);
 }
 
@@ -196,6 +236,14 @@ int install_exec_handler() {
 	return add_idt_entry(exec_handler, EXEC_INT, TRAP_GATE, USER_DPL);
 }
 
+/** @brief Function to install a handler for spawn
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_spawn_handler() {
+	return add_idt_entry(spawn_handler, SPAWN_INT, TRAP_GATE, USER_DPL);
+}
+
 /** @brief Function to install a handler for set_status
  *
  *  @return int return value of add_idt_entry
@@ -237,6 +285,41 @@ int install_new_pages_handler() {
 							TRAP_GATE, USER_DPL);
 }
 
+/** @brief Function to install a handler for memstats syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_memstats_handler() {
+	return add_idt_entry(memstats_handler, MEMSTATS_INT, TRAP_GATE, USER_DPL);
+}
+
+/** @brief Function to install a handler for shm_create syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_shm_create_handler() {
+	return add_idt_entry(shm_create_handler, SHM_CREATE_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
+/** @brief Function to install a handler for shm_attach syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_shm_attach_handler() {
+	return add_idt_entry(shm_attach_handler, SHM_ATTACH_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
+/** @brief Function to install a handler for shm_detach syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_shm_detach_handler() {
+	return add_idt_entry(shm_detach_handler, SHM_DETACH_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
 /** @brief Function to install a handler for readline syscall
  *
  *  @return int return value of add_idt_entry
@@ -310,6 +393,33 @@ int install_swexn_handler() {
 	return add_idt_entry(swexn_handler, SWEXN_INT, TRAP_GATE, USER_DPL);
 }
 
+/** @brief Function to install a handler for set_priority syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_set_priority_handler() {
+	return add_idt_entry(set_priority_handler, SET_PRIORITY_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
+/** @brief Function to install a handler for get_time_ns syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_get_time_ns_handler() {
+	return add_idt_entry(get_time_ns_handler, GET_TIME_NS_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
+/** @brief Function to install a handler for sleep_ns syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_sleep_ns_handler() {
+	return add_idt_entry(sleep_ns_handler, SLEEP_NS_INT, 
+							TRAP_GATE, USER_DPL);
+}
+
 /** @brief Function to install a handler for readfile syscall
  *
  *  @return int return value of add_idt_entry
@@ -318,6 +428,14 @@ int install_readfile_handler() {
 	return add_idt_entry(readfile_handler, READFILE_INT, TRAP_GATE, USER_DPL);
 }
 
+/** @brief Function to install a handler for map_file syscall
+ *
+ *  @return int return value of add_idt_entry
+ */
+int install_map_file_handler() {
+	return add_idt_entry(map_file_handler, MAP_FILE_INT, TRAP_GATE, USER_DPL);
+}
+
 /** @brief Function to install a handler for set_term_color syscall
  *
  *  @return int return value of add_idt_entry
@@ -19,6 +19,7 @@
 #include <syscalls/syscall_util.h>
 
 static int validate_uregs(ureg_t *uregs);
+static int is_user_range(const void *ptr, int len);
 
 /** @brief setup the kernel stack
  *
@@ -123,39 +124,81 @@ int is_pointer_valid(void *ptr, int bytes) {
     return 0;
 }
 
-/** @brief copy user memory to kernel memory checking for validity
+/** @brief copy a string from user memory to kernel memory
  *
- *  Check validity of each byte and if valid copy into kernel buf. If
- *  data exceeds max_size return ERR_BIG. It is expected that the caller
- *  of this function will allocate atleast max_size memory for buf. This
- *  is a reasonable assumption to make since this function will be used only
- *  by kernel code.
+ *  The string is copied without walking the page tables first. A fault 
+ *  on user memory which cannot be resolved makes the copy fail. If data
+ *  exceeds max_size return ERR_BIG. It is expected that the caller
+ *  of this function will allocate atleast max_size memory for buf.
  *  
  *  @param buf kernel memory to copy into
  *  @param ptr user ptr to copy from
  *  @param max_size the maximum amount of data in bytes to copy
  *
- *  @return bytes copied on success, -ve integer on failure 
+ *  @return bytes copied including the NUL on success, -ve integer on 
+ *          failure 
  */
-int copy_user_data(char *buf, char *ptr, int max_size) {
-    if (buf == NULL || ptr == NULL || max_size <= 0) {
+int strncpy_from_user(char *buf, const char *ptr, int max_size) {
+    if (buf == NULL || max_size <= 0 || ptr < (char *)USER_MEM_START) {
         return ERR_INVAL;
     }
+    /* Do not run off the top of the address space */
+    if ((unsigned int)ptr + max_size < (unsigned int)ptr) {
+        max_size = -(unsigned int)ptr;
+    }
+    int count = copy_user_string(buf, ptr, max_size);
+    if (count < 0) {
+        return count;
+    }
+    if (buf[count - 1] != '\0') {
+        return ERR_BIG;
+    }
+    return count;
+}
 
-    int count = 0;
+/** @brief copy user memory to kernel memory
+ *
+ *  @param buf kernel memory to copy into
+ *  @param ptr user ptr to copy from
+ *  @param len the number of bytes to copy
+ *
+ *  @return 0 on success, ERR_INVAL if the user memory is not all mapped
+ */
+int copy_from_user(void *buf, const void *ptr, int len) {
+    if (is_user_range(ptr, len) < 0) {
+        return ERR_INVAL;
+    }
+    return copy_user(buf, ptr, len);
+}
 
-    while (count < max_size) {
-        if (is_pointer_valid(&ptr[count], 1) < 0) {
-            return ERR_INVAL;
-        }
-        buf[count] = ptr[count];
-        if (buf[count] == '\0') {
-            break;
-        }
-        count++;
+/** @brief copy kernel memory to user memory
+ *
+ *  @param ptr user ptr to copy into
+ *  @param buf kernel memory to copy from
+ *  @param len the number of bytes to copy
+ *
+ *  @return 0 on success, ERR_INVAL if the user memory is not all mapped
+ *          and writable
+ */
+int copy_to_user(void *ptr, const void *buf, int len) {
+    if (is_user_range(ptr, len) < 0) {
+        return ERR_INVAL;
     }
-    if (count == max_size) {
-        return ERR_BIG;
+    return copy_user(ptr, buf, len);
+}
+
+/** @brief check that a range lies entirely in user space
+ *
+ *  Nothing is checked about the range being mapped.
+ *
+ *  @param ptr start of the range
+ *  @param len length of the range
+ *  @return 0 if it does, ERR_INVAL if not
+ */
+int is_user_range(const void *ptr, int len) {
+    if (ptr < (void *)USER_MEM_START || len < 0 ||
+        (unsigned int)ptr + len < (unsigned int)ptr) {
+        return ERR_INVAL;
     }
-    return count + 1;
+    return 0;
 }
@@ -13,6 +13,7 @@
 #include <common/errors.h>
 #include <simics.h>
 #include <drivers/timer/timer.h>
+#include <drivers/timer/tsc.h>
 #include <syscall.h>
 #include <syscalls/syscall_util.h>
 #include <ureg.h>
@@ -45,7 +46,7 @@ int yield_handler_c(int tid) {
             return ERR_FAILURE;
         }
     }
-    context_switch();
+    context_yield();
     return 0;
 }
 
@@ -57,6 +58,19 @@ int sleep_handler_c(int ticks) {
     return do_sleep(ticks);
 }
 
+/** @brief sleep for a number of nanoseconds
+ *
+ *  @param arg_packet the number of nanoseconds, 64 bits wide
+ *  @return int 0 on success -ve integer if the packet is invalid
+ */
+int sleep_ns_handler_c(void *arg_packet) {
+    unsigned long long ns;
+    if (copy_from_user(&ns, arg_packet, sizeof(ns)) < 0) {
+        return ERR_INVAL;
+    }
+    return do_sleep_ns(ns);
+}
+
 /** @brief deschedule a thread
  *
  *  @return int 0 immediately if integer pointed by reject is non zero
@@ -103,6 +117,51 @@ int make_runnable_handler_c(int tid) {
     return 0;
 }
 
+/** @brief get the time since boot in nanoseconds
+ *
+ *  The assembly wrapper hands the 64 bit result back in %edx:%eax.
+ *
+ *  @return unsigned long long nanoseconds since boot
+ */
+unsigned long long get_time_ns_handler_c() {
+    return tsc_time_ns();
+}
+
+/** @brief set the priority of a thread
+ *
+ *  Only threads of the calling task can be changed, so a task cannot
+ *  starve or promote the threads of another.
+ *
+ *  @param arg_packet the thread id and the priority, 0 being the highest
+ *  @return int 0 on success, -ve integer if the thread does not exist, 
+ *              belongs to another task or the priority is out of range
+ */
+int set_priority_handler_c(void *arg_packet) {
+    int args[2];
+    if (copy_from_user(args, arg_packet, sizeof(args)) < 0) {
+        return ERR_INVAL;
+    }
+    int tid = args[0];
+    int priority = args[1];
+    if (tid < 0 || priority < 0 || priority >= NUM_PRIORITY_LEVELS) {
+        return ERR_INVAL;
+    }
+    thread_struct_t *thr = get_thread_from_id(tid);
+    if (thr == NULL || thr->parent_task != get_curr_task()) {
+        return ERR_INVAL;
+    }
+    set_thread_priority(thr, priority);
+
+    /* Let a thread which now outranks us run. A thread changing its own
+     * priority goes behind the threads of its new level */
+    if (thr == get_curr_thread()) {
+        context_yield();
+    } else if (priority < get_curr_thread()->priority) {
+        context_switch();
+    }
+    return 0;
+}
+
 /** @brief get the number of ticks since system boot
  *
  *  @return unsigned int number of ticks since system boot
@@ -52,6 +52,14 @@ void udriv_init() {
     init_udriv_map();
 }
 
+/** @brief Check if a driver thread is waiting to run
+ *
+ *  @return int 1 if there is a driver thread waiting, 0 if not
+ */
+int udriv_thread_pending() {
+	return get_first(&udriv_threads) != NULL;
+}
+
 /** @brief Returns next driver thread to be run, if any
  *
  *  If any driver thread is waiting to run, the scheduler will
@@ -0,0 +1,138 @@
+/** @file page_cache.c
+ *  @brief cache of read-only program pages shared between tasks
+ *
+ *  Text and rodata pages of a program are the same in every task running
+ *  it. The first task to touch such a page fills a frame from the ramdisk
+ *  and adds it here. Later tasks map the cached frame instead of filling
+ *  their own. The cache holds one reference on each of its frames (through
+ *  the VM frame reference counts) so they are never freed.
+ *
+ *  Pages of files mapped with map_file are cached the same way, keyed by
+ *  their offset in the file instead of a program address. The ramdisk
+ *  lives in the kernel image below USER_MEM_START, so file offsets never
+ *  clash with program addresses, which are all above it.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <vm/page_cache.h>
+#include <common/malloc_wrappers.h>
+#include <common/errors.h>
+#include <allocator/frame_allocator.h>
+#include <list/list.h>
+#include <sync/mutex.h>
+#include <exec2obj.h>
+#include <page.h>
+#include <stddef.h>
+
+#define HASHMAP_SIZE PAGE_SIZE
+
+#define PAGE_CACHE_INDEX(toc_index, page_addr) \
+    (((toc_index) * MAX_NUM_APP_ENTRIES + \
+     ((unsigned int)(page_addr) >> PAGE_SHIFT)) % HASHMAP_SIZE)
+
+/** @brief a cached program page */
+typedef struct page_cache_entry {
+    int toc_index;          /* program the page belongs to */
+    void *page_addr;        /* virtual address of the page in the program */
+    void *frame;            /* frame holding the page contents */
+    list_head map_link;     /* link in the hash bucket */
+} page_cache_entry_t;
+
+static mutex_t map_mutex;
+static list_head page_cache_map[HASHMAP_SIZE];
+
+static page_cache_entry_t *find_entry(int toc_index, void *page_addr);
+
+/** @brief Initialize the buckets of the page cache
+ *
+ *  @return void
+ */
+void page_cache_init() {
+    int i;
+    for (i = 0; i < HASHMAP_SIZE; i++) {
+        init_head(&page_cache_map[i]);
+    }
+    mutex_init(&map_mutex);
+}
+
+/** @brief look up a cached program page
+ *
+ *  The frame returned stays valid for as long as the caller wants since
+ *  the cache never lets go of its reference.
+ *
+ *  @param toc_index index of the program in exec2obj_userapp_TOC
+ *  @param page_addr the page aligned virtual address in the program, or
+ *         the page aligned offset in a mapped file
+ *  @return void* the frame holding the page, NULL if not cached
+ */
+void *page_cache_lookup(int toc_index, void *page_addr) {
+    void *frame = NULL;
+    mutex_lock(&map_mutex);
+    page_cache_entry_t *entry = find_entry(toc_index, page_addr);
+    if (entry != NULL) {
+        frame = entry->frame;
+    }
+    mutex_unlock(&map_mutex);
+    return frame;
+}
+
+/** @brief add a program page to the cache
+ *
+ *  The caller hands one reference on the frame over to the cache when 
+ *  this function succeeds.
+ *
+ *  @param toc_index index of the program in exec2obj_userapp_TOC
+ *  @param page_addr the page aligned virtual address in the program, or
+ *         the page aligned offset in a mapped file
+ *  @param frame the frame holding the filled in page
+ *  @return int 0 on success, ERR_BUSY if another task cached the page 
+ *          first, ERR_NOMEM if there is no memory for the entry
+ */
+int page_cache_insert(int toc_index, void *page_addr, void *frame) {
+    page_cache_entry_t *entry = 
+                (page_cache_entry_t *)smalloc(sizeof(page_cache_entry_t));
+    if (entry == NULL) {
+        return ERR_NOMEM;
+    }
+    entry->toc_index = toc_index;
+    entry->page_addr = page_addr;
+    entry->frame = frame;
+
+    mutex_lock(&map_mutex);
+    if (find_entry(toc_index, page_addr) != NULL) {
+        mutex_unlock(&map_mutex);
+        sfree(entry, sizeof(page_cache_entry_t));
+        return ERR_BUSY;
+    }
+    add_to_tail(&entry->map_link, 
+                &page_cache_map[PAGE_CACHE_INDEX(toc_index, page_addr)]);
+    frame_set_cached(frame);
+    mutex_unlock(&map_mutex);
+    return 0;
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief find the cache entry for a program page
+ *
+ *  @pre map_mutex is held
+ *  @param toc_index index of the program in exec2obj_userapp_TOC
+ *  @param page_addr the page aligned virtual address in the program, or
+ *         the page aligned offset in a mapped file
+ *  @return page_cache_entry_t* the entry, NULL if not cached
+ */
+page_cache_entry_t *find_entry(int toc_index, void *page_addr) {
+    list_head *bucket_head = 
+                &page_cache_map[PAGE_CACHE_INDEX(toc_index, page_addr)];
+    list_head *node = get_first(bucket_head);
+	while(node != NULL && node != bucket_head) {
+        page_cache_entry_t *entry = get_entry(node, page_cache_entry_t, 
+                                              map_link);
+        if (entry->toc_index == toc_index && entry->page_addr == page_addr) {
+            return entry;
+        }
+		node = node->next;
+	}
+    return NULL;
+}
@@ -0,0 +1,186 @@
+/** @file shm.c
+ *  @brief shared memory segments
+ *
+ *  A segment is a set of frames named by a key. Every task mapping the
+ *  segment maps the very same frames, so data written by one is seen by
+ *  all others without being copied. The frames are allocated and zeroed
+ *  when the segment is created. The segment holds a reference to each of
+ *  them and so does every page table entry mapping them, which keeps
+ *  them out of the way of copy-on-write and swapping.
+ *
+ *  A segment goes away with the last area mapping it. Its key may then
+ *  be used for a new segment.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <vm/shm.h>
+#include <vm/vm.h>
+#include <allocator/frame_allocator.h>
+#include <common/malloc_wrappers.h>
+#include <common/errors.h>
+#include <common/assert.h>
+#include <sync/mutex.h>
+#include <list/list.h>
+#include <stddef.h>
+#include <x86/asm.h>
+#include <x86/eflags.h>
+
+static list_head shm_list;  /* Segments which have not gone away */
+static mutex_t shm_mutex;   /* Serializes the list and reference counts */
+
+static shm_segment_t *find_segment(int key);
+static void free_segment(shm_segment_t *seg);
+
+/** @brief Initialize the list of segments
+ *
+ *  @return void
+ */
+void shm_init() {
+    init_head(&shm_list);
+    kernel_assert(mutex_init(&shm_mutex) == 0);
+}
+
+/** @brief create a segment of zeroed frames
+ *
+ *  @param key the key of the segment
+ *  @param num_pages the size of the segment in pages
+ *  @param seg set to the segment, with one reference for the caller
+ *  @return int 0 on success, ERR_BUSY if a segment with the key exists,
+ *          ERR_NOMEM if out of memory
+ */
+int shm_alloc(int key, int num_pages, shm_segment_t **seg) {
+    mutex_lock(&shm_mutex);
+    int exists = (find_segment(key) != NULL);
+    mutex_unlock(&shm_mutex);
+    if (exists) {
+        return ERR_BUSY;
+    }
+    shm_segment_t *new_seg = smalloc(sizeof(shm_segment_t));
+    if (new_seg == NULL) {
+        return ERR_NOMEM;
+    }
+    new_seg->frames = smalloc(num_pages * sizeof(void *));
+    if (new_seg->frames == NULL) {
+        sfree(new_seg, sizeof(shm_segment_t));
+        return ERR_NOMEM;
+    }
+    if (reserve_frames(num_pages) < 0) {
+        sfree(new_seg->frames, num_pages * sizeof(void *));
+        sfree(new_seg, sizeof(shm_segment_t));
+        return ERR_NOMEM;
+    }
+    int i;
+    for (i = 0; i < num_pages; i++) {
+        int zeroed;
+        void *frame = allocate_reserved_frame(1, &zeroed);
+        if (!zeroed) {
+            int int_flag = get_eflags() & EFL_IF;
+            disable_interrupts();
+            zero_frame(frame);
+            if (int_flag) {
+                enable_interrupts();
+            }
+        }
+        frame_add_ref(frame, 1);
+        new_seg->frames[i] = frame;
+    }
+    new_seg->key = key;
+    new_seg->num_pages = num_pages;
+    new_seg->ref_count = 1;
+
+    mutex_lock(&shm_mutex);
+    if (find_segment(key) != NULL) {
+        /* Created by someone else meanwhile */
+        mutex_unlock(&shm_mutex);
+        free_segment(new_seg);
+        return ERR_BUSY;
+    }
+    add_to_tail(&new_seg->link, &shm_list);
+    mutex_unlock(&shm_mutex);
+    *seg = new_seg;
+    return 0;
+}
+
+/** @brief find a segment by its key
+ *
+ *  @param key the key of the segment
+ *  @return shm_segment_t* the segment, with one more reference for the
+ *          caller. NULL if there is none
+ */
+shm_segment_t *shm_lookup(int key) {
+    mutex_lock(&shm_mutex);
+    shm_segment_t *seg = find_segment(key);
+    if (seg != NULL) {
+        seg->ref_count++;
+    }
+    mutex_unlock(&shm_mutex);
+    return seg;
+}
+
+/** @brief add a reference to a segment
+ *
+ *  @param seg the segment
+ *  @return void
+ */
+void shm_dup(shm_segment_t *seg) {
+    mutex_lock(&shm_mutex);
+    kernel_assert(seg->ref_count > 0);
+    seg->ref_count++;
+    mutex_unlock(&shm_mutex);
+}
+
+/** @brief drop a reference to a segment, freeing it with the last
+ *
+ *  Frames still mapped somewhere are freed when their last mapping goes.
+ *
+ *  @param seg the segment
+ *  @return void
+ */
+void shm_put(shm_segment_t *seg) {
+    mutex_lock(&shm_mutex);
+    kernel_assert(seg->ref_count > 0);
+    if (--seg->ref_count > 0) {
+        mutex_unlock(&shm_mutex);
+        return;
+    }
+    del_entry(&seg->link);
+    mutex_unlock(&shm_mutex);
+    free_segment(seg);
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief drop the references of a segment to its frames and free it
+ *
+ *  @param seg the segment, no longer in the list
+ *  @return void
+ */
+void free_segment(shm_segment_t *seg) {
+    int i;
+    for (i = 0; i < seg->num_pages; i++) {
+        if (frame_add_ref(seg->frames[i], -1) == 0) {
+            deallocate_frame(seg->frames[i]);
+        }
+    }
+    sfree(seg->frames, seg->num_pages * sizeof(void *));
+    sfree(seg, sizeof(shm_segment_t));
+}
+
+/** @brief find a segment by its key
+ *
+ *  @pre shm_mutex is held
+ *  @param key the key of the segment
+ *  @return shm_segment_t* the segment, NULL if there is none
+ */
+shm_segment_t *find_segment(int key) {
+    list_head *node = get_first(&shm_list);
+    while (node != NULL && node != &shm_list) {
+        shm_segment_t *seg = get_entry(node, shm_segment_t, link);
+        if (seg->key == key) {
+            return seg;
+        }
+        node = node->next;
+    }
+    return NULL;
+}
@@ -0,0 +1,215 @@
+/** @file swap.c
+ *  @brief compressed in-memory store for swapped out pages
+ *
+ *  When frames run out the VM compresses cold user pages into kernel
+ *  memory and frees their frames. Every stored page lives in a slot,
+ *  named by the page table entries of the page. A page table copied
+ *  when a shared table is split names the same slot, so slots are
+ *  reference counted.
+ *
+ *  Pages are compressed word by word: runs of a repeated word are
+ *  stored as the word and a count, everything else is copied. That is
+ *  cheap and catches the zero filled and sparse pages which make up
+ *  most cold memory. Pages which do not shrink to 3/4 of their size
+ *  are not worth keeping and are refused.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <vm/swap.h>
+#include <common/malloc_wrappers.h>
+#include <common/errors.h>
+#include <common/assert.h>
+#include <sync/mutex.h>
+#include <string.h>
+#include <stddef.h>
+#include <page.h>
+
+#define WORDS_PER_PAGE ((int)(PAGE_SIZE / sizeof(unsigned int)))
+#define MAX_COMPRESSED_WORDS (WORDS_PER_PAGE * 3 / 4)
+#define SWAP_POOL_MAX (2 * 1024 * 1024) /* Kernel memory for stored pages */
+#define MIN_RUN 3               /* Shorter runs are cheaper as literals */
+#define RUN_TOKEN 0x80000000    /* Token of a run, the count is below it */
+
+/** @brief a stored page */
+typedef struct swap_slot {
+    unsigned int *data;     /* compressed page, NULL if the slot is free */
+    int num_words;          /* size of the compressed page */
+    int ref_count;          /* page table entries naming the slot */
+} swap_slot_t;
+
+static swap_slot_t slots[SWAP_MAX_SLOTS];
+static int free_slots[SWAP_MAX_SLOTS];  /* Stack of unused slots */
+static int num_free_slots;
+static int pool_size;                   /* Bytes held by stored pages */
+static unsigned int compress_buf[MAX_COMPRESSED_WORDS];
+static mutex_t swap_pool_mutex;
+
+static int compress_page(const unsigned int *page, unsigned int *buf);
+static void decompress_page(const unsigned int *data, int num_words,
+                            unsigned int *page);
+
+/** @brief Initialize the slots of the store
+ *
+ *  @return void
+ */
+void swap_init() {
+    int i;
+    for (i = 0; i < SWAP_MAX_SLOTS; i++) {
+        free_slots[i] = SWAP_MAX_SLOTS - 1 - i;
+    }
+    num_free_slots = SWAP_MAX_SLOTS;
+    mutex_init(&swap_pool_mutex);
+}
+
+/** @brief compress a page into a new slot
+ *
+ *  @param page the contents of the page, in kernel memory
+ *  @return int the slot holding the page with one reference. ERR_BIG if
+ *          the page does not compress well, ERR_NOMEM if the store is full
+ */
+int swap_store(const void *page) {
+    mutex_lock(&swap_pool_mutex);
+    if (num_free_slots == 0) {
+        mutex_unlock(&swap_pool_mutex);
+        return ERR_NOMEM;
+    }
+    int num_words = compress_page(page, compress_buf);
+    if (num_words < 0) {
+        mutex_unlock(&swap_pool_mutex);
+        return ERR_BIG;
+    }
+    int size = num_words * sizeof(unsigned int);
+    if (pool_size + size > SWAP_POOL_MAX) {
+        mutex_unlock(&swap_pool_mutex);
+        return ERR_NOMEM;
+    }
+    unsigned int *data = smalloc(size);
+    if (data == NULL) {
+        mutex_unlock(&swap_pool_mutex);
+        return ERR_NOMEM;
+    }
+    memcpy(data, compress_buf, size);
+    int slot = free_slots[--num_free_slots];
+    slots[slot].data = data;
+    slots[slot].num_words = num_words;
+    slots[slot].ref_count = 1;
+    pool_size += size;
+    mutex_unlock(&swap_pool_mutex);
+    return slot;
+}
+
+/** @brief get the contents of a stored page
+ *
+ *  @param slot the slot of the page
+ *  @param page where to put the page, in kernel memory
+ *  @return void
+ */
+void swap_load(int slot, void *page) {
+    mutex_lock(&swap_pool_mutex);
+    kernel_assert(slots[slot].data != NULL);
+    decompress_page(slots[slot].data, slots[slot].num_words, page);
+    mutex_unlock(&swap_pool_mutex);
+}
+
+/** @brief add a reference to a stored page
+ *
+ *  @param slot the slot of the page
+ *  @return void
+ */
+void swap_dup(int slot) {
+    mutex_lock(&swap_pool_mutex);
+    kernel_assert(slots[slot].ref_count > 0);
+    slots[slot].ref_count++;
+    mutex_unlock(&swap_pool_mutex);
+}
+
+/** @brief drop a reference to a stored page, freeing it with the last
+ *
+ *  @param slot the slot of the page
+ *  @return void
+ */
+void swap_free(int slot) {
+    mutex_lock(&swap_pool_mutex);
+    kernel_assert(slots[slot].ref_count > 0);
+    if (--slots[slot].ref_count == 0) {
+        int size = slots[slot].num_words * sizeof(unsigned int);
+        sfree(slots[slot].data, size);
+        slots[slot].data = NULL;
+        pool_size -= size;
+        free_slots[num_free_slots++] = slot;
+    }
+    mutex_unlock(&swap_pool_mutex);
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief compress a page
+ *
+ *  The output is a series of tokens. A token with RUN_TOKEN set is
+ *  followed by one word repeated as many times as the rest of the token
+ *  says. Any other token is a count of words copied as they are.
+ *
+ *  @param page the page
+ *  @param buf room for MAX_COMPRESSED_WORDS words
+ *  @return int the number of words written, -1 if they would not fit
+ */
+int compress_page(const unsigned int *page, unsigned int *buf) {
+    int in = 0, out = 0;
+    while (in < WORDS_PER_PAGE) {
+        int run = 1;
+        while (in + run < WORDS_PER_PAGE && page[in + run] == page[in]) {
+            run++;
+        }
+        if (run >= MIN_RUN) {
+            if (out + 2 > MAX_COMPRESSED_WORDS) {
+                return -1;
+            }
+            buf[out++] = RUN_TOKEN | run;
+            buf[out++] = page[in];
+            in += run;
+            continue;
+        }
+        /* Copy words up to where the next run starts */
+        int start = in;
+        while (in < WORDS_PER_PAGE &&
+               !(in + MIN_RUN <= WORDS_PER_PAGE && page[in] == page[in + 1]
+                 && page[in] == page[in + 2])) {
+            in++;
+        }
+        if (out + 1 + (in - start) > MAX_COMPRESSED_WORDS) {
+            return -1;
+        }
+        buf[out++] = in - start;
+        memcpy(&buf[out], &page[start], (in - start) * sizeof(unsigned int));
+        out += in - start;
+    }
+    return out;
+}
+
+/** @brief decompress a page
+ *
+ *  @param data the output of compress_page
+ *  @param num_words the number of words of data
+ *  @param page where to put the page
+ *  @return void
+ */
+void decompress_page(const unsigned int *data, int num_words,
+                     unsigned int *page) {
+    int in = 0, out = 0;
+    while (in < num_words) {
+        unsigned int token = data[in++];
+        if (token & RUN_TOKEN) {
+            int run = token & ~RUN_TOKEN;
+            while (run-- > 0) {
+                page[out++] = data[in];
+            }
+            in++;
+        } else {
+            memcpy(&page[out], &data[in], token * sizeof(unsigned int));
+            out += token;
+            in += token;
+        }
+    }
+    kernel_assert(out == WORDS_PER_PAGE);
+}
@@ -21,39 +21,105 @@
 #include <common/errors.h>
 #include <common/assert.h>
 #include <allocator/frame_allocator.h>
+#include <vm/page_cache.h>
+#include <vm/vm_area.h>
+#include <vm/swap.h>
+#include <vm/shm.h>
+#include <x86/asm.h>
+#include <x86/eflags.h>
+#include <smp/apic.h>
+#include <smp/mptable.h>
+#include <smp/smp.h>
+#include <core/cpu.h>
 
 #define USER_PD_ENTRY_FLAGS PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE
-#define SET_NEWPAGE_START(x) (((unsigned int)(x) & 0xfffff3ff) | NEWPAGE_START)
-#define SET_NEWPAGE_END(x) (((unsigned int)(x) & 0xfffff3ff) | NEWPAGE_END)
-#define GET_NEWPAGE_FLAGS(x) (((unsigned int)(x) & 0x00000c00))
-#define IS_NEWPAGE_START(x) ((unsigned int)(x) & NEWPAGE_START)
-#define IS_NEWPAGE_PAGE(x) ((unsigned int)(x) & NEWPAGE_PAGE)
-#define IS_NEWPAGE_END(x) ((unsigned int)(x) & NEWPAGE_END)
-
-static int *frame_ref_count;
+#define PT_REF_INDEX(pt) (((unsigned int)(pt)) >> PAGE_SHIFT)
+#define LARGE_REF_INDEX(frame) (((unsigned int)(frame)) >> PAGE_DIRECTORY_SHIFT)
+#define PD_MAP_INDEX(pd) (((unsigned int)(pd)) >> PAGE_SHIFT)
+#define SWAP_RECLAIM_BATCH 16 /* Pages swapped out when frames run out */
+#define SWAP_SCAN_ROUNDS 2    /* Clears accessed bits, then evicts */
+#define STAT_ADD(pd, field, n) \
+    atomic_add(&pd_stats[PD_MAP_INDEX(pd)].field, (n))
+#define PAGE_ROUND_UP(addr) (((unsigned int)(addr) + PAGE_SIZE - 1) \
+                             & PAGE_ROUND_DOWN)
+#define FREE_FRAMES_BATCH 64 /* Frames handed back to the allocator at once */
+#define NUM_PROGRAM_SEGMENTS 5 /* text, data, rodata, bss and stack */
+#define IS_LARGE_PAGE_ALIGNED(addr) (((unsigned int)(addr) & \
+                                      (LARGE_PAGE_SIZE - 1)) == 0)
+
+static int pt_ref_count[USER_MEM_START / PAGE_SIZE]; /* sharers of a PT */
+static int large_ref_count[MAX_MEMORY_ADDR / LARGE_PAGE_SIZE + 1]; /* and of
+                                                          a 4 MB page */
+static vm_map_t *pd_maps[USER_MEM_START / PAGE_SIZE]; /* areas of a PD */
+static char pd_swappable[USER_MEM_START / PAGE_SIZE]; /* PDs the clock scans */
+static mem_stats_t pd_stats[USER_MEM_START / PAGE_SIZE]; /* usage of a PD */
+static int pd_recycled[USER_MEM_START / PAGE_SIZE]; /* frames kept by exec */
+static mutex_t swap_mutex;     /* Serializes the clock and swapping in */
+static char swap_buf[PAGE_SIZE]; /* Page being swapped, under swap_mutex */
+static int clock_pd_slot;      /* The clock hand: page directory, */
+static int clock_pd_index;     /* page table */
+static int clock_pt_index;     /* and entry it looks at next */
+static mutex_t pt_cow_mutex;   /* Serializes sharing and splitting of PTs */
+static mutex_t populate_mutex; /* Serializes claiming reserved frames */
 static void *kernel_pd;
-static void *dead_thr_kernel_stack;
+static void *dead_thr_kernel_stacks[MAX_CPUS]; /* One per processor */
+static char *frame_windows;      /* Kernel pages used to reach any frame, 
+                                  * one per processor */
+static int *frame_window_entries; /* Their entries in the direct map */
 
-static void init_frame_ref_count();
 static void zero_fill(void *addr, int size);
 static void direct_map_kernel_pages(void *pd_addr);
 static void setup_direct_map();
+static void enable_large_pages();
 static void setup_kernel_pd();
+static void setup_frame_window();
+static void *map_frame_window(void *frame);
+static void tlb_invalidate(int *pd, void *addr, int num_pages);
 static int map_text_segment(simple_elf_t *se_hdr, void *pd_addr);
 static int map_data_segment(simple_elf_t *se_hdr, void *pd_addr);
 static int map_rodata_segment(simple_elf_t *se_hdr, void *pd_addr);
 static int map_bss_segment(simple_elf_t *se_hdr, void *pd_addr);
 static int map_stack_segment(void *pd_addr);
-static int map_segment(void *start_addr, unsigned int length, 
-						int *pd_addr, int flags);
-static void *direct_map[USER_MEM_START / (PAGE_SIZE * NUM_PAGE_TABLE_ENTRIES)];
+static int reserve_segment(void *start_addr, unsigned int length, 
+						int *pd_addr, unsigned int entry);
+static int is_addr_reserved(void *addr, int lod);
+static int populate_reserved_page(void *addr, const program_image_t *image);
+static void populate_shared_page(int *pd, int pd_index, int pt_index, 
+                                 void *page_addr, const program_image_t *image);
+static unsigned int direct_map[USER_MEM_START / LARGE_PAGE_SIZE];
 
 static void *create_page_table();
 static void free_page_table(int *pt);
-static void make_pages_cow(int *pd);
+static int clear_page_table(int *pt, int recycle);
+static void free_page_entry(unsigned int entry);
+static void *release_page_entry(unsigned int entry);
+static void *split_page_table(int *pt);
+static int unshare_page_table(int *pd, int pd_index);
 static void make_pt_cow(int *pt);
-static void increment_ref_count(int *pd);
+static void increment_ref_count(int *pt);
 static void enable_page_pinning();
+static int map_large_page(int *pd, void *addr);
+static void free_large_page(unsigned int entry);
+static int unshare_large_page(int *pd, int pd_index);
+static vm_map_t *get_vm_map(void *pd);
+static void *allocate_frame_reclaim();
+static int reserve_frames_reclaim(int num_frames);
+static int swap_out_pages(int num_pages);
+static int swap_out_page(int *pd, int pd_index, int pt_index);
+static void advance_clock(int *wraps);
+static void stop_swapping(void *pd);
+static void resume_swapping(void *pd);
+static int get_program_tables(simple_elf_t *se_hdr, unsigned int *need_pt);
+static int count_recyclable_frames(int *pd);
+static void free_spare_tables(int *spare_pts);
+static int add_segment_area(void *pd_addr, unsigned int start, 
+                            unsigned int length, int prot, int type);
+static int unshare_range(int *pd_addr, vm_area_t *area);
+static int unmap_range(int *pd_addr, vm_area_t *area);
+static int *get_user_page_table(int *pd_addr, void *addr);
+static void *get_file_frame(int toc_index, int offset);
+static void dup_shm_areas(vm_map_t *map);
+static void put_shm_areas(vm_map_t *map);
 
 /** @brief initialize the virtual memory system
  *
@@ -63,12 +129,20 @@ static void enable_page_pinning();
  *  @return void
  */
 void vm_init() {
+    setup_frame_window();
     setup_direct_map();
     setup_kernel_pd();
     set_kernel_pd();
+    enable_large_pages();
     enable_paging();
-	init_frame_ref_count();
     enable_page_pinning();
+	page_cache_init();
+	kernel_assert(mutex_init(&pt_cow_mutex) == 0);
+	kernel_assert(mutex_init(&swap_mutex) == 0);
+	kernel_assert(mutex_init(&populate_mutex) == 0);
+	swap_init();
+	shm_init();
+	clock_pd_index = KERNEL_MAP_NUM_ENTRIES;
 }
 
 /** @brief Function to set the the special kernel page
@@ -79,19 +153,11 @@ void vm_init() {
 void setup_kernel_pd() {
     kernel_pd = create_page_directory();
     kernel_assert(kernel_pd != NULL);
-    dead_thr_kernel_stack = (void *)smalloc(PAGE_SIZE);
-	kernel_assert(dead_thr_kernel_stack != NULL);
-}
-
-/** @brief Initializes the array which stored the 
- * 		   reference count for physical frames
- *  @return void
- */
-void init_frame_ref_count() {
-	int size = FREE_FRAMES_COUNT*sizeof(int);
-    frame_ref_count = (int *)smalloc(size);
-	kernel_assert(frame_ref_count != NULL);
-	memset(frame_ref_count, 0, size);
+    int cpu;
+    for (cpu = 0; cpu < get_num_cpus(); cpu++) {
+        dead_thr_kernel_stacks[cpu] = (void *)smalloc(PAGE_SIZE);
+        kernel_assert(dead_thr_kernel_stacks[cpu] != NULL);
+    }
 }
 
 /** @brief Set the current page directory to kernel page
@@ -111,13 +177,30 @@ void *get_kernel_pd() {
 	return kernel_pd;
 }
 
-/** @brief Gets the address of the dead thread kernel stack
+/** @brief turn on virtual memory on an application processor
+ *
+ *  The processor uses the kernel page directory set up by vm_init on the
+ *  boot processor. It cannot tell which processor it is before paging
+ *  is on, so the caller records the page directory with set_kernel_pd()
+ *  afterwards.
+ *
+ *  @return void
+ */
+void vm_init_ap() {
+    set_cr3((uint32_t)kernel_pd);
+    enable_large_pages();
+    enable_paging();
+    enable_page_pinning();
+}
+
+/** @brief Gets the address of the dead thread kernel stack of this
+ *         processor
  *
  *  @return void* Address of the special kernel stack for dead
  *  threads
  */
 void *get_dead_thr_kernel_stack() {
-	return ((char *)dead_thr_kernel_stack + PAGE_SIZE - 1);
+	return ((char *)dead_thr_kernel_stacks[this_cpu()] + PAGE_SIZE - 1);
 }
 
 /** @brief Sets the control register %cr3 with the given
@@ -130,20 +213,35 @@ void *get_dead_thr_kernel_stack() {
  */
 void set_cur_pd(void *pd_addr) {
 	set_cr3((uint32_t)pd_addr);
+	set_cpu_pd(pd_addr);
 }
 
 /** @brief enable VM 
  *
- *  Set bit 31 of cr0
+ *  Set bit 31 of cr0. Write protection is enabled as well so that
+ *  kernel writes to read-only (copy-on-write) user pages fault too.
  *
  *  @return void
  */
 void enable_paging() {
     unsigned int cr0 = get_cr0();
-    cr0 = cr0 | CR0_PG;
+    cr0 = cr0 | CR0_PG | CR0_WP;
     set_cr0(cr0);
 }
 
+/** @brief Function to enable 4 MB pages in the page directory
+ *
+ *  Must be called before paging is enabled since the direct map
+ *  is made of 4 MB pages.
+ *
+ *  @return void
+ */
+void enable_large_pages() {
+    unsigned int cr4 = get_cr4();
+    cr4 = cr4 | CR4_PSE;
+    set_cr4(cr4);
+}
+
 /** @brief Function to enable setting of 
  *  global flag.
  * 
@@ -170,17 +268,25 @@ void *create_page_directory() {
     if(frame_addr == NULL) {
         return NULL;
     }
+    vm_map_t *map = vm_map_create();
+    if(map == NULL) {
+        sfree(frame_addr, PAGE_SIZE);
+        return NULL;
+    }
+    pd_maps[PD_MAP_INDEX(frame_addr)] = map;
     direct_map_kernel_pages(frame_addr);
 	int i;
 	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
 		frame_addr[i] = PAGE_DIR_ENTRY_DEFAULT;
 	}
+    memset(&pd_stats[PD_MAP_INDEX(frame_addr)], 0, sizeof(mem_stats_t));
+    pd_swappable[PD_MAP_INDEX(frame_addr)] = 1;
     return (void *)frame_addr;
 }
  
 /** @brief free a page directory 
  *
- *  frees the specified page directory using sfree
+ *  frees the specified page directory and its map of areas
  *  
  *  @return void
  */
@@ -188,9 +294,21 @@ void free_page_directory(void *pd_addr) {
     if (pd_addr == NULL) {
         return;
     }
+    stop_swapping(pd_addr);
+    vm_map_destroy(get_vm_map(pd_addr));
+    pd_maps[PD_MAP_INDEX(pd_addr)] = NULL;
 	sfree(pd_addr, PAGE_SIZE);
 }
 
+/** @brief get the map of areas of a page directory
+ *
+ *  @param pd the page directory
+ *  @return vm_map_t* its map
+ */
+vm_map_t *get_vm_map(void *pd) {
+    return pd_maps[PD_MAP_INDEX(pd)];
+}
+
 /** @brief create a new page table
  *
  *  This function will allocate a new kernel physical frame for 
@@ -209,31 +327,91 @@ void *create_page_table() {
 	for(i=0; i<NUM_PAGE_TABLE_ENTRIES; i++) {
 		frame_addr[i] = PAGE_TABLE_ENTRY_DEFAULT;
 	}
+	pt_ref_count[PT_REF_INDEX(frame_addr)] = 1;
     return (void *)frame_addr;
 }
 
-/** @brief Creates a clone of the page table
+/** @brief Creates a private copy of a shared page table
  * 
- * 	@param pt Address of the page table to be cloned
+ *  Every frame mapped by the page table gains a reference from the copy
+ *  and the writable ones are made copy-on-write in both tables. The copy
+ *  needs its own frame for every page not yet populated, so those are 
+ *  reserved here.
+ *
+ *  @pre pt_cow_mutex is held
+ * 	@param pt Address of the page table to be split
  *  
- *  @return Address of the new page table
+ *  @return Address of the new page table, NULL on failure
  */
-void *clone_page_table(void *pt) {
-	if(pt == NULL) {
+void *split_page_table(int *pt) {
+	int i, reserved_count = 0;
+	for(i=0; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(IS_RESERVED_ENTRY(pt[i])) {
+			reserved_count++;
+		}
+	}
+	if(reserve_frames_reclaim(reserved_count) < 0) {
 		return NULL;
 	}
-	void *new_pt = create_page_table();
+	int *new_pt = create_page_table();
 	if(new_pt == NULL) {
+		unreserve_frames(reserved_count);
 		return NULL;
 	}
+	make_pt_cow(pt);
 	memcpy(new_pt, pt, PAGE_SIZE);
 	increment_ref_count(new_pt);
 	return new_pt;
 }
 
+/** @brief Give a page directory a private copy of a page table
+ *
+ *  The page table is shared copy-on-write after a fork and its directory
+ *  entry is read only. If this page directory is the last one using the 
+ *  table it simply takes it over. Otherwise the table is split. A shared
+ *  4 MB page is handled by unshare_large_page().
+ *
+ *  @param pd the page directory
+ *  @param pd_index the index of the directory entry to unshare
+ *
+ *  @return 0 on success, ERR_NOMEM if the table could not be split
+ */
+int unshare_page_table(int *pd, int pd_index) {
+	mutex_lock(&pt_cow_mutex);
+	if(!(pd[pd_index] & PT_COW_MODE)) {
+		/* Another thread of the task got here first */
+		mutex_unlock(&pt_cow_mutex);
+		return 0;
+	}
+	if(pd[pd_index] & LARGE_PAGE_ENTRY) {
+		int retval = unshare_large_page(pd, pd_index);
+		mutex_unlock(&pt_cow_mutex);
+		if(retval == 0) {
+			tlb_invalidate(pd, GET_PD_BASE(pd_index), 1);
+		}
+		return retval;
+	}
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	if(pt_ref_count[PT_REF_INDEX(pt)] > 1) {
+		int *new_pt = split_page_table(pt);
+		if(new_pt == NULL) {
+			mutex_unlock(&pt_cow_mutex);
+			return ERR_NOMEM;
+		}
+		pt_ref_count[PT_REF_INDEX(pt)]--;
+		pt = new_pt;
+	}
+	pd[pd_index] = (unsigned int)pt | USER_PD_ENTRY_FLAGS;
+	mutex_unlock(&pt_cow_mutex);
+
+	tlb_invalidate(pd, GET_PD_BASE(pd_index), NUM_PAGE_TABLE_ENTRIES);
+	return 0;
+}
+
 /** @brief free a page table
  *
- *  frees the specified page table using sfree
+ *  frees the specified page table using sfree. If other page directories
+ *  still share the table only our reference to it is dropped.
  *  
  *  @return void
  */
@@ -241,29 +419,108 @@ void free_page_table(int *pt) {
     if (pt == NULL) {
         return;
     }
-	int i;
+	mutex_lock(&pt_cow_mutex);
+	if(--pt_ref_count[PT_REF_INDEX(pt)] > 0) {
+		mutex_unlock(&pt_cow_mutex);
+		return;
+	}
+	mutex_unlock(&pt_cow_mutex);
+	unreserve_frames(clear_page_table(pt, 0));
+	sfree(pt, PAGE_SIZE);
+}
+
+/** @brief release whatever the entries of a private page table hold
+ *
+ *  Frames losing their last reference are freed in batches and swap 
+ *  slots are given back. The frame reservations of demand-zero and 
+ *  demand-load entries are handed to the caller. When recycling, the
+ *  entries are cleared and the frames freed stay reserved and are handed 
+ *  to the caller as well.
+ *
+ *  @param pt the page table
+ *  @param recycle 1 to clear the table and keep its frames reserved
+ *  @return int the number of frame reservations handed to the caller
+ */
+int clear_page_table(int *pt, int recycle) {
+	void *frames[FREE_FRAMES_BATCH];
+	int i, num_frames = 0, num_reserved = 0;
 	for(i=0; i<NUM_PAGE_TABLE_ENTRIES; i++) {
-		if(pt[i] == PAGE_TABLE_ENTRY_DEFAULT) {
-			continue;
+		if(IS_RESERVED_ENTRY(pt[i])) {
+			num_reserved++;
+		} else if(IS_SWAP_ENTRY(pt[i])) {
+			swap_free(GET_SWAP_SLOT(pt[i]));
+		} else if((frames[num_frames] = release_page_entry(pt[i])) != NULL &&
+				  ++num_frames == FREE_FRAMES_BATCH) {
+			if(recycle) {
+				deallocate_frames_reserved(frames, num_frames);
+				num_reserved += num_frames;
+			} else {
+				deallocate_frames(frames, num_frames);
+			}
+			num_frames = 0;
 		}
-		void *frame_addr = (void *)GET_ADDR_FROM_ENTRY(pt[i]);
-        /* If the frame belongs to kernel space (maybe through udriv_mmap) dont free */
-        if ((unsigned int)frame_addr < USER_MEM_START) {
-            continue;
-        }
-		lock_frame(frame_addr);
-		frame_ref_count[FRAME_INDEX(frame_addr)]--;
-		kernel_assert(frame_ref_count[FRAME_INDEX(frame_addr)] >= 0);
-		if(frame_ref_count[FRAME_INDEX(frame_addr)] == 0) {
-			deallocate_frame(frame_addr);
+		if(recycle) {
+			pt[i] = PAGE_TABLE_ENTRY_DEFAULT;
 		}
-		unlock_frame(frame_addr);
 	}
-	sfree(pt, PAGE_SIZE);
+	if(recycle) {
+		deallocate_frames_reserved(frames, num_frames);
+		num_reserved += num_frames;
+	} else {
+		deallocate_frames(frames, num_frames);
+	}
+	return num_reserved;
 }
 
-/** @brief Creates a copy of the given page directory and
- * 	the corresponding valid page tables.
+/** @brief release whatever a page table entry holds
+ *
+ *  Drops a reference to the frame of a present entry, freeing the
+ *  frame when the last reference goes away. A demand-zero or demand-load
+ *  entry gives back its frame reservation and a swapped out entry its 
+ *  swap slot.
+ *
+ *  @param entry the page table entry being discarded
+ *  @return void
+ */
+void free_page_entry(unsigned int entry) {
+	if(IS_RESERVED_ENTRY(entry)) {
+		unreserve_frames(1);
+		return;
+	}
+	if(IS_SWAP_ENTRY(entry)) {
+		swap_free(GET_SWAP_SLOT(entry));
+		return;
+	}
+	void *frame_addr = release_page_entry(entry);
+	if(frame_addr != NULL) {
+		deallocate_frame(frame_addr);
+	}
+}
+
+/** @brief drop the reference a present page table entry holds
+ *
+ *  @param entry the page table entry being discarded
+ *  @return void* the frame if that was its last reference and it has to 
+ *          be freed by the caller, NULL otherwise
+ */
+void *release_page_entry(unsigned int entry) {
+	if(!(entry & PAGE_ENTRY_PRESENT)) {
+		return NULL;
+	}
+	void *frame_addr = (void *)GET_ADDR_FROM_ENTRY(entry);
+	/* If the frame belongs to kernel space (maybe through udriv_mmap) dont free */
+	if ((unsigned int)frame_addr < USER_MEM_START) {
+		return NULL;
+	}
+	return (frame_add_ref(frame_addr, -1) == 0) ? frame_addr : NULL;
+}
+
+/** @brief Creates a copy of the given page directory
+ *
+ *  The page tables themselves are not copied. Both page directories point
+ *  to the same tables through read-only entries and a table is only split
+ *  when one side writes to or maps pages in its 4 MB region. 4 MB pages
+ *  are shared the same way.
  *
  *  @param pd Address of the page directory
  *
@@ -273,23 +530,41 @@ void *clone_paging_info(int *pd) {
 	if(pd == NULL) {
 		return NULL;
 	}
+	int i, first = 0, last = 0;
 	int *new_pd = create_page_directory();
 	if(new_pd == NULL) {
 		return NULL;
 	}
-	int i;
+	if(vm_map_copy(get_vm_map(new_pd), get_vm_map(pd)) < 0) {
+		free_page_directory(new_pd);
+		return NULL;
+	}
+	dup_shm_areas(get_vm_map(new_pd));
+	/* The child maps everything we do, through the same page tables */
+	pd_stats[PD_MAP_INDEX(new_pd)] = pd_stats[PD_MAP_INDEX(pd)];
+	mutex_lock(&pt_cow_mutex);
 	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
         if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
-			void *new_pt = clone_page_table((void *)GET_ADDR_FROM_ENTRY(pd[i]));
-			if(new_pt == NULL) {
-				free_paging_info(new_pd);
-				return NULL;
+			pd[i] = (pd[i] | PT_COW_MODE) & WRITE_DISABLE_MASK;
+			new_pd[i] = pd[i];
+			if(pd[i] & LARGE_PAGE_ENTRY) {
+				large_ref_count[LARGE_REF_INDEX(GET_ADDR_FROM_ENTRY(pd[i]))]++;
+			} else {
+				pt_ref_count[PT_REF_INDEX(GET_ADDR_FROM_ENTRY(pd[i]))]++;
+			}
+			if(first == 0) {
+				first = i;
 			}
-			new_pd[i] = (unsigned int)new_pt | GET_FLAGS_FROM_ENTRY(pd[i]);
+			last = i;
 		}
     }
-	make_pages_cow(pd);
-	make_pages_cow(new_pd);
+	mutex_unlock(&pt_cow_mutex);
+
+	/* Our own mappings just became read only */
+	if(first != 0) {
+		tlb_invalidate(pd, GET_PD_BASE(first), 
+					   (last - first + 1) * NUM_PAGE_TABLE_ENTRIES);
+	}
 	return new_pd;
 }
       
@@ -303,17 +578,239 @@ void free_paging_info(int *pd) {
 	if(pd == NULL) {
 		return;
 	}
+	stop_swapping(pd);
+	put_shm_areas(get_vm_map(pd));
+	/* An exec which failed to load its program may have left some */
+	unreserve_frames(pd_recycled[PD_MAP_INDEX(pd)]);
+	pd_recycled[PD_MAP_INDEX(pd)] = 0;
 	int i;
 	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
-        if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
+        if(pd[i] & LARGE_PAGE_ENTRY) {
+			free_large_page(pd[i]);
+		} else if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
 			free_page_table((void *)GET_ADDR_FROM_ENTRY(pd[i]));	
 		}
     }
 	free_page_directory(pd);
 }
 
+/** @brief clear the user mappings of a page directory for a new program
+ *
+ *  Exec loads the new program into the same page directory rather than
+ *  building a fresh one and freeing the old. Page tables private to the
+ *  task are cleared and kept, and as programs are laid out alike they 
+ *  are mostly reused by the new one. Frames only the task used are
+ *  freed but stay reserved, along with the reservations of pages never
+ *  touched, and reserve_segment() draws on them before reserving any 
+ *  more. Shared page tables and 4 MB pages are let go.
+ *
+ *  Whatever loading the new program needs that could fail is obtained 
+ *  before anything is cleared, so a failure leaves the old program as it
+ *  was. The frames the segments need beyond those the old program gives 
+ *  back are reserved, and every page table they fall in is made private.
+ *  Every processor loses its translations of the old program before any
+ *  of its frames is freed.
+ *
+ *  trim_paging_info() must be called once the new program is loaded.
+ *
+ *  @param pd the current page directory
+ *  @param se_hdr the header of the new program
+ *  @return int 0 on success, ERR_NOMEM if the old program was kept
+ */
+int reset_paging_info(int *pd, simple_elf_t *se_hdr) {
+	unsigned int need_pt[NUM_PAGE_TABLE_ENTRIES / 32];
+	int *spare_pts = NULL;
+	int i, num_tables = 0, recycled = 0;
+
+	/* The clock must not change what count_recyclable_frames() sees */
+	stop_swapping(pd);
+	int num_pages = get_program_tables(se_hdr, need_pt);
+	int extra = num_pages - count_recyclable_frames(pd);
+	if(extra < 0) {
+		extra = 0;
+	}
+	if(reserve_frames_reclaim(extra) < 0) {
+		resume_swapping(pd);
+		return ERR_NOMEM;
+	}
+	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(!(need_pt[i / 32] & (1U << (i % 32))) || 
+		   (pd[i] != PAGE_DIR_ENTRY_DEFAULT && 
+			!(pd[i] & (LARGE_PAGE_ENTRY | PT_COW_MODE)))) {
+			continue;
+		}
+		int *pt = create_page_table();
+		if(pt == NULL) {
+			free_spare_tables(spare_pts);
+			unreserve_frames(extra);
+			resume_swapping(pd);
+			return ERR_NOMEM;
+		}
+		if(pd[i] == PAGE_DIR_ENTRY_DEFAULT) {
+			/* An empty table changes nothing for the old program */
+			pd[i] = (unsigned int)pt | USER_PD_ENTRY_FLAGS;
+		} else {
+			/* Kept aside until the shared table or 4 MB page is let go,
+			 * chained through their first entry */
+			pt[0] = (int)spare_pts;
+			spare_pts = pt;
+		}
+	}
+
+	/* Threads of the task on other processors must not reach a frame 
+	 * once it is freed, so the old program is cut off from every
+	 * processor first. The entries are kept to be torn down below */
+	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
+			pd[i] &= ~PAGE_ENTRY_PRESENT;
+		}
+	}
+	set_cur_pd(pd);
+	tlb_shootdown(pd);
+
+	put_shm_areas(get_vm_map(pd));
+	vm_map_clear(get_vm_map(pd));
+	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(pd[i] & LARGE_PAGE_ENTRY) {
+			free_large_page(pd[i]);
+			pd[i] = PAGE_DIR_ENTRY_DEFAULT;
+		} else if(pd[i] & PT_COW_MODE) {
+			free_page_table((void *)GET_ADDR_FROM_ENTRY(pd[i]));
+			pd[i] = PAGE_DIR_ENTRY_DEFAULT;
+		} else if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
+			recycled += clear_page_table((void *)GET_ADDR_FROM_ENTRY(pd[i]), 1);
+			pd[i] |= PAGE_ENTRY_PRESENT;
+			num_tables++;
+			continue;
+		} else {
+			continue;
+		}
+		if(need_pt[i / 32] & (1U << (i % 32))) {
+			int *pt = spare_pts;
+			spare_pts = (int *)pt[0];
+			pt[0] = PAGE_TABLE_ENTRY_DEFAULT;
+			pd[i] = (unsigned int)pt | USER_PD_ENTRY_FLAGS;
+			num_tables++;
+		}
+	}
+	kernel_assert(spare_pts == NULL);
+
+	pd_recycled[PD_MAP_INDEX(pd)] = recycled + extra;
+	memset(&pd_stats[PD_MAP_INDEX(pd)], 0, sizeof(mem_stats_t));
+	pd_stats[PD_MAP_INDEX(pd)].page_table_pages = num_tables;
+	resume_swapping(pd);
+	return 0;
+}
+
+/** @brief find what the segments of a program need
+ *
+ *  The pages are counted the way reserve_segment() counts them for each
+ *  segment, so a page two segments share is counted twice.
+ *
+ *  @param se_hdr the header of the program
+ *  @param need_pt bitmap set to the page tables the segments fall in
+ *  @return int the number of frames the segments reserve
+ */
+int get_program_tables(simple_elf_t *se_hdr, unsigned int *need_pt) {
+	unsigned int start[NUM_PROGRAM_SEGMENTS] = { se_hdr->e_txtstart, 
+		se_hdr->e_datstart, se_hdr->e_rodatstart, se_hdr->e_bssstart,
+		STACK_START - DEFAULT_STACK_SIZE + 1 };
+	unsigned int length[NUM_PROGRAM_SEGMENTS] = { se_hdr->e_txtlen,
+		se_hdr->e_datlen, se_hdr->e_rodatlen, se_hdr->e_bsslen,
+		DEFAULT_STACK_SIZE };
+	int i, j, num_pages = 0;
+
+	memset(need_pt, 0, NUM_PAGE_TABLE_ENTRIES / 8);
+	for(i=0; i<NUM_PROGRAM_SEGMENTS; i++) {
+		if(length[i] == 0) {
+			continue;
+		}
+		unsigned int end = start[i] + length[i];
+		unsigned int page_start = start[i] & PAGE_ROUND_DOWN;
+		num_pages += (end - page_start + PAGE_SIZE - 1) / PAGE_SIZE;
+		for(j = GET_PD_INDEX(page_start); j <= GET_PD_INDEX(end - 1); j++) {
+			need_pt[j / 32] |= 1U << (j % 32);
+		}
+	}
+	return num_pages;
+}
+
+/** @brief count the frames reset_paging_info() would keep reserved
+ *
+ *  These are the reservations of pages never touched and the frames
+ *  nobody but the task uses, in its private page tables.
+ *
+ *  @param pd the page directory
+ *  @return int the number of frames
+ */
+int count_recyclable_frames(int *pd) {
+	int i, j, count = 0;
+	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(pd[i] == PAGE_DIR_ENTRY_DEFAULT || 
+		   (pd[i] & (LARGE_PAGE_ENTRY | PT_COW_MODE))) {
+			continue;
+		}
+		int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[i]);
+		for(j=0; j<NUM_PAGE_TABLE_ENTRIES; j++) {
+			void *frame = (void *)GET_ADDR_FROM_ENTRY(pt[j]);
+			if(IS_RESERVED_ENTRY(pt[j]) ||
+			   ((pt[j] & PAGE_ENTRY_PRESENT) && 
+				(unsigned int)frame >= USER_MEM_START &&
+				frame_get_ref(frame) == 1)) {
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+/** @brief free page tables set aside by reset_paging_info()
+ *
+ *  @param spare_pts the first of the chained page tables, may be NULL
+ *  @return void
+ */
+void free_spare_tables(int *spare_pts) {
+	while(spare_pts != NULL) {
+		int *pt = spare_pts;
+		spare_pts = (int *)pt[0];
+		pt[0] = PAGE_TABLE_ENTRY_DEFAULT;
+		free_page_table(pt);
+	}
+}
+
+/** @brief let go of what the new program did not reuse
+ *
+ *  Gives back the frame reservations left over from reset_paging_info()
+ *  and frees the page tables the new program left empty.
+ *
+ *  @param pd the current page directory
+ *  @return void
+ */
+void trim_paging_info(int *pd) {
+	int i, j;
+	unreserve_frames(pd_recycled[PD_MAP_INDEX(pd)]);
+	pd_recycled[PD_MAP_INDEX(pd)] = 0;
+	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
+		if(pd[i] == PAGE_DIR_ENTRY_DEFAULT || 
+		   (pd[i] & (LARGE_PAGE_ENTRY | PT_COW_MODE))) {
+			continue;
+		}
+		int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[i]);
+		for(j=0; j<NUM_PAGE_TABLE_ENTRIES && 
+				 pt[j] == PAGE_TABLE_ENTRY_DEFAULT; j++) {
+			continue;
+		}
+		if(j == NUM_PAGE_TABLE_ENTRIES) {
+			pd[i] = PAGE_DIR_ENTRY_DEFAULT;
+			tlb_invalidate(pd, GET_PD_BASE(i), 1);
+			free_page_table(pt);
+			STAT_ADD(pd, page_table_pages, -1);
+		}
+	}
+}
+
 /** @brief Increments the reference count for all the physical frames
- *  allocated for a given page table
+ *  allocated for a given page table, and for its swapped out pages
  *
  *  @return void
  */
@@ -323,11 +820,12 @@ void increment_ref_count(int *pt) {
 	}
 	int i;
 	for(i=0; i<NUM_PAGE_TABLE_ENTRIES; i++) {
-		if(pt[i] != PAGE_TABLE_ENTRY_DEFAULT) {
+		if((pt[i] & PAGE_ENTRY_PRESENT) && 
+			GET_ADDR_FROM_ENTRY(pt[i]) >= USER_MEM_START) {
 			void *frame_addr = (void *)GET_ADDR_FROM_ENTRY(pt[i]);
-			lock_frame(frame_addr);
-			frame_ref_count[FRAME_INDEX(frame_addr)]++;
-			unlock_frame(frame_addr);
+			frame_add_ref(frame_addr, 1);
+		} else if(IS_SWAP_ENTRY(pt[i])) {
+			swap_dup(GET_SWAP_SLOT(pt[i]));
 		}
 	}
 }
@@ -345,19 +843,32 @@ int map_phys_to_virt(void *base_phys, void *base_virt, int len) {
     int *pt_addr;
     int pd_index, pt_index;
     int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE;
+    int retval;
 
-    while (base_virt <= end_addr) {
+    if ((retval = vm_map_insert(get_vm_map(pd_addr), 
+                                (unsigned int)base_virt & PAGE_ROUND_DOWN,
+                                PAGE_ROUND_UP(end_addr), 
+                                VMA_READ | VMA_WRITE, VMA_PHYS, 
+                                NULL)) < 0) {
+        return retval;
+    }
+    while (base_virt < end_addr) {
         pd_index = GET_PD_INDEX(base_virt);
         pt_index = GET_PT_INDEX(base_virt);
         if (pd_addr[pd_index] == PAGE_DIR_ENTRY_DEFAULT) { /* Page directory entry absent */
             void *new_pt = create_page_table();
             if (new_pt != NULL) {
                 pd_addr[pd_index] = (unsigned int)new_pt | USER_PD_ENTRY_FLAGS;
+                STAT_ADD(pd_addr, page_table_pages, 1);
             }
             else {
                 return ERR_NOMEM;
             }
         }
+        if ((pd_addr[pd_index] & PT_COW_MODE) && 
+            unshare_page_table(pd_addr, pd_index) < 0) {
+            return ERR_NOMEM;
+        }
         pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
         if (pt_addr[pt_index] == PAGE_TABLE_ENTRY_DEFAULT) { /* Page table entry absent */
                 pt_addr[pt_index] = (unsigned int)base_phys | flags;
@@ -369,26 +880,114 @@ int map_phys_to_virt(void *base_phys, void *base_virt, int len) {
     return 0;
 }
 
-/*********************COPY-ON-WRITE FUNCTIONS***************************/
-
-/** @brief Function to make the pages for a task copy-on-write
- * 
- *  @param pd Page directory
+/** @brief copy data into the user memory of a task which is not running
  *
- *  @return Void
+ *  Sets up a task before its first run. Demand-zero pages in the range
+ *  get their frame here. The entries are marked accessed and dirty, as 
+ *  the MMU would have for a write by the task, so the clock does not 
+ *  swap out a page as it is being filled.
+ *
+ *  @param pd the page directory of the task
+ *  @param dst the user address to copy to
+ *  @param src the data, in kernel memory
+ *  @param len the number of bytes to copy
+ *  @return int 0 on success, ERR_INVAL if part of the range is not backed
+ *          by present or demand-zero pages
  */
-void make_pages_cow(int *pd) {
-	if(pd == NULL) {
-		return;
+int copy_to_pd(int *pd, void *dst, const void *src, int len) {
+	char *addr = dst;
+	const char *from = src;
+	while(len > 0) {
+		int pd_index = GET_PD_INDEX(addr);
+		int pt_index = GET_PT_INDEX(addr);
+		int offset = (unsigned int)addr & ~PAGE_ROUND_DOWN;
+		int chunk = (len < PAGE_SIZE - offset) ? len : PAGE_SIZE - offset;
+		if(!(pd[pd_index] & PAGE_ENTRY_PRESENT) ||
+		   (pd[pd_index] & (LARGE_PAGE_ENTRY | PT_COW_MODE))) {
+			return ERR_INVAL;
+		}
+		int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+		void *new_frame = NULL;
+		int zeroed = 0;
+		if(IS_ZFOD_ENTRY(pt[pt_index])) {
+			new_frame = allocate_reserved_frame(1, &zeroed);
+			frame_add_ref(new_frame, 1);
+		} else if(!(pt[pt_index] & PAGE_ENTRY_PRESENT)) {
+			return ERR_INVAL;
+		}
+
+		int int_flag = get_eflags() & EFL_IF;
+		disable_interrupts();
+		if(new_frame != NULL) {
+			if(!zeroed) {
+				zero_frame(new_frame);
+			}
+			pt[pt_index] = (unsigned int)new_frame | PAGE_ENTRY_PRESENT |
+						   GET_FLAGS_FROM_ENTRY(pt[pt_index]);
+		}
+		pt[pt_index] |= PAGE_ACCESSED | PAGE_DIRTY;
+		void *frame = (void *)GET_ADDR_FROM_ENTRY(pt[pt_index]);
+		memcpy((char *)map_frame_window(frame) + offset, from, chunk);
+		if(int_flag) {
+			enable_interrupts();
+		}
+		if(new_frame != NULL) {
+			STAT_ADD(pd, resident_pages, 1);
+		}
+
+		addr += chunk;
+		from += chunk;
+		len -= chunk;
 	}
-	int i;
+	return 0;
+}
+
+/** @brief get the memory usage of the current address space
+ *
+ *  Everything but the shared page count is kept up to date as pages are 
+ *  mapped, swapped and unmapped. Whether a frame is shared changes behind
+ *  the back of a task when another task exits or writes to its copy, so
+ *  shared pages are counted here by walking the page tables: a page is
+ *  shared if its page table is shared or its frame is mapped elsewhere as
+ *  well. The reference the page cache keeps on a frame does not count.
+ *
+ *  @param stats filled with the usage
+ *  @return void
+ */
+void get_mem_stats(mem_stats_t *stats) {
+	int *pd = (int *)get_cr3();
+	unsigned int mem_end = machine_phys_frames() * PAGE_SIZE;
+	int i, j, shared = 0;
+
+	*stats = pd_stats[PD_MAP_INDEX(pd)];
 	for(i=KERNEL_MAP_NUM_ENTRIES; i<NUM_PAGE_TABLE_ENTRIES; i++) {
-		if(pd[i] != PAGE_DIR_ENTRY_DEFAULT) {
-			make_pt_cow((int *)GET_ADDR_FROM_ENTRY(pd[i]));	
+		if(!(pd[i] & PAGE_ENTRY_PRESENT)) {
+			continue;
+		}
+		if(pd[i] & LARGE_PAGE_ENTRY) {
+			if(pd[i] & PT_COW_MODE) {
+				shared += FRAMES_PER_LARGE_FRAME;
+			}
+			continue;
+		}
+		int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[i]);
+		for(j=0; j<NUM_PAGE_TABLE_ENTRIES; j++) {
+			unsigned int frame = GET_ADDR_FROM_ENTRY(pt[j]);
+			if(!(pt[j] & PAGE_ENTRY_PRESENT) || frame < USER_MEM_START ||
+			   frame >= mem_end) {
+				continue;
+			}
+			if((pd[i] & PT_COW_MODE) || 
+			   frame_get_mappings((void *)frame) > 1) {
+				shared++;
+			}
 		}
 	}
+	stats->shared_pages = shared;
 }
 
+/*********************COPY-ON-WRITE FUNCTIONS***************************/
+
 /** @brief Functions to make a page table COW
  *
  *  This function iterates through each page table entry and makes
@@ -402,10 +1001,12 @@ void make_pt_cow(int *pt) {
 	}
 	int i;
 	for(i=0; i<NUM_PAGE_TABLE_ENTRIES; i++) {
-		if(pt[i] == PAGE_TABLE_ENTRY_DEFAULT) {
+		if(!(pt[i] & PAGE_ENTRY_PRESENT)) {
 			continue;
 		}
-		if(GET_FLAGS_FROM_ENTRY(pt[i]) & READ_WRITE_ENABLE) {
+		/* Shared memory stays shared */
+		if((GET_FLAGS_FROM_ENTRY(pt[i]) & READ_WRITE_ENABLE) &&
+		   !(pt[i] & SHARED_MEM_PAGE)) {
 			pt[i] = (pt[i] | COW_MODE) & WRITE_DISABLE_MASK;
 		}
 	}
@@ -424,8 +1025,12 @@ int is_addr_cow(void *addr) {
 	int *pd = (void *)get_cr3();
 	int pd_index = GET_PD_INDEX(addr);
 	int pt_index = GET_PT_INDEX(addr);
+	if(!(pd[pd_index] & PAGE_ENTRY_PRESENT) || 
+		(pd[pd_index] & LARGE_PAGE_ENTRY)) {
+		return 0;
+	}
 	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
-	if((pt[pt_index] | COW_MODE) && !(pt[pt_index] & READ_WRITE_ENABLE)
+	if((pt[pt_index] & COW_MODE) && !(pt[pt_index] & READ_WRITE_ENABLE)
 		&& (pt[pt_index]&PAGE_ENTRY_PRESENT)) {
 		return 1;
 	}
@@ -444,76 +1049,434 @@ int handle_cow(void *addr) {
     int pd_index = GET_PD_INDEX(addr);
     int pt_index = GET_PT_INDEX(addr);
     int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
-	void *frame_addr = (void *)GET_ADDR_FROM_ENTRY(pt[pt_index]);
+	unsigned int entry = pt[pt_index];
+	void *frame_addr = (void *)GET_ADDR_FROM_ENTRY(entry);
     void *page_addr = (void *)((int)addr & PAGE_ROUND_DOWN);
-	lock_frame(frame_addr);
-	if(frame_ref_count[FRAME_INDEX(frame_addr)] == 1) {
-		pt[pt_index] &= COW_MODE_DISABLE_MASK;
+	if((pd[pd_index] & PT_COW_MODE) || !(entry & PAGE_ENTRY_PRESENT)) {
+		/* The page table was shared by a fork or the page swapped out
+		 * meanwhile, retry */
+		return 0;
+	}
+	if(frame_get_ref(frame_addr) == 1) {
+		/* Every other sharer is gone, the frame is ours */
+		int int_flag = get_eflags() & EFL_IF;
+		disable_interrupts();
+		if(pt[pt_index] == entry) {
+			pt[pt_index] = (entry & COW_MODE_DISABLE_MASK) | READ_WRITE_ENABLE;
+		}
+		if(int_flag) {
+			enable_interrupts();
+		}
 	} else {
-        /* Copy the data from the old frame to a kernel frame */
-		char frame_contents[PAGE_SIZE];
-		memcpy(frame_contents, page_addr, PAGE_SIZE);
-
-		void *new_frame = allocate_frame();
+		void *new_frame = allocate_frame_reclaim();
 		if(new_frame == NULL) {
-			unlock_frame(frame_addr);
 			return ERR_FAILURE;
 		}
+		frame_add_ref(new_frame, 1);
+
+		/* Copy from the old frame, still mapped read only at page_addr, 
+		 * straight into the new frame through the frame window */
+		int int_flag = get_eflags() & EFL_IF;
+		disable_interrupts();
+		if((pd[pd_index] & PT_COW_MODE) || 
+		   GET_ADDR_FROM_ENTRY(pt[pt_index]) != (unsigned int)frame_addr ||
+		   !(pt[pt_index] & COW_MODE)) {
+			/* Another thread of the task broke the sharing first */
+			if(int_flag) {
+				enable_interrupts();
+			}
+			frame_add_ref(new_frame, -1);
+			deallocate_frame(new_frame);
+			return 0;
+		}
+		memcpy(map_frame_window(new_frame), page_addr, PAGE_SIZE);
+		int flags = GET_FLAGS_FROM_ENTRY(pt[pt_index]) | READ_WRITE_ENABLE;
+		pt[pt_index] = ((unsigned int)new_frame | flags) & COW_MODE_DISABLE_MASK;
+		if(int_flag) {
+			enable_interrupts();
+		}
 
-		int flags = GET_FLAGS_FROM_ENTRY(pt[pt_index]);
-		pt[pt_index] = (unsigned int)new_frame | flags;
-		pt[pt_index] &= COW_MODE_DISABLE_MASK;
-        set_cur_pd(pd);
+		/* Adjust reference counts. The other sharers may have gone away
+		 * while we were copying */
+		if(frame_add_ref(frame_addr, -1) == 0) {
+			deallocate_frame(frame_addr);
+		}
+	}
 
-        /* Copy data from kernel frame into the new allocated frame and free 
-         * the kernel scratch space */
-        memcpy(page_addr, frame_contents, PAGE_SIZE);
+	tlb_invalidate(pd, page_addr, 1);
 
-		/* Adjust reference counts */
-		frame_ref_count[FRAME_INDEX(frame_addr)]--;
+	return 0;
+}
 
-		lock_frame(new_frame);
-		frame_ref_count[FRAME_INDEX(new_frame)]++;
-		unlock_frame(new_frame);
+/** @brief Function to check if a particular address lies in a page 
+ *  table shared copy-on-write
+ *
+ *  @param addr Virtual address to be checked.
+ *
+ *  @return 1 if the page table is shared, 0 if not
+ */
+int is_addr_pt_cow(void *addr) {
+	if((unsigned int)addr < USER_MEM_START) {
+		return 0;
 	}
-	unlock_frame(frame_addr);
-	pt[pt_index] |= READ_WRITE_ENABLE;
-
-	/* INVLPG is not working for some reason :( */
-	set_cur_pd(pd);
+	int *pd = (void *)get_cr3();
+	int pd_index = GET_PD_INDEX(addr);
+	return ((pd[pd_index] & PAGE_ENTRY_PRESENT) && 
+			(pd[pd_index] & PT_COW_MODE));
+}
 
-	return 0;
+/** @brief Function to handle a fault in a shared page table
+ *
+ *  @param addr the faulting virtual address
+ *
+ *  @return int 0 on success. Negative number on failure
+ */
+int handle_pt_cow(void *addr) {
+	return unshare_page_table((int *)get_cr3(), GET_PD_INDEX(addr));
 }
 
 /******************COPY-ON-WRITE FUNCTIONS END*************************/
 
-/** @brief setup paging for a program
+/** @brief Function to check if a particular address is demand-zero
  *
- *  this function reads a simple_elf_t and creates mappings in the 
- *  page directory/page table for the regions found in the elf header.
- *  This function DOES NOT copy the data from the binary to these
- *  regions. That is the responsisbility of the loader. 
+ *  @param addr Virtual address to be checked.
  *
- *  @param se_hdr pointer to a simple_elf_t containing info about the 
- *                program to be loaded
- *  @param pd_addr the address of the page directory obtained through
- *                 a previous call to create_page_directory
+ *  @return 1 if the page has a frame reserved but not yet allocated, 
+ *          0 if not
+ */
+int is_addr_zfod(void *addr) {
+	return is_addr_reserved(addr, 0);
+}
+
+/** @brief Function to check if a particular address is demand-loaded
  *
- *  @return 0 on success. Negative number on failure
+ *  @param addr Virtual address to be checked.
+ *
+ *  @return 1 if the page has to be filled from the program image, 
+ *          0 if not
  */
-int setup_page_table(simple_elf_t *se_hdr, void *pd_addr) {
-    if(se_hdr == NULL || pd_addr == NULL) {
-        return ERR_FAILURE;
-    }
-    int retval;
-    if((retval = map_text_segment(se_hdr, pd_addr)) < 0) {
-        return retval;
-    }
-    if((retval = map_data_segment(se_hdr, pd_addr)) < 0) {
-        return retval;
-    }
-    if((retval = map_rodata_segment(se_hdr, pd_addr)) < 0) {
-        return retval;
+int is_addr_lod(void *addr) {
+	return is_addr_reserved(addr, 1);
+}
+
+/** @brief Function to populate a demand-zero page
+ *
+ *  @param addr the faulting virtual address
+ *
+ *  @return int 0 on success. Negative number on failure
+ */
+int handle_zfod(void *addr) {
+	return populate_reserved_page(addr, NULL);
+}
+
+/** @brief Function to populate a demand-loaded page
+ *
+ *  @param addr the faulting virtual address
+ *  @param image the program image of the current task
+ *
+ *  @return int 0 on success. Negative number on failure
+ */
+int handle_lod(void *addr, const program_image_t *image) {
+	if(image == NULL) {
+		return ERR_INVAL;
+	}
+	return populate_reserved_page(addr, image);
+}
+
+/***************************SWAP FUNCTIONS*****************************/
+
+/** @brief Function to check if a particular address was swapped out
+ *
+ *  @param addr Virtual address to be checked.
+ *
+ *  @return 1 if the page is in the swap store, 0 if not
+ */
+int is_addr_swapped(void *addr) {
+	if((unsigned int)addr < USER_MEM_START) {
+		return 0;
+	}
+	int *pd = (void *)get_cr3();
+	int pd_index = GET_PD_INDEX(addr);
+	if(!(pd[pd_index] & PAGE_ENTRY_PRESENT) || 
+		(pd[pd_index] & LARGE_PAGE_ENTRY)) {
+		return 0;
+	}
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	return IS_SWAP_ENTRY(pt[GET_PT_INDEX(addr)]);
+}
+
+/** @brief Function to bring a swapped out page back
+ *
+ *  The page is decompressed into a new frame, swapping out other pages
+ *  if there is no free frame, and mapped with its old flags.
+ *
+ *  @param addr the faulting virtual address
+ *
+ *  @return int 0 on success. Negative number on failure
+ */
+int handle_swapped(void *addr) {
+	int *pd = (void *)get_cr3();
+    int pd_index = GET_PD_INDEX(addr);
+    int pt_index = GET_PT_INDEX(addr);
+	int installed = 0;
+
+	void *new_frame = allocate_frame_reclaim();
+	if(new_frame == NULL) {
+		return ERR_NOMEM;
+	}
+	frame_add_ref(new_frame, 1);
+
+	mutex_lock(&swap_mutex);
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	unsigned int entry = pt[pt_index];
+	if(!(pd[pd_index] & PT_COW_MODE) && IS_SWAP_ENTRY(entry)) {
+		swap_load(GET_SWAP_SLOT(entry), swap_buf);
+
+		int int_flag = get_eflags() & EFL_IF;
+		disable_interrupts();
+		if(!(pd[pd_index] & PT_COW_MODE) && pt[pt_index] == entry) {
+			memcpy(map_frame_window(new_frame), swap_buf, PAGE_SIZE);
+			pt[pt_index] = (unsigned int)new_frame | 
+						   GET_FLAGS_FROM_ENTRY(entry) | PAGE_ENTRY_PRESENT;
+			installed = 1;
+		}
+		if(int_flag) {
+			enable_interrupts();
+		}
+	}
+	mutex_unlock(&swap_mutex);
+
+	if(installed) {
+		swap_free(GET_SWAP_SLOT(entry));
+		STAT_ADD(pd, swapped_pages, -1);
+		STAT_ADD(pd, resident_pages, 1);
+	} else {
+		/* Another thread of the task got here first */
+		frame_add_ref(new_frame, -1);
+		deallocate_frame(new_frame);
+	}
+	return 0;
+}
+
+/** @brief allocate a frame, swapping pages out if there is none
+ *
+ *  @return void* the frame, NULL if none could be freed up
+ */
+void *allocate_frame_reclaim() {
+	void *frame = allocate_frame();
+	if(frame == NULL && swap_out_pages(SWAP_RECLAIM_BATCH) > 0) {
+		frame = allocate_frame();
+	}
+	return frame;
+}
+
+/** @brief reserve frames, swapping pages out if there are too few
+ *
+ *  @param num_frames the number of frames to reserve
+ *  @return int 0 on success, ERR_NOMEM if they could not be freed up
+ */
+int reserve_frames_reclaim(int num_frames) {
+	if(reserve_frames(num_frames) == 0) {
+		return 0;
+	}
+	if(swap_out_pages(num_frames + SWAP_RECLAIM_BATCH) == 0) {
+		return ERR_NOMEM;
+	}
+	return reserve_frames(num_frames);
+}
+
+/** @brief swap out cold user pages of any task
+ *
+ *  A clock hand sweeps the page tables of every address space. A page
+ *  accessed since the hand last passed has its accessed bit cleared and
+ *  is left alone, any other private page is compressed into the swap
+ *  store and its frame freed. The sweep gives up after the hand has gone
+ *  around SWAP_SCAN_ROUNDS times.
+ *
+ *  @param num_pages the number of pages wanted
+ *  @return int the number of pages swapped out
+ */
+int swap_out_pages(int num_pages) {
+	int swapped = 0, wraps = 0;
+	mutex_lock(&swap_mutex);
+	while(swapped < num_pages && wraps < SWAP_SCAN_ROUNDS) {
+		if(pd_swappable[clock_pd_slot] &&
+		   swap_out_page((int *)(clock_pd_slot << PAGE_SHIFT),
+						 clock_pd_index, clock_pt_index) == 0) {
+			swapped++;
+		}
+		advance_clock(&wraps);
+	}
+	mutex_unlock(&swap_mutex);
+	return swapped;
+}
+
+/** @brief swap out a page if it is private and was not recently used
+ *
+ *  The page is copied out with interrupts disabled and its dirty bit 
+ *  cleared. It is compressed with interrupts enabled and only unmapped if
+ *  the entry did not change meanwhile, which the dirty bit tells if the 
+ *  page was written to.
+ *
+ *  @pre swap_mutex is held
+ *  @param pd the page directory
+ *  @param pd_index the index of the page table in the page directory
+ *  @param pt_index the index of the entry in the page table
+ *  @return int 0 if the page was swapped out, negative number if not
+ */
+int swap_out_page(int *pd, int pd_index, int pt_index) {
+	void *page_addr = (char *)GET_PD_BASE(pd_index) + pt_index * PAGE_SIZE;
+	unsigned int pd_entry = pd[pd_index];
+	if(!(pd_entry & PAGE_ENTRY_PRESENT) || 
+	   (pd_entry & (LARGE_PAGE_ENTRY | PT_COW_MODE))) {
+		return ERR_INVAL;
+	}
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd_entry);
+
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	unsigned int entry = pt[pt_index];
+	void *frame = (void *)GET_ADDR_FROM_ENTRY(entry);
+	if(!(entry & PAGE_ENTRY_PRESENT) || (unsigned int)frame < USER_MEM_START
+	   || (unsigned int)frame >= machine_phys_frames() * PAGE_SIZE
+	   || frame_get_ref(frame) != 1) {
+		/* Kernel, device or shared memory */
+		if(int_flag) {
+			enable_interrupts();
+		}
+		return ERR_INVAL;
+	}
+	if(entry & PAGE_ACCESSED) {
+		/* Give it another round */
+		pt[pt_index] = entry & ~PAGE_ACCESSED;
+		tlb_invalidate(pd, page_addr, 1);
+		if(int_flag) {
+			enable_interrupts();
+		}
+		return ERR_BUSY;
+	}
+	entry &= ~PAGE_DIRTY;
+	pt[pt_index] = entry;
+	tlb_invalidate(pd, page_addr, 1);
+	memcpy(swap_buf, map_frame_window(frame), PAGE_SIZE);
+	if(int_flag) {
+		enable_interrupts();
+	}
+
+	int slot = swap_store(swap_buf);
+	if(slot < 0) {
+		return slot;
+	}
+
+	int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	if(((pd[pd_index] ^ pd_entry) & ~PAGE_ACCESSED) ||
+	   (pt[pt_index] & ~PAGE_ACCESSED) != entry) {
+		/* Written to, unmapped or shared meanwhile */
+		if(int_flag) {
+			enable_interrupts();
+		}
+		swap_free(slot);
+		return ERR_BUSY;
+	}
+	pt[pt_index] = SWAP_ENTRY(slot, entry);
+	tlb_invalidate(pd, page_addr, 1);
+	if(int_flag) {
+		enable_interrupts();
+	}
+
+	STAT_ADD(pd, resident_pages, -1);
+	STAT_ADD(pd, swapped_pages, 1);
+	if(frame_add_ref(frame, -1) == 0) {
+		deallocate_frame(frame);
+	}
+	return 0;
+}
+
+/** @brief move the clock hand to the next page table entry
+ *
+ *  Page directories not scanned and page table entries which cannot
+ *  hold a swappable page are skipped a whole table or directory at a time.
+ *
+ *  @pre swap_mutex is held
+ *  @param wraps incremented when the hand goes past the last directory
+ *  @return void
+ */
+void advance_clock(int *wraps) {
+	int *pd = (int *)(clock_pd_slot << PAGE_SHIFT);
+	if(pd_swappable[clock_pd_slot]) {
+		unsigned int pd_entry = pd[clock_pd_index];
+		if((pd_entry & PAGE_ENTRY_PRESENT) && 
+		   !(pd_entry & (LARGE_PAGE_ENTRY | PT_COW_MODE)) &&
+		   ++clock_pt_index < NUM_PAGE_TABLE_ENTRIES) {
+			return;
+		}
+		clock_pt_index = 0;
+		if(++clock_pd_index < NUM_PAGE_TABLE_ENTRIES) {
+			return;
+		}
+	}
+	clock_pt_index = 0;
+	clock_pd_index = KERNEL_MAP_NUM_ENTRIES;
+	if(++clock_pd_slot == USER_MEM_START / PAGE_SIZE) {
+		clock_pd_slot = 0;
+		(*wraps)++;
+	}
+}
+
+/** @brief take a page directory out of the clock's sweep
+ *
+ *  Waits for a sweep in progress, which may be looking at its tables.
+ *
+ *  @param pd the page directory
+ *  @return void
+ */
+void stop_swapping(void *pd) {
+	mutex_lock(&swap_mutex);
+	pd_swappable[PD_MAP_INDEX(pd)] = 0;
+	mutex_unlock(&swap_mutex);
+}
+
+/** @brief let the clock swap out pages of an address space again
+ *
+ *  @param pd the page directory
+ *  @return void
+ */
+void resume_swapping(void *pd) {
+	mutex_lock(&swap_mutex);
+	pd_swappable[PD_MAP_INDEX(pd)] = 1;
+	mutex_unlock(&swap_mutex);
+}
+
+/*************************SWAP FUNCTIONS END***************************/
+
+/** @brief setup paging for a program
+ *
+ *  this function reads a simple_elf_t and creates mappings in the 
+ *  page directory/page table for the regions found in the elf header.
+ *  No data is copied from the binary here. Text, data and rodata
+ *  pages are filled in from the program image when first touched. 
+ *
+ *  @param se_hdr pointer to a simple_elf_t containing info about the 
+ *                program to be loaded
+ *  @param pd_addr the address of the page directory obtained through
+ *                 a previous call to create_page_directory
+ *
+ *  @return 0 on success. Negative number on failure
+ */
+int setup_page_table(simple_elf_t *se_hdr, void *pd_addr) {
+    if(se_hdr == NULL || pd_addr == NULL) {
+        return ERR_FAILURE;
+    }
+    int retval;
+    if((retval = map_text_segment(se_hdr, pd_addr)) < 0) {
+        return retval;
+    }
+    if((retval = map_data_segment(se_hdr, pd_addr)) < 0) {
+        return retval;
+    }
+    if((retval = map_rodata_segment(se_hdr, pd_addr)) < 0) {
+        return retval;
     }
     if((retval = map_bss_segment(se_hdr, pd_addr)) < 0) {
         return retval;
@@ -541,15 +1504,170 @@ void zero_fill(void *addr, int size) {
     return;
 }
 
+/** @brief check if an address lies in a page which is not yet populated
+ *
+ *  @param addr Virtual address to be checked.
+ *  @param lod 1 to look for a demand-load entry, 0 for demand-zero
+ *
+ *  @return 1 if the entry is of the asked kind, 0 if not
+ */
+int is_addr_reserved(void *addr, int lod) {
+	if((unsigned int)addr < USER_MEM_START) {
+		return 0;
+	}
+	int *pd = (void *)get_cr3();
+	int pd_index = GET_PD_INDEX(addr);
+	int pt_index = GET_PT_INDEX(addr);
+	if(!(pd[pd_index] & PAGE_ENTRY_PRESENT) || 
+		(pd[pd_index] & LARGE_PAGE_ENTRY)) {
+		return 0;
+	}
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	if(lod) {
+		return IS_LOD_ENTRY(pt[pt_index]);
+	}
+	return IS_ZFOD_ENTRY(pt[pt_index]);
+}
+
+/** @brief populate a page which has a frame reserved for it
+ *
+ *  Claims the frame reserved for the page, maps it with the flags 
+ *  recorded in the entry and fills it, either with zeroes or from the
+ *  program image. Population is serialized by populate_mutex and the 
+ *  entry is checked under it before the reservation is claimed, so two 
+ *  threads of a task faulting on the same page never both claim it. The 
+ *  entry is checked again with interrupts disabled before it is set, in 
+ *  case the page was removed or the table shared by a fork meanwhile.
+ *
+ *  @param addr the faulting virtual address
+ *  @param image the program image to fill the page from, NULL to zero it
+ *
+ *  @return int 0 on success. Negative number on failure
+ */
+int populate_reserved_page(void *addr, const program_image_t *image) {
+	int *pd = (void *)get_cr3();
+    int pd_index = GET_PD_INDEX(addr);
+    int pt_index = GET_PT_INDEX(addr);
+    void *page_addr = (void *)((int)addr & PAGE_ROUND_DOWN);
+
+	mutex_lock(&populate_mutex);
+    int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	unsigned int entry = pt[pt_index];
+	if((pd[pd_index] & PT_COW_MODE) || !IS_RESERVED_ENTRY(entry)) {
+		/* Another thread of the task populated the page first */
+		mutex_unlock(&populate_mutex);
+		return 0;
+	}
+
+	/* Read-only program pages are the same in every task running it */
+	if(image != NULL && !(entry & READ_WRITE_ENABLE)) {
+		populate_shared_page(pd, pd_index, pt_index, page_addr, image);
+		mutex_unlock(&populate_mutex);
+		return 0;
+	}
+
+	int zeroed;
+	void *new_frame = allocate_reserved_frame(image == NULL, &zeroed);
+	frame_add_ref(new_frame, 1);
+
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	if((pd[pd_index] & PT_COW_MODE) || pt[pt_index] != entry) {
+		if(int_flag) {
+			enable_interrupts();
+		}
+		mutex_unlock(&populate_mutex);
+		/* Whoever changed the entry accounted for its reservation */
+		frame_add_ref(new_frame, -1);
+		deallocate_frames_reserved(&new_frame, 1);
+		return 0;
+	}
+	/* Fill the frame before it becomes visible at page_addr */
+	if(image == NULL) {
+		if(!zeroed) {
+			zero_frame(new_frame);
+		}
+	} else {
+		load_page(image, page_addr, map_frame_window(new_frame));
+	}
+	int flags = GET_FLAGS_FROM_ENTRY(entry) | PAGE_ENTRY_PRESENT;
+	pt[pt_index] = (unsigned int)new_frame | flags;
+	if(int_flag) {
+		enable_interrupts();
+	}
+	mutex_unlock(&populate_mutex);
+	STAT_ADD(pd, resident_pages, 1);
+
+	return 0;
+}
+
+/** @brief populate a read-only program page through the page cache
+ *
+ *  If the page is cached its frame is mapped and the reservation for the
+ *  page is given back. Otherwise the reserved frame is filled from the 
+ *  program image and offered to the cache, which keeps its own reference.
+ *
+ *  @pre populate_mutex is held and the entry is a demand-load entry
+ *  @param pd the page directory of the faulting task
+ *  @param pd_index the index of the page table in the page directory
+ *  @param pt_index the index of the entry in the page table
+ *  @param page_addr the page aligned faulting virtual address
+ *  @param image the program image to fill the page from
+ *
+ *  @return void
+ */
+void populate_shared_page(int *pd, int pd_index, int pt_index, 
+                          void *page_addr, const program_image_t *image) {
+	int *pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	unsigned int entry = pt[pt_index];
+	void *frame = page_cache_lookup(image->toc_index, page_addr);
+	int cached = (frame != NULL);
+	if(!cached) {
+		frame = allocate_reserved_frame(0, NULL);
+	}
+	frame_add_ref(frame, 1);
+
+	int int_flag = get_eflags() & EFL_IF;
+	disable_interrupts();
+	pt = (int *)GET_ADDR_FROM_ENTRY(pd[pd_index]);
+	if((pd[pd_index] & PT_COW_MODE) || pt[pt_index] != entry) {
+		if(int_flag) {
+			enable_interrupts();
+		}
+		/* Whoever changed the entry accounted for its reservation */
+		frame_add_ref(frame, -1);
+		if(!cached) {
+			deallocate_frames_reserved(&frame, 1);
+		}
+		return;
+	}
+	if(!cached) {
+		load_page(image, page_addr, map_frame_window(frame));
+	}
+	int flags = GET_FLAGS_FROM_ENTRY(entry) | PAGE_ENTRY_PRESENT;
+	pt[pt_index] = (unsigned int)frame | flags;
+	if(int_flag) {
+		enable_interrupts();
+	}
+	STAT_ADD(pd, resident_pages, 1);
+
+	if(cached) {
+		unreserve_frames(1);
+	} else if(page_cache_insert(image->toc_index, page_addr, frame) == 0) {
+		frame_add_ref(frame, 1);
+	}
+}
+
 /** @brief direct map the kernel memory space
  *
  *  maps the lower 16 MB of the virtual memory to the lower 16 MB of
  *  physical memory. These pages are neither readable nor writable.
- *  All processes share the same page tables for the bottom 16 MB (i.e
- *  the page directory for all processes point to the same page tables for
- *  kernel memory). Therefore this function should be called once the mapping
- *  has been setup (setup_direct_map) and this simply copies the value in the
- *  direct_map array to the page directory.
+ *  All processes share the same page directory entries for the bottom 16 MB
+ *  (4 MB pages, and the single page table holding the frame windows). 
+ *  Therefore this function should be called once the mapping has been setup 
+ *  (setup_direct_map) and this simply copies the entries in the direct_map 
+ *  array to the page directory.
  *
  * @param pd_addr the page directory where the direct mapping has to be 
  * 			performed
@@ -557,47 +1675,132 @@ void zero_fill(void *addr, int size) {
  * @return void
  */
 void direct_map_kernel_pages(void *pd_addr) {
-    int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE;
     int i;
     for (i = 0; i < KERNEL_MAP_NUM_ENTRIES; i++) {
-        ((int *)pd_addr)[i] = (int)direct_map[i] | flags;
+        ((int *)pd_addr)[i] = direct_map[i];
     }
 }
 
 /** @brief set up the direct map for kernel memory
  *
- *  get 4 frames required to map the bottom 16 MB of physical address space
- *  and write the page table entries corresponding to the 16 MB along with a
- *  no read/write protection policy. These 4 frames are stored in the array 
- *  direct_map which are used whenever a new page directory is initialized. 
- *  The page directory points to these 4 page tables
+ *  The bottom 16 MB of physical address space is mapped with global 4 MB 
+ *  pages so that the whole kernel only takes up 4 TLB entries. The 4 MB 
+ *  region holding the frame windows is the exception: it gets a page table 
+ *  of 4 KB global entries so that the window entries alone can be repointed. 
+ *  On a multiprocessor the region holding LAPIC_VIRT_BASE gets one too, 
+ *  and that page is pointed at the local APIC with caching disabled.
+ *  The entries are stored in the array direct_map which is used whenever a 
+ *  new page directory is initialized.
  *
+ *  @pre the frame windows have been allocated and cpus_init has run
  *  @return void
  */
 void setup_direct_map() {
     int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | GLOBAL_PAGE_ENTRY;
-    int i = 0, j = 0, mem_start = 0, page_table_entry;
+    int i = 0, j = 0, mem_start = 0;
+    void *lapic = smp_lapic_base();
 
     for (i = 0; i < KERNEL_MAP_NUM_ENTRIES; i++) {
+        if (i != GET_PD_INDEX(frame_windows) && 
+            (lapic == NULL || i != GET_PD_INDEX(LAPIC_VIRT_BASE))) {
+            direct_map[i] = mem_start | flags | LARGE_PAGE_ENTRY;
+            mem_start += LARGE_PAGE_SIZE;
+            continue;
+        }
         int *frame_addr = (int *)create_page_table();
 
         kernel_assert(frame_addr != NULL);
 
         for (j = 0; j < NUM_PAGE_TABLE_ENTRIES; j++) {
-            page_table_entry = mem_start | flags;
-            frame_addr[j] = page_table_entry;
+            frame_addr[j] = mem_start | flags;
             mem_start += PAGE_SIZE;
         }                
-        direct_map[i] = frame_addr;
+        direct_map[i] = (unsigned int)frame_addr | PAGE_ENTRY_PRESENT 
+                        | READ_WRITE_ENABLE;
+        if (i == GET_PD_INDEX(frame_windows)) {
+            frame_window_entries = &frame_addr[GET_PT_INDEX(frame_windows)];
+            for (j = 0; j < get_num_cpus(); j++) {
+                frame_window_entries[j] &= ~GLOBAL_PAGE_ENTRY;
+            }
+        }
+        if (lapic != NULL && i == GET_PD_INDEX(LAPIC_VIRT_BASE)) {
+            frame_addr[GET_PT_INDEX(LAPIC_VIRT_BASE)] = (unsigned int)lapic 
+                        | flags | DISABLE_CACHING | WRITE_THROUGH_CACHING;
+        }
+    }
+}
+
+/** @brief set up the frame windows
+ *
+ *  A frame window is a kernel page whose direct map entry is pointed at
+ *  whatever frame the kernel needs to fill or copy into, so frames can be
+ *  written without mapping them in a user address space first. Each
+ *  processor has its own, so pointing it elsewhere only needs a flush of
+ *  the local TLB. The entries are not global so that they never outlive
+ *  an invalidation. They are set up by setup_direct_map, which keeps a 
+ *  page table for the windows. Aligning the windows on their total size
+ *  keeps them in that one table.
+ *
+ *  @pre cpus_init has run
+ *  @return void
+ */
+void setup_frame_window() {
+    frame_windows = smemalign(MAX_CPUS * PAGE_SIZE, 
+                              get_num_cpus() * PAGE_SIZE);
+    kernel_assert(frame_windows != NULL);
+}
+
+/** @brief point the frame window of this processor at a frame
+ *
+ *  The window must only be used with interrupts disabled, and the 
+ *  returned address is only good until they are enabled again.
+ *
+ *  @pre interrupts are disabled
+ *  @param frame the physical frame to be reached
+ *  @return void* kernel virtual address the frame can be accessed at
+ */
+void *map_frame_window(void *frame) {
+    int cpu = this_cpu();
+    char *window = frame_windows + cpu * PAGE_SIZE;
+    frame_window_entries[cpu] = (unsigned int)frame | PAGE_ENTRY_PRESENT 
+                                | READ_WRITE_ENABLE;
+    invalidate_tlb_page(window);
+    return window;
+}
+
+/** @brief drop the TLB entries of pages whose mapping changed
+ *
+ *  This processor drops them if the page directory is the current one.
+ *  The other processors running it flush their TLB.
+ *
+ *  @param pd the page directory
+ *  @param addr the first page
+ *  @param num_pages the number of pages
+ *  @return void
+ */
+void tlb_invalidate(int *pd, void *addr, int num_pages) {
+    if (pd == (int *)get_cr3()) {
+        invalidate_tlb_range(addr, num_pages);
     }
+    tlb_shootdown(pd);
+}
+
+/** @brief zero a frame through the frame window
+ *
+ *  @pre interrupts are disabled
+ *  @param frame the physical frame to be zeroed
+ *  @return void
+ */
+void zero_frame(void *frame) {
+    zero_fill(map_frame_window(frame), PAGE_SIZE);
 }
 
 /** @brief map the text segment into virtual memory
  *
  *  This function checks the address of the start of the text
  *  segment and length to define the number of physical frames
- *  required for the text segment. Then call a function which allocates
- *  free frames from the frame pool, sets up the mapping in the page directory.
+ *  required for the text segment. Then call a function which reserves
+ *  frames for it and sets up entries to be populated on first touch.
  *
  *  @param se_hdr the parsed elf header
  *  @param pd_addr the address of the page directory frame
@@ -605,16 +1808,20 @@ void setup_direct_map() {
  */
 int map_text_segment(simple_elf_t *se_hdr, void *pd_addr) {
     int flags = PAGE_ENTRY_PRESENT | USER_MODE;
-    return map_segment((void *)se_hdr->e_txtstart, se_hdr->e_txtlen, 
-						pd_addr, flags);
+    if (add_segment_area(pd_addr, se_hdr->e_txtstart, se_hdr->e_txtlen,
+                         VMA_READ, VMA_IMAGE) < 0) {
+        return ERR_NOMEM;
+    }
+    return reserve_segment((void *)se_hdr->e_txtstart, se_hdr->e_txtlen, 
+						pd_addr, LOD_ENTRY(flags));
 }
 
 /** @brief map the data segment into virtual memory
  *
  *  This function checks the address of the start of the data
  *  segment and length to define the number of physical frames
- *  required for the data segment. Then call a function which allocates
- *  free frames from the frame pool, sets up the mapping in the page directory.
+ *  required for the data segment. Then call a function which reserves
+ *  frames for it and sets up entries to be populated on first touch.
  *
  *  @param se_hdr the parsed elf header
  *  @param pd_addr the address of the page directory frame
@@ -622,16 +1829,20 @@ int map_text_segment(simple_elf_t *se_hdr, void *pd_addr) {
  */
 int map_data_segment(simple_elf_t *se_hdr, void *pd_addr) {
     int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE;
-    return map_segment((void *)se_hdr->e_datstart, se_hdr->e_datlen, 
-						pd_addr, flags);
+    if (add_segment_area(pd_addr, se_hdr->e_datstart, se_hdr->e_datlen,
+                         VMA_READ | VMA_WRITE, VMA_IMAGE) < 0) {
+        return ERR_NOMEM;
+    }
+    return reserve_segment((void *)se_hdr->e_datstart, se_hdr->e_datlen, 
+						pd_addr, LOD_ENTRY(flags));
 }
 
 /** @brief map the rodata segment into virtual memory
  *
  *  This function checks the address of the start of the rodata
  *  segment and length to define the number of physical frames
- *  required for the rodata segment. Then call a function which allocates
- *  free frames from the frame pool, sets up the mapping in the page directory.
+ *  required for the rodata segment. Then call a function which reserves
+ *  frames for it and sets up entries to be populated on first touch.
  *
  *  @param se_hdr the parsed elf header
  *  @param pd_addr the address of the page directory frame
@@ -639,16 +1850,20 @@ int map_data_segment(simple_elf_t *se_hdr, void *pd_addr) {
  */
 int map_rodata_segment(simple_elf_t *se_hdr, void *pd_addr) {
     int flags = PAGE_ENTRY_PRESENT | USER_MODE;
-    return map_segment((void *)se_hdr->e_rodatstart, 
-						se_hdr->e_rodatlen, pd_addr, flags);
+    if (add_segment_area(pd_addr, se_hdr->e_rodatstart, se_hdr->e_rodatlen,
+                         VMA_READ, VMA_IMAGE) < 0) {
+        return ERR_NOMEM;
+    }
+    return reserve_segment((void *)se_hdr->e_rodatstart, 
+						se_hdr->e_rodatlen, pd_addr, LOD_ENTRY(flags));
 }
 
 /** @brief map the bss segment into virtual memory
  *
  *  This function checks the address of the start of the bss
  *  segment and length to define the number of physical frames
- *  required for the bss segment. Then call a function which allocates
- *  free frames from the frame pool, sets up the mapping in the page directory.
+ *  required for the bss segment. Then call a function which reserves
+ *  frames for it and sets up entries to be populated on first touch.
  *
  *  @param se_hdr the parsed elf header
  *  @param pd_addr the address of the page directory frame
@@ -656,8 +1871,12 @@ int map_rodata_segment(simple_elf_t *se_hdr, void *pd_addr) {
  */
 int map_bss_segment(simple_elf_t *se_hdr, void *pd_addr) {
     int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE;
-    return map_segment((void *)se_hdr->e_bssstart, se_hdr->e_bsslen, 
-						pd_addr, flags);
+    if (add_segment_area(pd_addr, se_hdr->e_bssstart, se_hdr->e_bsslen,
+                         VMA_READ | VMA_WRITE, VMA_ZERO) < 0) {
+        return ERR_NOMEM;
+    }
+    return reserve_segment((void *)se_hdr->e_bssstart, se_hdr->e_bsslen, 
+						pd_addr, ZFOD_ENTRY(flags));
 }
 
 /** @brief map the stack segment into virtual memory
@@ -667,42 +1886,94 @@ int map_bss_segment(simple_elf_t *se_hdr, void *pd_addr) {
  */
 int map_stack_segment(void *pd_addr) {
     int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE;
-    return map_segment((char *)STACK_START - DEFAULT_STACK_SIZE + 1, 
-						DEFAULT_STACK_SIZE, pd_addr, flags); 
+    if (add_segment_area(pd_addr, STACK_START - DEFAULT_STACK_SIZE + 1,
+                         DEFAULT_STACK_SIZE, VMA_READ | VMA_WRITE, 
+                         VMA_ZERO) < 0) {
+        return ERR_NOMEM;
+    }
+    return reserve_segment((char *)STACK_START - DEFAULT_STACK_SIZE + 1, 
+						DEFAULT_STACK_SIZE, pd_addr, ZFOD_ENTRY(flags)); 
+}
+
+/** @brief record a program segment in the map of a page directory
+ *
+ *  Segments are widened to whole pages. Pages a segment shares with one
+ *  recorded earlier stay in the earlier area.
+ *
+ *  @param pd_addr the address of the page directory
+ *  @param start the start of the segment
+ *  @param length the length of the segment in bytes
+ *  @param prot VMA_READ and VMA_WRITE
+ *  @param type the VMA_* backing of the segment
+ *  @return int 0 on success, ERR_NOMEM if out of memory
+ */
+int add_segment_area(void *pd_addr, unsigned int start, unsigned int length, 
+                     int prot, int type) {
+    if (length == 0) {
+        return 0;
+    }
+    return vm_map_insert_gaps(get_vm_map(pd_addr), start & PAGE_ROUND_DOWN,
+                              PAGE_ROUND_UP(start + length), prot, type);
 }
 
 /** @brief map new_pages into virtual memory
+ *
+ *  The region is recorded as an area of the address space first, which
+ *  fails if it overlaps anything already there. A region which starts on 
+ *  a 4 MB boundary is backed by 4 MB pages for as long as whole 4 MB 
+ *  chunks of it remain and contiguous frames can be found. Those are 
+ *  allocated and zeroed right away. The rest of the region is reserved 
+ *  page by page and populated on first touch.
  *
  *  @param base the base of the new_pages region
  *  @param len the length of the new pages region
  *  @return int error code, 0 on success negative integer on failure
  */
 int map_new_pages(void *base, int length) {
-    int retval, pd_index, pt_index;
+    int retval, pd_index;
     int *pd_addr = (int *)get_cr3();
-    int *pt_addr;
-    int *end_addr = (int *)((char *)base + length - 1);
-    int *end_frame = (int *)((int)end_addr & PAGE_ROUND_DOWN);
-    int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE
-                | NEWPAGE_PAGE;
-    retval = map_segment((char *)base, length, pd_addr, flags); 
-    if (retval < 0) {
+    vm_map_t *map = get_vm_map(pd_addr);
+    int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE;
+    char *small_base = base;
+    int small_length = length;
+
+    if ((retval = vm_map_insert(map, (unsigned int)base, 
+                                PAGE_ROUND_UP((char *)base + length),
+                                VMA_READ | VMA_WRITE, VMA_NEW_PAGES, 
+                                NULL)) < 0) {
         return retval;
     }
+    if (IS_LARGE_PAGE_ALIGNED(base)) {
+        while (small_length >= LARGE_PAGE_SIZE &&
+               map_large_page(pd_addr, small_base) == 0) {
+            small_base += LARGE_PAGE_SIZE;
+            small_length -= LARGE_PAGE_SIZE;
+        }
+    }
+    if (small_length > 0) {
+        retval = reserve_segment(small_base, small_length, pd_addr, 
+                                 ZFOD_ENTRY(flags)); 
+        if (retval < 0) {
+            while (small_base != (char *)base) {
+                small_base -= LARGE_PAGE_SIZE;
+                pd_index = GET_PD_INDEX(small_base);
+                free_large_page(pd_addr[pd_index]);
+                pd_addr[pd_index] = PAGE_DIR_ENTRY_DEFAULT;
+                STAT_ADD(pd_addr, resident_pages, -FRAMES_PER_LARGE_FRAME);
+            }
+            tlb_invalidate(pd_addr, base, (length - small_length) / PAGE_SIZE);
+            vm_map_remove(map, (unsigned int)base, VMA_NEW_PAGES, NULL);
+            return retval;
+        }
+    }
 
-    pd_index = GET_PD_INDEX(end_frame);
-    pt_index = GET_PT_INDEX(end_frame);
-    pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
-    pt_addr[pt_index] = SET_NEWPAGE_END(pt_addr[pt_index]);
-
-    pd_index = GET_PD_INDEX(base);
-    pt_index = GET_PT_INDEX(base);
-    pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
-    pt_addr[pt_index] = SET_NEWPAGE_START(pt_addr[pt_index]);
-
-	/* INVLPG is not working for some reason :( */
-	set_cur_pd(pd_addr);
+    STAT_ADD(pd_addr, new_pages_regions, 1);
+    STAT_ADD(pd_addr, new_pages_bytes, 
+             PAGE_ROUND_UP((char *)base + length) - (unsigned int)base);
 
+    /* The entries were absent and are still not present (or were never 
+     * accessed, for the 4 MB pages) so the TLB cannot hold anything for 
+     * them */
     return 0;
 }
 
@@ -712,110 +1983,507 @@ int map_new_pages(void *base, int length) {
  *  @return int error code, 0 on success negative integer on failure
  */
 int unmap_new_pages(void *base) {
-    int pd_index, pt_index;
     int *pd_addr = (int *)get_cr3();
-    int *pt_addr;
-    void *frame_addr;
+    vm_map_t *map = get_vm_map(pd_addr);
+    vm_area_t area;
 
-    pd_index = GET_PD_INDEX(base);
-    pt_index = GET_PT_INDEX(base);
-    pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
-    if (GET_NEWPAGE_FLAGS(pt_addr[pt_index]) != NEWPAGE_START) {
+    if (vm_map_find(map, (unsigned int)base, &area) < 0 ||
+        area.start != (unsigned int)base || area.type != VMA_NEW_PAGES) {
         return ERR_INVAL;
     }
+    if (unshare_range(pd_addr, &area) < 0) {
+        return ERR_NOMEM;
+    }
+    if (vm_map_remove(map, (unsigned int)base, VMA_NEW_PAGES, &area) < 0) {
+        return ERR_INVAL;
+    }
+    STAT_ADD(pd_addr, new_pages_regions, -1);
+    STAT_ADD(pd_addr, new_pages_bytes, -(int)(area.end - area.start));
+    return unmap_range(pd_addr, &area);
+}
+
+/** @brief make every page table an area falls in private
+ *
+ *  Called before the area is removed, so running out of memory leaves
+ *  the area as it was. 4 MB pages are left alone, unmapping one only
+ *  drops a reference to it.
+ *
+ *  @param pd_addr the current page directory
+ *  @param area the area
+ *  @return int 0 on success, ERR_NOMEM if a table could not be split
+ */
+int unshare_range(int *pd_addr, vm_area_t *area) {
+    int pd_index;
+    for (pd_index = GET_PD_INDEX(area->start); 
+         pd_index <= GET_PD_INDEX(area->end - 1); pd_index++) {
+        if ((pd_addr[pd_index] & PT_COW_MODE) && 
+            !(pd_addr[pd_index] & LARGE_PAGE_ENTRY) &&
+            unshare_page_table(pd_addr, pd_index) < 0) {
+            return ERR_NOMEM;
+        }
+    }
+    return 0;
+}
+
+/** @brief clear the page table entries of an area removed from the map
+ *
+ *  The page tables of the area are expected to be private already, see
+ *  unshare_range(). Should a fork by another thread share one again and
+ *  it cannot be split, the pages before it are still unmapped and 
+ *  flushed before the error is returned.
+ *
+ *  @param pd_addr the current page directory
+ *  @param area the area
+ *  @return int error code, 0 on success negative integer on failure
+ */
+int unmap_range(int *pd_addr, vm_area_t *area) {
+    int pd_index, pt_index;
+    int *pt_addr;
+    void *base = (void *)area->start;
 
-    frame_addr = (void *)GET_ADDR_FROM_ENTRY(pt_addr[pt_index]);
-	lock_frame(frame_addr);
-	frame_ref_count[FRAME_INDEX(frame_addr)]--;
-	if(frame_ref_count[FRAME_INDEX(frame_addr)] == 0) {
-    	deallocate_frame(frame_addr); 
-	}
-	unlock_frame(frame_addr);
-	pt_addr[pt_index] = PAGE_TABLE_ENTRY_DEFAULT;
-    
-    base = (char *)base + PAGE_SIZE;
-    pd_index = GET_PD_INDEX(base);
-    pt_index = GET_PT_INDEX(base);
-    pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
-    while((GET_NEWPAGE_FLAGS(pt_addr[pt_index]) == NEWPAGE_PAGE) 
-          || (GET_NEWPAGE_FLAGS(pt_addr[pt_index]) == NEWPAGE_END)) { 
-        frame_addr = (void *)GET_ADDR_FROM_ENTRY(pt_addr[pt_index]);
-		lock_frame(frame_addr);
-		frame_ref_count[FRAME_INDEX(frame_addr)]--;
-		if(frame_ref_count[FRAME_INDEX(frame_addr)] == 0) {
-			deallocate_frame(frame_addr); 
-		}
-		unlock_frame(frame_addr);
-        pt_addr[pt_index] = PAGE_TABLE_ENTRY_DEFAULT;
-        base = (char *)base + PAGE_SIZE;
+    while ((unsigned int)base < area->end) {
         pd_index = GET_PD_INDEX(base);
         pt_index = GET_PT_INDEX(base);
-        pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
+        if (pd_addr[pd_index] & LARGE_PAGE_ENTRY) {
+            free_large_page(pd_addr[pd_index]);
+            pd_addr[pd_index] = PAGE_DIR_ENTRY_DEFAULT;
+            STAT_ADD(pd_addr, resident_pages, -FRAMES_PER_LARGE_FRAME);
+            base = (char *)base + LARGE_PAGE_SIZE;
+        } else {
+            if ((pd_addr[pd_index] & PT_COW_MODE) && 
+                unshare_page_table(pd_addr, pd_index) < 0) {
+                tlb_invalidate(pd_addr, (void *)area->start, 
+                               ((unsigned int)base - area->start) / PAGE_SIZE);
+                return ERR_NOMEM;
+            }
+            pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
+            /* The clock may swap the page out under us */
+            int int_flag = get_eflags() & EFL_IF;
+            disable_interrupts();
+            unsigned int entry = pt_addr[pt_index];
+            pt_addr[pt_index] = PAGE_TABLE_ENTRY_DEFAULT;
+            if (int_flag) {
+                enable_interrupts();
+            }
+            if (entry & PAGE_ENTRY_PRESENT) {
+                STAT_ADD(pd_addr, resident_pages, -1);
+            } else if (IS_SWAP_ENTRY(entry)) {
+                STAT_ADD(pd_addr, swapped_pages, -1);
+            }
+            free_page_entry(entry);
+            base = (char *)base + PAGE_SIZE;
+        }
     }
 
-	/* INVLPG is not working for some reason :( */
-	set_cur_pd(pd_addr);
+	tlb_invalidate(pd_addr, (void *)area->start, 
+                   (area->end - area->start) / PAGE_SIZE);
 
     return 0;
 }
 
-/** @brief map a segment into memory
+/** @brief map a shared memory segment into virtual memory
  *
- *  This function takes the starting virtual address and the length. Then
- *  calculate the total number of frames required for this range of memory 
- *  allocate those many frames and set up the mapping in the page directory.
+ *  The frames of the segment are mapped right away. Their entries are
+ *  marked as shared memory so a fork does not make them copy-on-write.
+ *
+ *  @param base the page aligned base to map the segment at
+ *  @param seg the segment. The area mapping it takes over the reference
+ *             of the caller on success.
+ *  @return int error code, 0 on success negative integer on failure
+ */
+int map_shm(void *base, shm_segment_t *seg) {
+    int retval, i;
+    int *pd_addr = (int *)get_cr3();
+    vm_map_t *map = get_vm_map(pd_addr);
+    vm_area_t area;
+    int flags = PAGE_ENTRY_PRESENT | READ_WRITE_ENABLE | USER_MODE 
+                | SHARED_MEM_PAGE;
+
+    area.start = (unsigned int)base;
+    area.end = area.start + seg->num_pages * PAGE_SIZE;
+    if ((retval = vm_map_insert(map, area.start, area.end, 
+                                VMA_READ | VMA_WRITE, VMA_SHM, seg)) < 0) {
+        return retval;
+    }
+    for (i = 0; i < seg->num_pages; i++) {
+        char *addr = (char *)base + i * PAGE_SIZE;
+        int *pt_addr = get_user_page_table(pd_addr, addr);
+        if (pt_addr == NULL) {
+            break;
+        }
+        frame_add_ref(seg->frames[i], 1);
+        pt_addr[GET_PT_INDEX(addr)] = (unsigned int)seg->frames[i] | flags;
+        STAT_ADD(pd_addr, resident_pages, 1);
+    }
+    if (i < seg->num_pages) {
+        vm_map_remove(map, area.start, VMA_SHM, NULL);
+        area.end = area.start + i * PAGE_SIZE;
+        /* get_user_page_table() just made the tables private */
+        unmap_range(pd_addr, &area);
+        return ERR_NOMEM;
+    }
+
+    /* The entries were absent so the TLB cannot hold anything for them */
+    return 0;
+}
+
+/** @brief unmap a shared memory segment from virtual memory
+ *
+ *  @param base the base the segment was mapped at
+ *  @return int error code, 0 on success negative integer on failure
+ */
+int unmap_shm(void *base) {
+    int *pd_addr = (int *)get_cr3();
+    vm_map_t *map = get_vm_map(pd_addr);
+    vm_area_t area;
+
+    if (vm_map_find(map, (unsigned int)base, &area) < 0 ||
+        area.start != (unsigned int)base || area.type != VMA_SHM) {
+        return ERR_INVAL;
+    }
+    if (unshare_range(pd_addr, &area) < 0) {
+        return ERR_NOMEM;
+    }
+    if (vm_map_remove(map, (unsigned int)base, VMA_SHM, &area) < 0) {
+        return ERR_INVAL;
+    }
+    int retval = unmap_range(pd_addr, &area);
+    shm_put(area.object);
+    return retval;
+}
+
+/** @brief map a ramdisk file read-only into virtual memory
+ *
+ *  Every page of the file is mapped right away. The pages come from the
+ *  page cache, so all tasks mapping a file share one copy of it.
+ *
+ *  @param base the page aligned base to map the file at
+ *  @param toc_index the index of the file in exec2obj_userapp_TOC
+ *  @param len the length of the file in bytes
+ *  @return int error code, 0 on success negative integer on failure
+ */
+int map_ramdisk_file(void *base, int toc_index, int len) {
+    int retval, offset;
+    int *pd_addr = (int *)get_cr3();
+    vm_map_t *map = get_vm_map(pd_addr);
+    vm_area_t area;
+    int flags = PAGE_ENTRY_PRESENT | USER_MODE;
+
+    area.start = (unsigned int)base;
+    area.end = PAGE_ROUND_UP(area.start + len);
+    if ((retval = vm_map_insert(map, area.start, area.end, VMA_READ, 
+                                VMA_FILE, NULL)) < 0) {
+        return retval;
+    }
+    for (offset = 0; offset < len; offset += PAGE_SIZE) {
+        char *addr = (char *)base + offset;
+        int *pt_addr = get_user_page_table(pd_addr, addr);
+        if (pt_addr == NULL) {
+            break;
+        }
+        void *frame = get_file_frame(toc_index, offset);
+        if (frame == NULL) {
+            break;
+        }
+        pt_addr[GET_PT_INDEX(addr)] = (unsigned int)frame | flags;
+        STAT_ADD(pd_addr, resident_pages, 1);
+    }
+    if (offset < len) {
+        vm_map_remove(map, area.start, VMA_FILE, NULL);
+        area.end = area.start + offset;
+        /* get_user_page_table() just made the tables private */
+        unmap_range(pd_addr, &area);
+        return ERR_NOMEM;
+    }
+
+    /* The entries were absent so the TLB cannot hold anything for them */
+    return 0;
+}
+
+/** @brief add a reference to the segments mapped by a copied map
+ *
+ *  @param map the copy, not yet reachable by any other thread
+ *  @return void
+ */
+void dup_shm_areas(vm_map_t *map) {
+    int i;
+    for (i = 0; i < map->num_areas; i++) {
+        if (map->areas[i].type == VMA_SHM) {
+            shm_dup(map->areas[i].object);
+        }
+    }
+}
+
+/** @brief drop the references to the segments mapped by a dying map
+ *
+ *  @param map the map, about to be cleared or destroyed
+ *  @return void
+ */
+void put_shm_areas(vm_map_t *map) {
+    int i;
+    for (i = 0; i < map->num_areas; i++) {
+        if (map->areas[i].type == VMA_SHM) {
+            shm_put(map->areas[i].object);
+        }
+    }
+}
+
+/** @brief get the page table mapping a user address, creating it if 
+ *         needed
+ *
+ *  A page table still shared after fork is made private first.
+ *
+ *  @param pd_addr the current page directory
+ *  @param addr the user address
+ *  @return int* the page table, NULL if out of memory
+ */
+int *get_user_page_table(int *pd_addr, void *addr) {
+    int pd_index = GET_PD_INDEX(addr);
+    if (pd_addr[pd_index] == PAGE_DIR_ENTRY_DEFAULT) {
+        void *new_pt = create_page_table();
+        if (new_pt == NULL) {
+            return NULL;
+        }
+        pd_addr[pd_index] = (unsigned int)new_pt | USER_PD_ENTRY_FLAGS;
+        STAT_ADD(pd_addr, page_table_pages, 1);
+    }
+    if ((pd_addr[pd_index] & PT_COW_MODE) && 
+        unshare_page_table(pd_addr, pd_index) < 0) {
+        return NULL;
+    }
+    return (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
+}
+
+/** @brief get a frame holding a page of a ramdisk file
+ *
+ *  The frame comes from the page cache, which is filled in on a miss.
+ *  If the cache has no room for it the frame is private to the caller.
+ *
+ *  @param toc_index the index of the file in exec2obj_userapp_TOC
+ *  @param offset the page aligned offset of the page in the file
+ *  @return void* the frame with one reference for the caller, NULL if
+ *          out of memory
+ */
+void *get_file_frame(int toc_index, int offset) {
+    void *frame = page_cache_lookup(toc_index, (void *)offset);
+    if (frame != NULL) {
+        frame_add_ref(frame, 1);
+        return frame;
+    }
+    if ((frame = allocate_frame()) == NULL) {
+        return NULL;
+    }
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    load_file_page(toc_index, offset, map_frame_window(frame));
+    if (int_flag) {
+        enable_interrupts();
+    }
+    frame_add_ref(frame, 1);
+
+    int retval = page_cache_insert(toc_index, (void *)offset, frame);
+    if (retval == 0) {
+        frame_add_ref(frame, 1);
+    } else if (retval == ERR_BUSY) {
+        /* Another task cached the page first, share its frame */
+        frame_add_ref(frame, -1);
+        deallocate_frame(frame);
+        frame = page_cache_lookup(toc_index, (void *)offset);
+        frame_add_ref(frame, 1);
+    }
+    return frame;
+}
+
+/** @brief back a 4 MB region of new_pages with a single 4 MB page
+ *
+ *  The frames are zeroed through the frame window before the page
+ *  is mapped, a page at a time so interrupts are not held off for long.
+ *  Every frame of the run carries its own reference so page tables split
+ *  from the page after a fork can share single frames.
+ *
+ *  @param pd the page directory
+ *  @param addr the 4 MB aligned base of the region
+ *  @return int 0 on success, ERR_NOMEM if the region already has a page 
+ *          table or no contiguous frames are free
+ */
+int map_large_page(int *pd, void *addr) {
+    int pd_index = GET_PD_INDEX(addr);
+    if (pd[pd_index] != PAGE_DIR_ENTRY_DEFAULT) {
+        return ERR_NOMEM;
+    }
+    char *frame_addr = allocate_contiguous_frames(LARGE_FRAME_ORDER);
+    if (frame_addr == NULL) {
+        return ERR_NOMEM;
+    }
+    int i;
+    for (i = 0; i < FRAMES_PER_LARGE_FRAME; i++) {
+        char *frame = frame_addr + i * PAGE_SIZE;
+        int int_flag = get_eflags() & EFL_IF;
+        disable_interrupts();
+        zero_frame(frame);
+        if (int_flag) {
+            enable_interrupts();
+        }
+        frame_add_ref(frame, 1);
+    }
+    large_ref_count[LARGE_REF_INDEX(frame_addr)] = 1;
+    pd[pd_index] = (unsigned int)frame_addr | USER_PD_ENTRY_FLAGS 
+                   | LARGE_PAGE_ENTRY;
+    STAT_ADD(pd, resident_pages, FRAMES_PER_LARGE_FRAME);
+    return 0;
+}
+
+/** @brief drop a page directory's use of a 4 MB page
+ *
+ *  The frames are freed once no page directory maps the 4 MB page. Page
+ *  tables split from it by unshare_large_page() hold their own references
+ *  to the frames, so when some are still in use only the others are 
+ *  freed, one by one.
+ *
+ *  @param entry the page directory entry of the 4 MB page
+ *  @return void
+ */
+void free_large_page(unsigned int entry) {
+    void *frames[FREE_FRAMES_BATCH];
+    char *frame_addr = (char *)GET_ADDR_FROM_ENTRY(entry);
+    int i, j, num_frames = 0;
+
+    mutex_lock(&pt_cow_mutex);
+    if (--large_ref_count[LARGE_REF_INDEX(frame_addr)] > 0) {
+        mutex_unlock(&pt_cow_mutex);
+        return;
+    }
+    mutex_unlock(&pt_cow_mutex);
+    for (i = 0; i < FRAMES_PER_LARGE_FRAME && 
+                frame_add_ref(frame_addr + i * PAGE_SIZE, -1) == 0; i++) {
+        continue;
+    }
+    if (i == FRAMES_PER_LARGE_FRAME) {
+        deallocate_contiguous_frames(frame_addr, LARGE_FRAME_ORDER);
+        return;
+    }
+    /* Frame i is still mapped by a split page table, as may be others */
+    for (j = 0; j < FRAMES_PER_LARGE_FRAME; j++) {
+        char *frame = frame_addr + j * PAGE_SIZE;
+        if (j == i || (j > i && frame_add_ref(frame, -1) > 0)) {
+            continue;
+        }
+        frames[num_frames++] = frame;
+        if (num_frames == FREE_FRAMES_BATCH) {
+            deallocate_frames(frames, num_frames);
+            num_frames = 0;
+        }
+    }
+    deallocate_frames(frames, num_frames);
+}
+
+/** @brief give a page directory a private 4 MB page after a fork
+ *
+ *  If no other page directory maps the 4 MB page any more it is simply 
+ *  made writable again. Otherwise this page directory gets a page table
+ *  mapping the same frames copy-on-write, with a reference to each, and
+ *  the page is only copied a 4 KB page at a time as it is written.
+ *
+ *  @pre pt_cow_mutex is held
+ *  @param pd the page directory
+ *  @param pd_index the index of the shared 4 MB page in the directory
+ *  @return int 0 on success, ERR_NOMEM if no page table could be allocated
+ */
+int unshare_large_page(int *pd, int pd_index) {
+    unsigned int frame_addr = GET_ADDR_FROM_ENTRY(pd[pd_index]);
+    if (large_ref_count[LARGE_REF_INDEX(frame_addr)] == 1) {
+        pd[pd_index] = (pd[pd_index] & COW_MODE_DISABLE_MASK) 
+                       | READ_WRITE_ENABLE;
+        return 0;
+    }
+    int *pt = create_page_table();
+    if (pt == NULL) {
+        return ERR_NOMEM;
+    }
+    int flags = PAGE_ENTRY_PRESENT | USER_MODE | COW_MODE;
+    int i;
+    for (i = 0; i < NUM_PAGE_TABLE_ENTRIES; i++) {
+        pt[i] = (frame_addr + i * PAGE_SIZE) | flags;
+        frame_add_ref((void *)(frame_addr + i * PAGE_SIZE), 1);
+    }
+    large_ref_count[LARGE_REF_INDEX(frame_addr)]--;
+    pd[pd_index] = (unsigned int)pt | USER_PD_ENTRY_FLAGS;
+    STAT_ADD(pd, page_table_pages, 1);
+    return 0;
+}
+
+/** @brief reserve a segment in memory
+ *
+ *  This function takes the starting virtual address and the length. No 
+ *  frames are allocated. Instead a frame is reserved for every page that 
+ *  is not already mapped and its page table entry is set to the demand-zero 
+ *  or demand-load entry passed in. The frame is allocated and filled by the 
+ *  page fault handler when the page is first touched. On failure no entry 
+ *  has been set and nothing stays reserved, though page tables created 
+ *  for the segment are kept.
  *
  *  @param start_addr the start of the virtual address
  *  @param length the length of this memory segment
  *  @param pd_addr the address of the page directory
+ *  @param entry the ZFOD_ENTRY() or LOD_ENTRY() to be set
  *
  *  @return int error code, 0 on success negative integer on failure
  */
-int map_segment(void *start_addr, unsigned int length, int *pd_addr, int flags) {
-    set_cur_pd(pd_addr);
+int reserve_segment(void *start_addr, unsigned int length, int *pd_addr, 
+					unsigned int entry) {
     void *end_addr = (char *)start_addr + length;
     int pd_index, pt_index;
     int *pt_addr;
 
     start_addr = (void *)((int)start_addr & PAGE_ROUND_DOWN);
-    while (start_addr < end_addr) {
-        pd_index = GET_PD_INDEX(start_addr);
-        pt_index = GET_PT_INDEX(start_addr);
+	int num_pages = ((char *)end_addr - (char *)start_addr + PAGE_SIZE - 1) 
+					/ PAGE_SIZE;
+	/* Every page table is made present and private before any entry is 
+	 * set, so a failure leaves nothing behind in the tables */
+	int last_pd_index = GET_PD_INDEX((char *)end_addr - 1);
+	for (pd_index = GET_PD_INDEX(start_addr); pd_index <= last_pd_index; 
+		 pd_index++) {
         if (pd_addr[pd_index] == PAGE_DIR_ENTRY_DEFAULT) { /* Page directory entry absent */
             void *new_pt = create_page_table();
-            if (new_pt != NULL) {
-                pd_addr[pd_index] = (unsigned int)new_pt | USER_PD_ENTRY_FLAGS;
-            }
-            else {
+            if (new_pt == NULL) {
                 return ERR_NOMEM;
             }
+            pd_addr[pd_index] = (unsigned int)new_pt | USER_PD_ENTRY_FLAGS;
+            STAT_ADD(pd_addr, page_table_pages, 1);
+        }
+        if ((pd_addr[pd_index] & PT_COW_MODE) && 
+            unshare_page_table(pd_addr, pd_index) < 0) {
+            return ERR_NOMEM;
         }
+	}
+	/* Frames an exec kept from the last program come first */
+	int *recycled = &pd_recycled[PD_MAP_INDEX(pd_addr)];
+	int from_recycled = (*recycled < num_pages) ? *recycled : num_pages;
+	if (reserve_frames_reclaim(num_pages - from_recycled) < 0) {
+		return ERR_NOMEM;
+	}
+	*recycled -= from_recycled;
+    while (start_addr < end_addr) {
+        pd_index = GET_PD_INDEX(start_addr);
+        pt_index = GET_PT_INDEX(start_addr);
         pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
         if (pt_addr[pt_index] == PAGE_TABLE_ENTRY_DEFAULT) { /* Page table entry absent */
-            /* Need to allocate frame from user free frame pool */
-            void *new_frame = allocate_frame();
-            if (new_frame != NULL) {
-				lock_frame(new_frame);
-                frame_ref_count[FRAME_INDEX(new_frame)]++;
-				unlock_frame(new_frame);
-                pt_addr[pt_index] = (unsigned int)new_frame | flags;
-                zero_fill(start_addr, PAGE_SIZE);
-            }
-            else {
-                return ERR_NOMEM;
-            }
+            pt_addr[pt_index] = entry;
+			num_pages--;
         }
         start_addr = (char *)start_addr + PAGE_SIZE;
     }
+	/* Pages that were already mapped do not need their reservation */
+	unreserve_frames(num_pages);
     return 0;
 }
 
 /** @brief check if a memory region is mapped in the current 
  *         process's usable address space
  *
- *  This function makes use of the paging info of the current process
- *  to determine if any part of the memory range passed in has already
- *  been mapped.
+ *  This function looks the range up in the map of areas of the current
+ *  address space to determine if any part of the memory range passed in
+ *  has already been mapped.
  *
  *  @param base the base of the memory range to be checked
  *  @param len the length of the memory range to be checked
@@ -834,25 +2502,85 @@ int is_memory_range_mapped(void *base, int len) {
     if (base < (void *)USER_MEM_START) {
         return MEMORY_REGION_MAPPED;
     }
-    void *end_addr = (char *)base + len;
-    int *pd_addr = (int *)get_cr3();
-    int *pt_addr;
-    int pd_index, pt_index;
+    unsigned int start = (unsigned int)base & PAGE_ROUND_DOWN;
+    unsigned int end = PAGE_ROUND_UP((char *)base + len);
+    if (end <= start || 
+        vm_map_overlaps(get_vm_map((void *)get_cr3()), start, end)) {
+        return MEMORY_REGION_MAPPED;
+    }
+    return MEMORY_REGION_UNMAPPED;
+}
 
-    base = (void *)((int)base & PAGE_ROUND_DOWN);
-    while (base <= end_addr) {
-        pd_index = GET_PD_INDEX(base);
-        pt_index = GET_PT_INDEX(base);
-        if (pd_addr[pd_index] != PAGE_DIR_ENTRY_DEFAULT) {
-            pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
-            if (pt_addr[pt_index] != PAGE_TABLE_ENTRY_DEFAULT) {
-                return MEMORY_REGION_MAPPED;
-            }
-        }
-        base = (char *)base + PAGE_SIZE;
+/** @brief check if an address belongs to an area of the current 
+ *         address space
+ *
+ *  A fault on an address outside every area can only be an error.
+ *
+ *  @param addr the address
+ *  @return int 1 if some area holds the address, 0 if not
+ */
+int is_addr_mapped(void *addr) {
+    if ((unsigned int)addr < USER_MEM_START) {
+        return 0;
     }
+    return vm_map_find(get_vm_map((void *)get_cr3()), 
+                       (unsigned int)addr, NULL) == 0;
+}
 
-    return MEMORY_REGION_UNMAPPED;
+/** @brief check if a faulting access would now succeed
+ *
+ *  Another thread of the task may have handled a fault on the same page
+ *  while this one waited to get into the kernel. The access only needs
+ *  to be retried then.
+ *
+ *  @param addr the faulting address
+ *  @param error_code the error code of the page fault
+ *  @return int 1 if the page now allows the access, 0 if not
+ */
+int is_fault_resolved(void *addr, unsigned int error_code) {
+    unsigned int need = PAGE_ENTRY_PRESENT;
+    if (error_code & PF_ERR_WRITE) {
+        need |= READ_WRITE_ENABLE;
+    }
+    if (error_code & PF_ERR_USER) {
+        need |= USER_MODE;
+    }
+    int *pd = (int *)get_cr3();
+    unsigned int pde = pd[GET_PD_INDEX(addr)];
+    if ((pde & need) != need) {
+        return 0;
+    }
+    if (pde & LARGE_PAGE_ENTRY) {
+        return 1;
+    }
+    int *pt = (int *)GET_ADDR_FROM_ENTRY(pde);
+    return (pt[GET_PT_INDEX(addr)] & need) == need;
+}
+
+/** @brief check if a range of the current address space may be accessed
+ *
+ *  The whole range has to lie in areas of the address space which allow 
+ *  the access. Its pages need not be present yet.
+ *
+ *  @param base the start of the range
+ *  @param len the length of the range
+ *  @param write 1 if the range is to be written, 0 if only read
+ *  @return int 0 if it may be accessed, ERR_INVAL if not
+ */
+int is_memory_range_accessible(void *base, int len, int write) {
+    unsigned int start = (unsigned int)base;
+    if (start < USER_MEM_START || len < 0 || start + len < start) {
+        return ERR_INVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    int prot = write ? (VMA_READ | VMA_WRITE) : VMA_READ;
+    if (!vm_map_covers(get_vm_map((void *)get_cr3()), start, start + len, 
+                       prot)) {
+        return ERR_INVAL;
+    }
+    return 0;
 }
 
 /** @brief check if memory location is user writable
@@ -870,6 +2598,14 @@ int is_memory_writable(void *ptr, int bytes) {
         
     pd_index = GET_PD_INDEX(ptr);
     pt_index = GET_PT_INDEX(ptr);
+    if (pd_addr[pd_index] & LARGE_PAGE_ENTRY) {
+        /* A 4 MB page shared by a fork is made private on a write */
+        if ((pd_addr[pd_index] & USER_MODE) && 
+            (pd_addr[pd_index] & (READ_WRITE_ENABLE | PT_COW_MODE))) {
+            return 0;
+        }
+        return ERR_INVAL;
+    }
     if (pd_addr[pd_index] != PAGE_DIR_ENTRY_DEFAULT) {
         pt_addr = (int *)GET_ADDR_FROM_ENTRY(pd_addr[pd_index]);
         if (pt_addr[pt_index] != PAGE_TABLE_ENTRY_DEFAULT) {
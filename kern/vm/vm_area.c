@@ -0,0 +1,348 @@
+/** @file vm_area.c
+ *  @brief regions of a user address space
+ *
+ *  Every page directory has a map of the regions of its address space
+ *  the task may touch: the program segments, the stack, new_pages
+ *  regions and device memory. The map is a sorted array of areas so a
+ *  lookup is a binary search.
+ *
+ *  The page fault handler looks the faulting address up, possibly with
+ *  interrupts disabled, so it cannot take the mutex. Lookups instead run
+ *  with interrupts disabled and every change to the array is made with
+ *  interrupts disabled as well. The mutex only serializes the threads
+ *  changing the map, and memory for the array is allocated outside the
+ *  interrupt disabled sections.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#include <vm/vm_area.h>
+#include <common/malloc_wrappers.h>
+#include <common/errors.h>
+#include <sync/mutex.h>
+#include <string.h>
+#include <stddef.h>
+#include <x86/asm.h>
+#include <x86/eflags.h>
+
+#define INITIAL_NUM_AREAS 8
+
+static int find_index(vm_map_t *map, unsigned int addr);
+static int grow_map(vm_map_t *map);
+static void insert_at(vm_map_t *map, int index, unsigned int start,
+                      unsigned int end, int prot, int type, void *object);
+
+/** @brief create an empty map
+ *
+ *  @return vm_map_t* the new map, NULL if out of memory
+ */
+vm_map_t *vm_map_create() {
+    vm_map_t *map = (vm_map_t *)smalloc(sizeof(vm_map_t));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->areas = (vm_area_t *)smalloc(INITIAL_NUM_AREAS * sizeof(vm_area_t));
+    if (map->areas == NULL) {
+        sfree(map, sizeof(vm_map_t));
+        return NULL;
+    }
+    map->num_areas = 0;
+    map->max_areas = INITIAL_NUM_AREAS;
+    mutex_init(&map->lock);
+    return map;
+}
+
+/** @brief free a map and all its areas
+ *
+ *  @param map the map, no longer reachable by any thread
+ *  @return void
+ */
+void vm_map_destroy(vm_map_t *map) {
+    if (map == NULL) {
+        return;
+    }
+    mutex_destroy(&map->lock);
+    sfree(map->areas, map->max_areas * sizeof(vm_area_t));
+    sfree(map, sizeof(vm_map_t));
+}
+
+/** @brief copy the areas of one map into another
+ *
+ *  @param dst a map not yet reachable by any other thread. Its areas
+ *             are replaced.
+ *  @param src the map to copy
+ *  @return int 0 on success, ERR_NOMEM if out of memory
+ */
+int vm_map_copy(vm_map_t *dst, vm_map_t *src) {
+    mutex_lock(&src->lock);
+    if (dst->max_areas < src->num_areas) {
+        vm_area_t *areas = smalloc(src->max_areas * sizeof(vm_area_t));
+        if (areas == NULL) {
+            mutex_unlock(&src->lock);
+            return ERR_NOMEM;
+        }
+        sfree(dst->areas, dst->max_areas * sizeof(vm_area_t));
+        dst->areas = areas;
+        dst->max_areas = src->max_areas;
+    }
+    memcpy(dst->areas, src->areas, src->num_areas * sizeof(vm_area_t));
+    dst->num_areas = src->num_areas;
+    mutex_unlock(&src->lock);
+    return 0;
+}
+
+/** @brief remove every area from a map
+ *
+ *  @param map the map
+ *  @return void
+ */
+void vm_map_clear(vm_map_t *map) {
+    mutex_lock(&map->lock);
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    map->num_areas = 0;
+    if (int_flag) {
+        enable_interrupts();
+    }
+    mutex_unlock(&map->lock);
+}
+
+/** @brief find the area holding an address
+ *
+ *  @param map the map
+ *  @param addr the address
+ *  @param area filled with the area found. May be NULL.
+ *  @return int 0 if an area holds the address, ERR_INVAL if not
+ */
+int vm_map_find(vm_map_t *map, unsigned int addr, vm_area_t *area) {
+    int retval = ERR_INVAL;
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int i = find_index(map, addr);
+    if (i < map->num_areas && map->areas[i].start <= addr) {
+        if (area != NULL) {
+            *area = map->areas[i];
+        }
+        retval = 0;
+    }
+    if (int_flag) {
+        enable_interrupts();
+    }
+    return retval;
+}
+
+/** @brief check if any area overlaps a range
+ *
+ *  @param map the map
+ *  @param start the start of the range
+ *  @param end the end of the range, exclusive
+ *  @return int 1 if some area overlaps the range, 0 if not
+ */
+int vm_map_overlaps(vm_map_t *map, unsigned int start, unsigned int end) {
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int i = find_index(map, start);
+    int overlaps = (i < map->num_areas && map->areas[i].start < end);
+    if (int_flag) {
+        enable_interrupts();
+    }
+    return overlaps;
+}
+
+/** @brief check if areas allowing an access cover a whole range
+ *
+ *  @param map the map
+ *  @param start the start of the range
+ *  @param end the end of the range, exclusive
+ *  @param prot the VMA_READ and VMA_WRITE access every area must allow
+ *  @return int 1 if the range is covered, 0 if not
+ */
+int vm_map_covers(vm_map_t *map, unsigned int start, unsigned int end,
+                  int prot) {
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    int i = find_index(map, start);
+    while (i < map->num_areas && map->areas[i].start <= start &&
+           (map->areas[i].prot & prot) == prot && 
+           map->areas[i].end < end) {
+        start = map->areas[i++].end;
+    }
+    int covers = (i < map->num_areas && map->areas[i].start <= start &&
+                  (map->areas[i].prot & prot) == prot);
+    if (int_flag) {
+        enable_interrupts();
+    }
+    return covers;
+}
+
+/** @brief add an area to a map
+ *
+ *  @param map the map
+ *  @param start the page aligned start of the area
+ *  @param end the page aligned end of the area, exclusive
+ *  @param prot VMA_READ and VMA_WRITE
+ *  @param type the VMA_* backing of the area
+ *  @param object what backs the area, NULL for most types
+ *  @return int 0 on success, ERR_INVAL if an area already overlaps the
+ *          range, ERR_NOMEM if out of memory
+ */
+int vm_map_insert(vm_map_t *map, unsigned int start, unsigned int end,
+                  int prot, int type, void *object) {
+    if (start >= end) {
+        return ERR_INVAL;
+    }
+    mutex_lock(&map->lock);
+    int i = find_index(map, start);
+    if (i < map->num_areas && map->areas[i].start < end) {
+        mutex_unlock(&map->lock);
+        return ERR_INVAL;
+    }
+    if (map->num_areas == map->max_areas && grow_map(map) < 0) {
+        mutex_unlock(&map->lock);
+        return ERR_NOMEM;
+    }
+    insert_at(map, i, start, end, prot, type, object);
+    mutex_unlock(&map->lock);
+    return 0;
+}
+
+/** @brief add areas covering the parts of a range not already in the map
+ *
+ *  Program segments may share a page with each other. The parts of the
+ *  range which already belong to an area are left alone.
+ *
+ *  @param map the map
+ *  @param start the page aligned start of the range
+ *  @param end the page aligned end of the range, exclusive
+ *  @param prot VMA_READ and VMA_WRITE
+ *  @param type the VMA_* backing of the new areas
+ *  @return int 0 on success, ERR_NOMEM if out of memory
+ */
+int vm_map_insert_gaps(vm_map_t *map, unsigned int start, unsigned int end,
+                       int prot, int type) {
+    mutex_lock(&map->lock);
+    while (start < end) {
+        int i = find_index(map, start);
+        if (i < map->num_areas && map->areas[i].start <= start) {
+            start = map->areas[i].end;
+            continue;
+        }
+        unsigned int gap_end = end;
+        if (i < map->num_areas && map->areas[i].start < end) {
+            gap_end = map->areas[i].start;
+        }
+        if (map->num_areas == map->max_areas && grow_map(map) < 0) {
+            mutex_unlock(&map->lock);
+            return ERR_NOMEM;
+        }
+        insert_at(map, i, start, gap_end, prot, type, NULL);
+        start = gap_end;
+    }
+    mutex_unlock(&map->lock);
+    return 0;
+}
+
+/** @brief remove an area from a map
+ *
+ *  @param map the map
+ *  @param start the start of the area
+ *  @param type the VMA_* backing the area must have
+ *  @param area filled with the area removed. May be NULL.
+ *  @return int 0 on success, ERR_INVAL if no area of that type starts at
+ *          the address
+ */
+int vm_map_remove(vm_map_t *map, unsigned int start, int type,
+                  vm_area_t *area) {
+    mutex_lock(&map->lock);
+    int i = find_index(map, start);
+    if (i >= map->num_areas || map->areas[i].start != start ||
+        map->areas[i].type != type) {
+        mutex_unlock(&map->lock);
+        return ERR_INVAL;
+    }
+    if (area != NULL) {
+        *area = map->areas[i];
+    }
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    memmove(&map->areas[i], &map->areas[i + 1],
+            (map->num_areas - i - 1) * sizeof(vm_area_t));
+    map->num_areas--;
+    if (int_flag) {
+        enable_interrupts();
+    }
+    mutex_unlock(&map->lock);
+    return 0;
+}
+
+/* ---------- Static local functions ----------- */
+
+/** @brief find the first area which ends after an address
+ *
+ *  @param map the map, which must not change during the call
+ *  @param addr the address
+ *  @return int index of the area, num_areas if there is none
+ */
+int find_index(vm_map_t *map, unsigned int addr) {
+    int lo = 0, hi = map->num_areas;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->areas[mid].end <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/** @brief double the room for areas in a map
+ *
+ *  Must be called with the map lock held.
+ *
+ *  @param map the map
+ *  @return int 0 on success, ERR_NOMEM if out of memory
+ */
+int grow_map(vm_map_t *map) {
+    int max_areas = 2 * map->max_areas;
+    vm_area_t *areas = smalloc(max_areas * sizeof(vm_area_t));
+    if (areas == NULL) {
+        return ERR_NOMEM;
+    }
+    vm_area_t *old_areas = map->areas;
+    int old_max_areas = map->max_areas;
+
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    memcpy(areas, old_areas, map->num_areas * sizeof(vm_area_t));
+    map->areas = areas;
+    map->max_areas = max_areas;
+    if (int_flag) {
+        enable_interrupts();
+    }
+    sfree(old_areas, old_max_areas * sizeof(vm_area_t));
+    return 0;
+}
+
+/** @brief insert an area at a position in the array
+ *
+ *  Must be called with the map lock held and room for one more area.
+ *
+ *  @return void
+ */
+void insert_at(vm_map_t *map, int index, unsigned int start,
+               unsigned int end, int prot, int type, void *object) {
+    int int_flag = get_eflags() & EFL_IF;
+    disable_interrupts();
+    memmove(&map->areas[index + 1], &map->areas[index],
+            (map->num_areas - index) * sizeof(vm_area_t));
+    map->areas[index].start = start;
+    map->areas[index].end = end;
+    map->areas[index].prot = prot;
+    map->areas[index].type = type;
+    map->areas[index].object = object;
+    map->num_areas++;
+    if (int_flag) {
+        enable_interrupts();
+    }
+}
@@ -0,0 +1,19 @@
+/** @file memstats.h
+ *  @brief memory usage of a task, as returned by memstats()
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+#ifndef _MEMSTATS_H
+#define _MEMSTATS_H
+
+typedef struct mem_stats {
+    int resident_pages;     /* user pages backed by a frame */
+    int shared_pages;       /* of those, pages other tasks map as well */
+    int swapped_pages;      /* pages held compressed in the swap store */
+    int page_table_pages;   /* page tables of the address space */
+    int new_pages_regions;  /* regions allocated with new_pages */
+    int new_pages_bytes;    /* bytes in those regions */
+} mem_stats_t;
+
+#endif /* _MEMSTATS_H */
@@ -93,6 +93,18 @@ void misbehave(int mode);
 typedef void (*swexn_handler_t)(void *arg, ureg_t *ureg);
 int swexn(void *esp3, swexn_handler_t eip, void *arg, ureg_t *newureg);
 
+/* Extensions, using the SYSCALL_RESERVED_* interrupts */
+#include <memstats.h>
+int memstats(mem_stats_t *stats);
+int spawn(char *execname, char *argvec[]);
+int shm_create(int key, void *base, int len);
+int shm_attach(int key, void *base);
+int shm_detach(void *base);
+int map_file(const char *filename, void *addr);
+int set_priority(int tid, int priority); /* 0 (highest) to 7 */
+unsigned long long get_time_ns(void);
+int sleep_ns(unsigned long long ns);
+
 /* Previous API */
 /*
 void exit(int status) NORETURN;
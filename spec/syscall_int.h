@@ -74,4 +74,15 @@
 #define SYSCALL_RESERVED_15       0x8F
 #define SYSCALL_RESERVED_END      0x8F
 
+/* Extensions */
+#define MEMSTATS_INT        SYSCALL_RESERVED_2
+#define SPAWN_INT           SYSCALL_RESERVED_3
+#define SHM_CREATE_INT      SYSCALL_RESERVED_4
+#define SHM_ATTACH_INT      SYSCALL_RESERVED_5
+#define SHM_DETACH_INT      SYSCALL_RESERVED_6
+#define MAP_FILE_INT        SYSCALL_RESERVED_7
+#define SET_PRIORITY_INT    SYSCALL_RESERVED_8
+#define GET_TIME_NS_INT     SYSCALL_RESERVED_9
+#define SLEEP_NS_INT        SYSCALL_RESERVED_10
+
 #endif /* _SYSCALL_INT_H */
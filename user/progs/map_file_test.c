@@ -0,0 +1,53 @@
+/** @file map_file_test.c
+ *
+ *  Test file for map_file
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define MAP_ADDR 0x40000000
+#define SECOND_MAP_ADDR 0x50000000
+#define CHUNK_SIZE 1024
+
+static char buf[CHUNK_SIZE];
+
+int main() {
+	char *file = (char *)MAP_ADDR;
+	int len, offset;
+
+	if((len = map_file("map_file_test", (void *)MAP_ADDR)) <= 0) {
+		lprintf("map_file failed");
+		return ERR_FAILURE;
+	}
+	for(offset = 0; offset < len; offset += CHUNK_SIZE) {
+		int count = readfile("map_file_test", buf, CHUNK_SIZE, offset);
+		if(count <= 0 || memcmp(file + offset, buf, count) != 0) {
+			lprintf("mapped file differs at offset %d", offset);
+			return ERR_FAILURE;
+		}
+	}
+
+	if(map_file("map_file_test", (void *)MAP_ADDR) >= 0) {
+		lprintf("map_file mapped over a mapped region");
+		return ERR_FAILURE;
+	}
+	if(map_file("no such file", (void *)SECOND_MAP_ADDR) >= 0) {
+		lprintf("map_file mapped a missing file");
+		return ERR_FAILURE;
+	}
+	if(map_file("map_file_test", (void *)SECOND_MAP_ADDR) != len ||
+	   memcmp((char *)SECOND_MAP_ADDR, file, len) != 0) {
+		lprintf("second mapping differs");
+		return ERR_FAILURE;
+	}
+
+	lprintf("map_file_test passed");
+	return 0;
+}
@@ -0,0 +1,58 @@
+/** @file memstats_test.c
+ *
+ *  Test file for memstats
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define NEW_PAGES_ADDR 0x40000000
+#define NEW_PAGES_LEN (4 * PAGE_SIZE)
+
+int main() {
+	mem_stats_t before, after;
+	int i;
+
+	if(memstats(&before) < 0) {
+		lprintf("memstats failed");
+		return ERR_FAILURE;
+	}
+	if(memstats((mem_stats_t *)0x10) >= 0) {
+		lprintf("memstats accepted a bad pointer");
+		return ERR_FAILURE;
+	}
+
+	if(new_pages((void *)NEW_PAGES_ADDR, NEW_PAGES_LEN) < 0) {
+		lprintf("new_pages failed");
+		return ERR_FAILURE;
+	}
+	for(i = 0; i < NEW_PAGES_LEN; i += PAGE_SIZE) {
+		*(char *)(NEW_PAGES_ADDR + i) = 1;
+	}
+	memstats(&after);
+	if(after.new_pages_regions != before.new_pages_regions + 1 ||
+	   after.new_pages_bytes != before.new_pages_bytes + NEW_PAGES_LEN ||
+	   after.resident_pages < before.resident_pages +
+	   						  NEW_PAGES_LEN / PAGE_SIZE) {
+		lprintf("memstats missed the new pages");
+		return ERR_FAILURE;
+	}
+
+	remove_pages((void *)NEW_PAGES_ADDR);
+	memstats(&after);
+	if(after.new_pages_regions != before.new_pages_regions ||
+	   after.new_pages_bytes != before.new_pages_bytes) {
+		lprintf("memstats missed remove_pages");
+		return ERR_FAILURE;
+	}
+
+	lprintf("resident %d shared %d swapped %d page tables %d",
+			after.resident_pages, after.shared_pages, after.swapped_pages,
+			after.page_table_pages);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/** @file priority_test.c
+ *
+ *  Test file for set_priority
+ *
+ *  A high priority parent keeps sleeping for a tick while a low priority
+ *  child spins. Each time it wakes up the parent has to get the CPU
+ *  within a tick, ahead of the child.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define LOW_PRIORITY 7
+#define HIGH_PRIORITY 0
+#define SPIN_TICKS 20
+#define SLEEP_ROUNDS 5
+#define MAX_LATE_TICKS 1
+
+int main() {
+	int tid = gettid();
+	int child_tid, status, i;
+
+	if(set_priority(tid, -1) >= 0 || set_priority(tid, 8) >= 0) {
+		lprintf("set_priority accepted a bad priority");
+		return ERR_FAILURE;
+	}
+	if(set_priority(-1, HIGH_PRIORITY) >= 0) {
+		lprintf("set_priority accepted a bad thread");
+		return ERR_FAILURE;
+	}
+
+	if((child_tid = fork()) == 0) {
+		/* A CPU bound child at the lowest priority */
+		int start = get_ticks();
+		if(set_priority(gettid(), LOW_PRIORITY) < 0) {
+			lprintf("set_priority failed in the child");
+			set_status(ERR_FAILURE);
+			vanish();
+		}
+		while(get_ticks() - start < SPIN_TICKS) {
+			continue;
+		}
+		set_status(0);
+		vanish();
+	}
+	if(child_tid < 0) {
+		lprintf("fork failed");
+		return ERR_FAILURE;
+	}
+
+	/* The child is in another task */
+	if(set_priority(child_tid, HIGH_PRIORITY) >= 0) {
+		lprintf("set_priority changed a thread of another task");
+		return ERR_FAILURE;
+	}
+
+	if(set_priority(tid, HIGH_PRIORITY) < 0) {
+		lprintf("set_priority failed");
+		return ERR_FAILURE;
+	}
+
+	/* Let the child start spinning */
+	sleep(1);
+	for(i = 0; i < SLEEP_ROUNDS; i++) {
+		int before = get_ticks();
+		sleep(1);
+		int late = get_ticks() - (before + 1);
+		if(late > MAX_LATE_TICKS) {
+			lprintf("woke up %d ticks late behind a low priority thread",
+					late);
+			return ERR_FAILURE;
+		}
+	}
+
+	if(wait(&status) != child_tid || status != 0) {
+		lprintf("the child failed");
+		return ERR_FAILURE;
+	}
+
+	lprintf("priority_test passed");
+	return 0;
+}
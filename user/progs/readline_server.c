@@ -30,16 +30,10 @@ int main(int argc, char *argv[]) {
 	ipc_state_t* buf_st;
 	if(argc == 1) {
 		/* Launch the keyboard server */
-		int server_tid = fork();
-		if(server_tid < 0) {
+		char *args[] = {keyboard_server, 0};
+		if(spawn(keyboard_server, args) < 0) {
 			return ERR_FAILURE;
 		}
-		if(!server_tid) {
-			char *args[] = {keyboard_server, 0};
-			if(exec(keyboard_server, args) < 0) {
-				return ERR_FAILURE;
-			}
-		}
 
 	    if (ipc_server_init(&server_st, UDR_READLINE_SERVER) < 0) {
         	return ERR_FAILURE;
@@ -250,15 +250,9 @@ int main(int argc, char *argv[]) {
  *	@return 0 on success. -ve number of failure
  */
 int launch_server(char *server_name, char *args[]) {
-	int server_tid = fork();
-	if(server_tid < 0) {
+	if(spawn(server_name, args) < 0) {
 		return ERR_FAILURE;
 	}
-	if(!server_tid) {
-		if(exec(server_name, args) < 0) {
-			return ERR_FAILURE;
-		}
-	}
 	return 0;
 }
 
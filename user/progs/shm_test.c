@@ -0,0 +1,65 @@
+/** @file shm_test.c
+ *
+ *  Test file for shared memory segments
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define SHM_KEY 410
+#define SHM_ADDR 0x40000000
+#define SHM_ATTACH_ADDR 0x50000000
+#define SHM_LEN (2 * PAGE_SIZE)
+
+int main() {
+	volatile char *shm = (char *)SHM_ADDR;
+	int status;
+
+	if(shm_create(SHM_KEY, (void *)SHM_ADDR, SHM_LEN) < 0) {
+		lprintf("shm_create failed");
+		return ERR_FAILURE;
+	}
+	if(shm_create(SHM_KEY, (void *)SHM_ATTACH_ADDR, SHM_LEN) >= 0) {
+		lprintf("shm_create accepted a key in use");
+		return ERR_FAILURE;
+	}
+
+	if(fork() == 0) {
+		volatile char *attached = (char *)SHM_ATTACH_ADDR;
+		/* The mapping inherited through fork is still shared */
+		shm[0] = 42;
+		if(shm_attach(SHM_KEY, (void *)SHM_ATTACH_ADDR) != SHM_LEN) {
+			lprintf("shm_attach failed");
+			vanish();
+		}
+		attached[PAGE_SIZE] = 7;
+		set_status(0);
+		vanish();
+	}
+	wait(&status);
+	if(shm[0] != 42 || shm[PAGE_SIZE] != 7) {
+		lprintf("writes of the child are not visible");
+		return ERR_FAILURE;
+	}
+
+	if(shm_detach((void *)SHM_ADDR) < 0) {
+		lprintf("shm_detach failed");
+		return ERR_FAILURE;
+	}
+	if(shm_detach((void *)SHM_ADDR) >= 0) {
+		lprintf("shm_detach accepted an unmapped base");
+		return ERR_FAILURE;
+	}
+	if(shm_attach(SHM_KEY, (void *)SHM_ADDR) >= 0) {
+		lprintf("segment outlived its last mapping");
+		return ERR_FAILURE;
+	}
+
+	lprintf("shm_test passed");
+	return 0;
+}
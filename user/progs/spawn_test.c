@@ -0,0 +1,64 @@
+/** @file spawn_test.c
+ *
+ *  Test file for spawn
+ *
+ *  Bad arguments have to be rejected. A good spawn starts this program 
+ *  again in a new task, which exits with a known status.
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define CHILD_ARG "child"
+#define CHILD_STATUS 42
+#define TOO_MANY_ARGS 17    /* One more than the kernel takes */
+#define KERNEL_ADDR ((void *)0x100000)
+
+int main(int argc, char *argv[]) {
+	char *child_argv[] = { "spawn_test", CHILD_ARG, NULL };
+	char *long_argv[TOO_MANY_ARGS + 1];
+	int pid, status, i;
+
+	if(argc == 2 && strcmp(argv[1], CHILD_ARG) == 0) {
+		return CHILD_STATUS;
+	}
+
+	if(spawn("no_such_program", child_argv) >= 0) {
+		lprintf("spawn accepted a missing program");
+		return ERR_FAILURE;
+	}
+	if(spawn(KERNEL_ADDR, child_argv) >= 0) {
+		lprintf("spawn accepted a bad execname pointer");
+		return ERR_FAILURE;
+	}
+	if(spawn("spawn_test", KERNEL_ADDR) >= 0) {
+		lprintf("spawn accepted a bad argv pointer");
+		return ERR_FAILURE;
+	}
+	for(i = 0; i < TOO_MANY_ARGS; i++) {
+		long_argv[i] = "spawn_test";
+	}
+	long_argv[TOO_MANY_ARGS] = NULL;
+	if(spawn("spawn_test", long_argv) >= 0) {
+		lprintf("spawn accepted too many arguments");
+		return ERR_FAILURE;
+	}
+
+	if((pid = spawn("spawn_test", child_argv)) < 0) {
+		lprintf("spawn failed");
+		return ERR_FAILURE;
+	}
+	if(wait(&status) != pid || status != CHILD_STATUS) {
+		lprintf("the spawned task did not exit with %d", CHILD_STATUS);
+		return ERR_FAILURE;
+	}
+
+	lprintf("spawn_test passed");
+	return 0;
+}
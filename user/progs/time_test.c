@@ -0,0 +1,54 @@
+/** @file time_test.c
+ *
+ *  Test file for get_time_ns and sleep_ns
+ *
+ *  @author Rohit Upadhyaya (rjupadhy)
+ *  @author Prajwal Yadapadithaya (pyadapad)
+ */
+
+#include <stdio.h>
+#include <errors.h>
+#include <syscall.h>
+#include <simics.h>
+
+#define NS_PER_MS 1000000ULL
+#define SHORT_SLEEP_NS (2 * NS_PER_MS)      /* Below a tick */
+#define LONG_SLEEP_NS (35 * NS_PER_MS)      /* A few ticks */
+#define TICK_NS (10 * NS_PER_MS)
+
+int main() {
+	unsigned long long start, end;
+	int ticks;
+
+	start = get_time_ns();
+	end = get_time_ns();
+	if(end < start) {
+		lprintf("get_time_ns went backwards");
+		return ERR_FAILURE;
+	}
+
+	start = get_time_ns();
+	sleep_ns(SHORT_SLEEP_NS);
+	end = get_time_ns();
+	if(end - start < SHORT_SLEEP_NS) {
+		lprintf("sleep_ns woke up early");
+		return ERR_FAILURE;
+	}
+
+	ticks = get_ticks();
+	start = get_time_ns();
+	sleep_ns(LONG_SLEEP_NS);
+	end = get_time_ns();
+	if(end - start < LONG_SLEEP_NS || 
+	   end - start > LONG_SLEEP_NS + 2 * TICK_NS) {
+		lprintf("sleep_ns slept %u us", (unsigned int)((end - start) / 1000));
+		return ERR_FAILURE;
+	}
+	if(get_ticks() - ticks < LONG_SLEEP_NS / TICK_NS) {
+		lprintf("get_time_ns disagrees with get_ticks");
+		return ERR_FAILURE;
+	}
+
+	lprintf("time_test passed");
+	return 0;
+}